@@ -0,0 +1,174 @@
+#include "batch.h"
+#include "logger.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <json/json.h>
+#include <sstream>
+
+namespace batch {
+
+Batch::Batch(std::vector<Item> items, const http::Headers &headers,
+             const size_t parallelism, scheduler::Scheduler *scheduler,
+             cache::ResponseCache *cache)
+    : items_(std::move(items)), scheduler_(scheduler), cache_(cache),
+      next_(0), cancelled_(false), done_(0) {
+  for (const std::string &line : headers.lines()) {
+    headers_.AppendHeaderLine(line);
+  }
+  const size_t threads =
+      std::min(std::max<size_t>(parallelism, 1), items_.size());
+  for (size_t idx = 0; idx < threads; ++idx) {
+    threads_.emplace_back(&Batch::Run, this);
+  }
+}
+
+Batch::~Batch() {
+  cancelled_ = true;
+  for (std::thread &thread : threads_) {
+    thread.join();
+  }
+}
+
+void Batch::Run() {
+  for (size_t idx = next_++; idx < items_.size() && !cancelled_;
+       idx = next_++) {
+    const Item &item = items_[idx];
+    if (item.url.empty()) {
+      Append(item, 0, "", "No such resource");
+      continue;
+    }
+    const std::string key = http::NormalizeUrl(item.url);
+    if (const auto cached = cache_->Find(key)) {
+      Append(item, cached->http_code, std::string(cached->body.view()), "");
+      continue;
+    }
+    http::Request request(rest::constants::GET, headers_);
+    request.set_cancelled(&cancelled_);
+    const http::Response response = scheduler_->Fetch(
+        scheduler::INTERACTIVE, item.endpoint, request, item.url);
+    if (response.curl_code != CURLE_OK) {
+      Append(item, 0, "", curl_easy_strerror(response.curl_code));
+      continue;
+    }
+    std::string body = response.data.str();
+    if (response.http_code != 200) {
+      // Lines with an error have no body, even when the response had none.
+      Append(item, response.http_code, "",
+             body.empty() ? "HTTP " + std::to_string(response.http_code)
+                          : body);
+      continue;
+    }
+    const auto etag_it = response.headers.find("etag");
+    const auto entry = cache_->Insert(
+        key, response.http_code, std::move(body),
+        (etag_it == response.headers.end()) ? "" : etag_it->second);
+    Append(item, response.http_code, std::string(entry->body.view()), "");
+  }
+}
+
+void Batch::Append(const Item &item, const int status, const std::string &body,
+                   const std::string &error) {
+  Json::Value line;
+  line["id"] = item.id;
+  line["status"] = status;
+  if (!error.empty()) {
+    line["error"] = error;
+  } else {
+    // Bodies that are not JSON are kept as strings.
+    Json::CharReaderBuilder reader_builder;
+    const std::unique_ptr<Json::CharReader> reader(
+        reader_builder.newCharReader());
+    if (!reader->parse(body.data(), body.data() + body.length(), &line["body"],
+                       nullptr)) {
+      line["body"] = body;
+    }
+  }
+  Json::StreamWriterBuilder writer_builder;
+  writer_builder["indentation"] = "";
+  const std::string text = Json::writeString(writer_builder, line) + "\n";
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    output_ += text;
+    ++done_;
+  }
+  cv_.notify_all();
+}
+
+size_t Batch::Read(char *buf, const size_t size, const off_t offset) {
+  const trace::Span span("batch_wait");
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this, offset]() {
+    return output_.size() > size_t(offset) || done_ == items_.size();
+  });
+  if (size_t(offset) >= output_.size()) {
+    return 0;
+  }
+  const size_t length = std::min(size, output_.size() - offset);
+  memcpy(buf, output_.data() + offset, length);
+  return length;
+}
+
+void Table::Write(const std::string &path, const std::string_view data,
+                  const off_t offset) {
+  std::shared_ptr<Batch> previous;
+  std::lock_guard<std::mutex> lock(mutex_);
+  File &file = files_[path];
+  if (file.ids.size() < offset + data.size()) {
+    file.ids.resize(offset + data.size());
+  }
+  file.ids.replace(offset, data.size(), data);
+  // Destroyed once unlocked: it waits for its requests to wind down.
+  previous = std::move(file.batch);
+}
+
+void Table::Truncate(const std::string &path, const off_t size) {
+  std::shared_ptr<Batch> previous;
+  std::lock_guard<std::mutex> lock(mutex_);
+  File &file = files_[path];
+  file.ids.resize(size);
+  previous = std::move(file.batch);
+}
+
+std::shared_ptr<Batch> Table::Get(const std::string &path,
+                                  const Start &start) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  File &file = files_[path];
+  if (file.batch == nullptr) {
+    std::vector<std::string> ids;
+    std::istringstream lines(file.ids);
+    for (std::string line; std::getline(lines, line);) {
+      const size_t begin = line.find_first_not_of(" \t\r");
+      if (begin == line.npos) {
+        continue;
+      }
+      const size_t end = line.find_last_not_of(" \t\r");
+      ids.push_back(line.substr(begin, end - begin + 1));
+    }
+    file.batch = start(ids);
+  }
+  return file.batch;
+}
+
+void Table::Open(const std::string &path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++files_[path].handles;
+}
+
+void Table::Release(const std::string &path) {
+  std::shared_ptr<Batch> previous;
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = files_.find(path);
+  if (it == files_.end() || it->second.handles == 0 ||
+      --it->second.handles > 0) {
+    return;
+  }
+  // Destroyed once unlocked, as in Write.
+  previous = std::move(it->second.batch);
+  if (it->second.ids.empty()) {
+    files_.erase(it);
+  }
+}
+
+} // namespace batch
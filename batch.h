@@ -0,0 +1,114 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "cache.h"
+#include "http.h"
+#include "scheduler.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Batch files read many resources in one go. A GET operation with a single
+// path parameter, such as /v2/orders/{soid}/get.json, gets a batch file next
+// to its parameter: /v2/orders/batch.get.ndjson. Writing IDs to it, one per
+// line, and reading it back sends all the GETs concurrently and reads one
+// NDJSON line per ID, in completion order:
+//
+//   {"body":{...},"id":"42","status":200}
+//   {"error":"...","id":"43","status":404}
+namespace batch {
+
+struct Item final {
+  std::string id;
+  // Empty when the ID does not name a resource.
+  std::string url;
+  // Path template of `url`, as the scheduler groups requests.
+  std::string endpoint;
+};
+
+// The GETs of a batch, sent by up to `parallelism` threads through the
+// scheduler and the response cache.
+class Batch final {
+public:
+  Batch(std::vector<Item> items, const http::Headers &headers,
+        const size_t parallelism, scheduler::Scheduler *scheduler,
+        cache::ResponseCache *cache);
+  Batch(const Batch &) = delete;
+  Batch &operator=(const Batch &) = delete;
+  // Cancels the requests in flight and waits for the threads.
+  ~Batch();
+
+  // Copies the output past `offset` to `buf`, waiting until there is some.
+  // Returns 0 once every item was read.
+  size_t Read(char *buf, const size_t size, const off_t offset);
+
+private:
+  void Run();
+  void Append(const Item &item, const int status, const std::string &body,
+              const std::string &error);
+
+  const std::vector<Item> items_;
+  // A copy: the mount may be reloaded while the batch runs.
+  http::Headers headers_;
+  scheduler::Scheduler *const scheduler_;
+  cache::ResponseCache *const cache_;
+
+  std::atomic<size_t> next_;
+  std::atomic<bool> cancelled_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::string output_;
+  size_t done_;
+  std::vector<std::thread> threads_;
+};
+
+// The IDs written to every batch file and the batch last read from it. The
+// results of a batch, every body included, are dropped once the last handle
+// of its file is released.
+class Table final {
+public:
+  using Start =
+      std::function<std::unique_ptr<Batch>(const std::vector<std::string> &)>;
+
+  Table() {}
+  Table(const Table &) = delete;
+  Table &operator=(const Table &) = delete;
+
+  // Writes to the IDs of `path`, dropping the results read before.
+  void Write(const std::string &path, const std::string_view data,
+             const off_t offset);
+  void Truncate(const std::string &path, const off_t size);
+
+  // Returns the batch of the IDs written to `path`, started by `start` on the
+  // first read after they were written. Reading again gives the same lines
+  // while a handle of `path` stays open.
+  std::shared_ptr<Batch> Get(const std::string &path, const Start &start);
+
+  // Called as handles of `path` are opened and released. Releasing the last
+  // one drops the results read, and forgets `path` once it holds no IDs.
+  // Paths never opened are ignored.
+  void Open(const std::string &path);
+  void Release(const std::string &path);
+
+private:
+  struct File final {
+    std::string ids;
+    std::shared_ptr<Batch> batch;
+    size_t handles = 0;
+  };
+
+  std::mutex mutex_;
+  std::map<std::string, File> files_;
+};
+
+} // namespace batch
+
+#endif
@@ -0,0 +1,147 @@
+#include "breaker.h"
+#include "logger.h"
+
+namespace breaker {
+
+// Failures of the endpoint rather than of the request.
+static bool IsOutage(const http::Response &response) {
+  return response.curl_code != CURLE_OK || response.http_code >= 500;
+}
+
+// Failures worth answering again, rather than retrying. Throttled requests
+// are already held back by the scheduler.
+static bool IsRemembered(const http::Response &response) {
+  return response.curl_code != CURLE_OK ||
+         (response.http_code >= 400 && response.http_code != 429);
+}
+
+static Failure FailureOf(const http::Response &response) {
+  return {response.curl_code, response.http_code, response.data.str()};
+}
+
+std::optional<Failure> Breakers::Check(const std::string &endpoint,
+                                       const std::string &url,
+                                       const bool read) {
+  const Clock::time_point now = Clock::now();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (read) {
+    const auto it = negative_urls_.find(url);
+    if (it != negative_urls_.end()) {
+      if (it->second->second.expires > now) {
+        ++negative_hits_;
+        return it->second->second.failure;
+      }
+      Forget(url);
+    }
+  }
+  if (options_.failure_threshold <= 0) {
+    return std::nullopt;
+  }
+  const auto it = circuits_.find(endpoint);
+  if (it == circuits_.end()) {
+    return std::nullopt;
+  }
+  Circuit &circuit = it->second;
+  if (circuit.state == OPEN && circuit.open_until <= now) {
+    circuit.state = HALF_OPEN;
+  }
+  if (circuit.state == CLOSED ||
+      (circuit.state == HALF_OPEN && !circuit.probing)) {
+    circuit.probing = circuit.state == HALF_OPEN;
+    return std::nullopt;
+  }
+  ++rejected_;
+  return circuit.failure;
+}
+
+void Breakers::Record(const std::string &endpoint, const std::string &url,
+                      const bool read, const http::Response &response) {
+  // Cancelled requests tell nothing about the endpoint.
+  const bool cancelled = response.curl_code == CURLE_ABORTED_BY_CALLBACK;
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!cancelled && options_.negative_ttl.count() > 0) {
+    if (read && IsRemembered(response)) {
+      Remember(url, FailureOf(response));
+    } else if (!read && response.curl_code == CURLE_OK &&
+               response.http_code < 400) {
+      // Writes may create what was missing.
+      Forget(url);
+    }
+  }
+  if (options_.failure_threshold <= 0) {
+    return;
+  }
+  Circuit &circuit = circuits_[endpoint];
+  const bool probe = circuit.state == HALF_OPEN && circuit.probing;
+  if (probe) {
+    circuit.probing = false;
+  }
+  if (cancelled) {
+    return;
+  }
+  if (!IsOutage(response)) {
+    if (circuit.state != CLOSED) {
+      LOG(INFO) << "Closing the circuit of " << endpoint;
+    }
+    circuit.state = CLOSED;
+    circuit.failures = 0;
+    return;
+  }
+  ++circuit.failures;
+  // A failed probe opens the circuit again at once.
+  if (probe || (circuit.state == CLOSED &&
+                circuit.failures >= options_.failure_threshold)) {
+    LOG(WARNING) << "Opening the circuit of " << endpoint << " after "
+                 << circuit.failures << " failures";
+    circuit.state = OPEN;
+    circuit.open_until = Clock::now() + options_.open_duration;
+    circuit.failure = FailureOf(response);
+    ++circuit.opened;
+  }
+}
+
+void Breakers::Remember(const std::string &url, Failure failure) {
+  Forget(url);
+  while (!negatives_.empty() &&
+         negatives_.size() >= options_.negative_entries) {
+    negative_urls_.erase(negatives_.front().first);
+    negatives_.pop_front();
+  }
+  if (options_.negative_entries == 0) {
+    return;
+  }
+  negatives_.emplace_back(
+      url, Negative{std::move(failure), Clock::now() + options_.negative_ttl});
+  negative_urls_.emplace(url, std::prev(negatives_.end()));
+}
+
+void Breakers::Forget(const std::string &url) {
+  const auto it = negative_urls_.find(url);
+  if (it == negative_urls_.end()) {
+    return;
+  }
+  negatives_.erase(it->second);
+  negative_urls_.erase(it);
+}
+
+Json::Value Breakers::Metrics() const {
+  static const char *const STATE_NAMES[] = {"closed", "open", "half_open"};
+  std::lock_guard<std::mutex> lock(mutex_);
+  Json::Value metrics;
+  metrics["failure_threshold"] = options_.failure_threshold;
+  metrics["open_ms"] = Json::Int64(options_.open_duration.count());
+  metrics["rejected"] = Json::UInt64(rejected_);
+  metrics["negative_ttl_ms"] = Json::Int64(options_.negative_ttl.count());
+  metrics["negative_entries"] = Json::UInt64(negatives_.size());
+  metrics["negative_hits"] = Json::UInt64(negative_hits_);
+  metrics["circuits"] = Json::Value(Json::objectValue);
+  for (const auto &[endpoint, circuit] : circuits_) {
+    Json::Value &value = metrics["circuits"][endpoint];
+    value["state"] = STATE_NAMES[circuit.state];
+    value["failures"] = circuit.failures;
+    value["opened"] = Json::UInt64(circuit.opened);
+  }
+  return metrics;
+}
+
+} // namespace breaker
@@ -0,0 +1,98 @@
+#ifndef BREAKER_H
+#define BREAKER_H
+
+#include "http.h"
+
+#include <chrono>
+#include <json/json.h>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+// Keeps broken upstreams from being hammered, and from slowing down reads of
+// the healthy ones.
+//
+// Every endpoint has a circuit breaker. Once enough requests in a row fail,
+// by transport errors or 5xx responses, the circuit opens: requests to the
+// endpoint fail right away with the failure that opened it. After a while
+// one request is let through, and the circuit closes again once one
+// succeeds.
+//
+// Failed reads are also remembered per URL for a short while, 404s
+// included, so that tools retrying them get the same answer without a
+// request.
+namespace breaker {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options final {
+  // Failures in a row that open the circuit of an endpoint. 0 disables the
+  // circuits.
+  int failure_threshold;
+  // How long an open circuit fails requests before letting one through.
+  std::chrono::milliseconds open_duration;
+  // How long failed reads are remembered. 0 disables it.
+  std::chrono::milliseconds negative_ttl;
+  // Failed reads remembered at most, oldest dropped first.
+  size_t negative_entries;
+};
+
+// What a failed request got, given to the requests failed in its place.
+struct Failure final {
+  CURLcode curl_code;
+  int http_code;
+  std::string body;
+};
+
+class Breakers final {
+public:
+  explicit Breakers(const Options &options)
+      : options_(options), rejected_(0), negative_hits_(0) {}
+  Breakers(const Breakers &) = delete;
+  Breakers &operator=(const Breakers &) = delete;
+
+  // Returns the failure to answer a request to `url` of `endpoint` with, or
+  // std::nullopt to send it. `read` requests may be answered by a remembered
+  // failure of the same URL. Every request that is sent must be recorded.
+  std::optional<Failure> Check(const std::string &endpoint,
+                               const std::string &url, const bool read);
+  void Record(const std::string &endpoint, const std::string &url,
+              const bool read, const http::Response &response);
+
+  Json::Value Metrics() const;
+
+private:
+  enum State { CLOSED, OPEN, HALF_OPEN };
+  struct Circuit final {
+    State state = CLOSED;
+    int failures = 0;
+    Clock::time_point open_until;
+    // Whether the request let through a half-open circuit is in flight.
+    bool probing = false;
+    Failure failure;
+    size_t opened = 0;
+  };
+  struct Negative final {
+    Failure failure;
+    Clock::time_point expires;
+  };
+  using Negatives = std::list<std::pair<std::string, Negative>>;
+
+  // Must hold `mutex_`.
+  void Remember(const std::string &url, Failure failure);
+  void Forget(const std::string &url);
+
+  const Options options_;
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, Circuit> circuits_;
+  Negatives negatives_; // Oldest first.
+  std::unordered_map<std::string, Negatives::iterator> negative_urls_;
+  size_t rejected_;
+  size_t negative_hits_;
+};
+
+} // namespace breaker
+
+#endif
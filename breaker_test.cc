@@ -0,0 +1,86 @@
+#include "breaker.h"
+#include "logger.h"
+
+#include <thread>
+
+static http::Response Response(const CURLcode curl_code, const int http_code) {
+  http::Response response;
+  response.curl_code = curl_code;
+  response.http_code = http_code;
+  response.data << "body " << http_code;
+  return response;
+}
+
+int main(int argc, char *argv[]) {
+  breaker::Breakers breakers({
+      .failure_threshold = 3,
+      .open_duration = std::chrono::milliseconds(50),
+      .negative_ttl = std::chrono::milliseconds(200),
+      .negative_entries = 2,
+  });
+  const http::Response unavailable = Response(CURLE_OK, 503);
+  const http::Response ok = Response(CURLE_OK, 200);
+
+  // Three failures in a row open the circuit of the endpoint.
+  breakers.Record("e", "u1", false, unavailable);
+  breakers.Record("e", "u2", false, unavailable);
+  CHECK(!breakers.Check("e", "u3", false).has_value());
+  breakers.Record("e", "u3", false, Response(CURLE_OPERATION_TIMEDOUT, -1));
+  const auto failure = breakers.Check("e", "u4", false);
+  CHECK(failure.has_value());
+  CHECK(failure->curl_code == CURLE_OPERATION_TIMEDOUT);
+  CHECK(!breakers.Check("other", "u4", false).has_value());
+
+  // Then one request is let through, and closes it when it succeeds.
+  std::this_thread::sleep_for(std::chrono::milliseconds(60));
+  CHECK(!breakers.Check("e", "u5", false).has_value());
+  CHECK(breakers.Check("e", "u6", false).has_value());
+  breakers.Record("e", "u5", false, ok);
+  CHECK(!breakers.Check("e", "u6", false).has_value());
+
+  // A failed probe opens it again at once.
+  for (int idx = 0; idx < 3; ++idx) {
+    breakers.Record("e", "u", false, unavailable);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(60));
+  CHECK(!breakers.Check("e", "u", false).has_value());
+  breakers.Record("e", "u", false, unavailable);
+  CHECK(breakers.Check("e", "u", false).has_value());
+
+  // Errors of the requests themselves, and cancellations, are no outage.
+  for (int idx = 0; idx < 5; ++idx) {
+    breakers.Record("f", "missing", false, Response(CURLE_OK, 404));
+    breakers.Record("f", "u", false, Response(CURLE_ABORTED_BY_CALLBACK, -1));
+  }
+  CHECK(!breakers.Check("f", "u", false).has_value());
+
+  // Failed reads are answered again, 404s included, until they expire.
+  breakers.Record("g", "gone", true, Response(CURLE_OK, 404));
+  const auto negative = breakers.Check("g", "gone", true);
+  CHECK(negative.has_value() && negative->http_code == 404);
+  CHECK(negative->body == "body 404");
+  CHECK(!breakers.Check("g", "gone", false).has_value());
+  CHECK(!breakers.Check("g", "throttled", true).has_value());
+  breakers.Record("g", "throttled", true, Response(CURLE_OK, 429));
+  CHECK(!breakers.Check("g", "throttled", true).has_value());
+  std::this_thread::sleep_for(std::chrono::milliseconds(210));
+  CHECK(!breakers.Check("g", "gone", true).has_value());
+
+  // Successful writes forget them, and the oldest go first.
+  breakers.Record("g", "a", true, Response(CURLE_OK, 404));
+  breakers.Record("g", "a", false, Response(CURLE_OK, 201));
+  CHECK(!breakers.Check("g", "a", true).has_value());
+  breakers.Record("g", "a", true, Response(CURLE_OK, 404));
+  breakers.Record("g", "b", true, Response(CURLE_OK, 404));
+  breakers.Record("g", "c", true, Response(CURLE_OK, 404));
+  CHECK(!breakers.Check("g", "a", true).has_value());
+  CHECK(breakers.Check("g", "c", true).has_value());
+
+  CHECK(http::ErrnoOf(ok) == 0);
+  CHECK(http::ErrnoOf(Response(CURLE_OK, 404)) == ENOENT);
+  CHECK(http::ErrnoOf(Response(CURLE_OK, 403)) == EACCES);
+  CHECK(http::ErrnoOf(Response(CURLE_OPERATION_TIMEDOUT, -1)) == ETIMEDOUT);
+  CHECK(http::ErrnoOf(Response(CURLE_COULDNT_CONNECT, -1)) == EIO);
+  CHECK(http::ErrnoOf(unavailable) == EIO);
+  return 0;
+}
@@ -0,0 +1,549 @@
+#include "cache.h"
+#include "logger.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cache {
+
+static bool WriteAll(const int fd, const std::string_view data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    const ssize_t n = write(fd, data.data() + written, data.size() - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    written += n;
+  }
+  return true;
+}
+
+// Writes `data` to a new temporary file next to `path`, to be renamed to
+// it. Returns the name of the file, or nullopt when it can't be written.
+static std::optional<std::string> WriteTemp(const std::string &path,
+                                            const std::string_view data) {
+  std::string temp = path + ".XXXXXX";
+  const int fd = mkostemp(temp.data(), O_CLOEXEC);
+  if (fd < 0) {
+    LOG(WARNING) << "Cannot create " << temp << ": " << strerror(errno);
+    return std::nullopt;
+  }
+  bool written = WriteAll(fd, data) && fdatasync(fd) == 0;
+  written = (close(fd) == 0) && written;
+  if (!written) {
+    LOG(WARNING) << "Cannot write " << temp << ": " << strerror(errno);
+    unlink(temp.c_str());
+    return std::nullopt;
+  }
+  return temp;
+}
+
+// Moves `temp` written by WriteTemp to `path`.
+static bool RenameTemp(const std::string &temp, const std::string &path) {
+  if (rename(temp.c_str(), path.c_str()) != 0) {
+    LOG(WARNING) << "Cannot write " << path << ": " << strerror(errno);
+    unlink(temp.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Replaces the file at `path` with `data` through a temporary file, so that
+// readers and crashes see either the old or the new contents.
+static bool WriteFile(const std::string &path, const std::string_view data) {
+  const std::optional<std::string> temp = WriteTemp(path, data);
+  return temp.has_value() && RenameTemp(*temp, path);
+}
+
+Body Body::Sealed(std::string contents) {
+  if (contents.size() < SEALED_MIN_BYTES) {
+    return Body(std::move(contents));
+  }
+  const int fd = memfd_create("restfs-body", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    LOG(WARNING) << "memfd_create failed: " << strerror(errno);
+    return Body(std::move(contents));
+  }
+  if (!WriteAll(fd, contents)) {
+    LOG(WARNING) << "memfd write failed: " << strerror(errno);
+    close(fd);
+    return Body(std::move(contents));
+  }
+  // Sealed before mapping: shared mappings keep writes from being sealed.
+  if (fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+    LOG(WARNING) << "memfd seal failed: " << strerror(errno);
+    close(fd);
+    return Body(std::move(contents));
+  }
+  void *map = mmap(nullptr, contents.size(), PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    LOG(WARNING) << "memfd mmap failed: " << strerror(errno);
+    close(fd);
+    return Body(std::move(contents));
+  }
+  return Body(fd, map, contents.size());
+}
+
+std::optional<Body> Body::Open(const std::string &path) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return std::nullopt;
+  }
+  struct stat stat;
+  if (fstat(fd, &stat) != 0) {
+    close(fd);
+    return std::nullopt;
+  }
+  const size_t size = stat.st_size;
+  if (size < SEALED_MIN_BYTES) {
+    std::string contents(size, '\0');
+    size_t read = 0;
+    while (read < size) {
+      const ssize_t n = pread(fd, contents.data() + read, size - read, read);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        close(fd);
+        return std::nullopt;
+      }
+      read += n;
+    }
+    close(fd);
+    return Body(std::move(contents));
+  }
+  void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    close(fd);
+    return std::nullopt;
+  }
+  return Body(fd, map, size);
+}
+
+Body::Body(Body &&other)
+    : contents_(std::move(other.contents_)), fd_(other.fd_), map_(other.map_),
+      size_(other.size_) {
+  other.fd_ = -1;
+  other.map_ = nullptr;
+  other.size_ = 0;
+}
+
+Body::~Body() {
+  if (fd_ >= 0) {
+    munmap(const_cast<void *>(map_), size_);
+    close(fd_);
+  }
+}
+
+// Cached sealed bodies, which each hold a descriptor for as long as they are
+// cached. Bodies past them are kept in memory, leaving most of the default
+// soft RLIMIT_NOFILE of 1024 to sockets, inotify and the journal.
+constexpr size_t MAX_SEALED_ENTRIES = 256;
+
+// Bookkeeping charged to every entry on top of its URL and body.
+constexpr size_t ENTRY_OVERHEAD = sizeof(Entry) + 64;
+
+static size_t Cost(const std::string &url, const Entry &entry) {
+  return url.length() + entry.body.size() + ENTRY_OVERHEAD;
+}
+
+bool ResponseCache::SealedFull() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return sealed_ >= MAX_SEALED_ENTRIES;
+}
+
+void ResponseCache::Erase(const Lru::iterator it) {
+  bytes_ -= Cost(it->first, *it->second);
+  sealed_ -= it->second->body.fd() >= 0;
+  entries_.erase(it->first);
+  lru_.erase(it);
+}
+
+std::shared_ptr<const Entry> ResponseCache::Find(const std::string &url) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = entries_.find(url);
+  if (it == entries_.end()) {
+    ++misses_;
+    return nullptr;
+  }
+  if (it->second->second->expires <= Clock::now()) {
+    Erase(it->second);
+    ++misses_;
+    return nullptr;
+  }
+  lru_.splice(lru_.begin(), lru_, it->second);
+  ++hits_;
+  return it->second->second;
+}
+
+bool ResponseCache::Contains(const std::string &url) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = entries_.find(url);
+  return it != entries_.end() && it->second->second->expires > Clock::now();
+}
+
+std::shared_ptr<const Entry> ResponseCache::Insert(const std::string &url,
+                                                   const int http_code,
+                                                   std::string body,
+                                                   std::string etag) {
+  if (!enabled() || url.length() + body.size() + ENTRY_OVERHEAD > max_bytes_) {
+    return std::make_shared<const Entry>(Entry{
+        http_code, Body(std::move(body)), Clock::now(), std::move(etag)});
+  }
+  auto entry = std::make_shared<const Entry>(
+      Entry{http_code,
+            SealedFull() ? Body(std::move(body))
+                         : Body::Sealed(std::move(body)),
+            Clock::now() + ttl_, std::move(etag)});
+  Insert(url, entry);
+  return entry;
+}
+
+void ResponseCache::Insert(const std::string &url,
+                           std::shared_ptr<const Entry> entry) {
+  const size_t cost = Cost(url, *entry);
+  if (!enabled() || cost > max_bytes_ || entry->expires <= Clock::now()) {
+    return;
+  }
+  if (entry->body.fd() >= 0 && SealedFull()) {
+    // Copied, such as a body mapped from disk: the caller's entry keeps the
+    // descriptor only as long as it is used.
+    entry = std::make_shared<const Entry>(
+        Entry{entry->http_code, Body(std::string(entry->body.view())),
+              entry->expires, entry->etag});
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (entry->body.fd() >= 0 && sealed_ >= MAX_SEALED_ENTRIES) {
+    // Others sealed theirs meanwhile.
+    return;
+  }
+  const auto it = entries_.find(url);
+  if (it != entries_.end()) {
+    Erase(it->second);
+  }
+  while (bytes_ + cost > max_bytes_) {
+    Erase(std::prev(lru_.end()));
+    ++evictions_;
+  }
+  sealed_ += entry->body.fd() >= 0;
+  lru_.emplace_front(url, std::move(entry));
+  entries_.emplace(url, lru_.begin());
+  bytes_ += cost;
+}
+
+void ResponseCache::Remove(const std::string &url) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = entries_.find(url);
+  if (it != entries_.end()) {
+    Erase(it->second);
+  }
+}
+
+Json::Value ResponseCache::Metrics() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Json::Value metrics;
+  metrics["max_bytes"] = Json::UInt64(max_bytes_);
+  metrics["ttl_seconds"] = Json::Int64(ttl_.count());
+  metrics["bytes"] = Json::UInt64(bytes_);
+  metrics["entries"] = Json::UInt64(entries_.size());
+  metrics["sealed_entries"] = Json::UInt64(sealed_);
+  metrics["max_sealed_entries"] = Json::UInt64(MAX_SEALED_ENTRIES);
+  metrics["hits"] = Json::UInt64(hits_);
+  metrics["misses"] = Json::UInt64(misses_);
+  metrics["evictions"] = Json::UInt64(evictions_);
+  return metrics;
+}
+
+// Names files that outlive the process, so unlike std::hash it must not
+// change between builds. FNV-1a.
+static uint64_t UrlKey(const std::string &url) {
+  uint64_t key = 14695981039346656037ull;
+  for (const unsigned char c : url) {
+    key = (key ^ c) * 1099511628211ull;
+  }
+  return key;
+}
+
+static int64_t SecondsSinceEpoch() {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+constexpr char INDEX_HEADER[] = "restfs-disk-cache 1";
+constexpr char INDEX_NAME[] = "index";
+constexpr char BODY_SUFFIX[] = ".body";
+constexpr size_t KEY_DIGITS = 16;
+constexpr std::chrono::seconds INDEX_SAVE_INTERVAL(1);
+
+DiskCache::DiskCache(const std::string &directory, const size_t max_bytes,
+                     const std::chrono::seconds ttl)
+    : directory_(directory), max_bytes_(max_bytes), ttl_(ttl), bytes_(0),
+      next_version_(0), dirty_(false), saved_(), hits_(0), stale_(0),
+      misses_(0), revalidated_(0), evictions_(0), write_errors_(0) {}
+
+DiskCache::~DiskCache() {
+  std::optional<std::string> index;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    index = IndexIfDue(true);
+  }
+  if (index.has_value()) {
+    WriteIndex(*index);
+  }
+}
+
+std::string DiskCache::BodyPath(const uint64_t key) const {
+  char name[KEY_DIGITS + sizeof(BODY_SUFFIX)];
+  snprintf(name, sizeof(name), "%016llx%s", (unsigned long long)key,
+           BODY_SUFFIX);
+  return directory_ + "/" + name;
+}
+
+void DiskCache::Load() {
+  std::error_code error;
+  std::filesystem::create_directories(directory_, error);
+  if (error) {
+    LOG(WARNING) << "Cannot create " << directory_ << ": " << error.message();
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::ifstream index(directory_ + "/" + INDEX_NAME);
+  std::string line;
+  if (std::getline(index, line) && line == INDEX_HEADER) {
+    // key, size, expires, ETag and URL, separated by tabs.
+    while (std::getline(index, line)) {
+      std::istringstream fields(line);
+      std::string key, size, expires;
+      Record record;
+      if (!std::getline(fields, key, '\t') ||
+          !std::getline(fields, size, '\t') ||
+          !std::getline(fields, expires, '\t') ||
+          !std::getline(fields, record.etag, '\t') ||
+          !std::getline(fields, record.url)) {
+        continue;
+      }
+      record.size = std::strtoull(size.c_str(), nullptr, 10);
+      record.expires = std::strtoll(expires.c_str(), nullptr, 10);
+      record.version = next_version_++;
+      const uint64_t parsed_key = std::strtoull(key.c_str(), nullptr, 16);
+      if (parsed_key != UrlKey(record.url) || records_.count(parsed_key) > 0) {
+        continue;
+      }
+      lru_.emplace_back(parsed_key, std::move(record));
+      records_.emplace(parsed_key, std::prev(lru_.end()));
+      bytes_ += lru_.back().second.size;
+    }
+  }
+
+  // Bodies written before the index, and temporary files left by a crash.
+  // Other files in the directory are not ours to remove.
+  const std::string index_temp_prefix = std::string(INDEX_NAME) + ".";
+  for (const auto &file :
+       std::filesystem::directory_iterator(directory_, error)) {
+    const std::string name = file.path().filename().string();
+    if (name.compare(0, index_temp_prefix.length(), index_temp_prefix) == 0) {
+      std::filesystem::remove(file.path(), error);
+      continue;
+    }
+    if (name.length() < KEY_DIGITS + strlen(BODY_SUFFIX) ||
+        name.find_first_not_of("0123456789abcdef") != KEY_DIGITS ||
+        name.compare(KEY_DIGITS, strlen(BODY_SUFFIX), BODY_SUFFIX) != 0) {
+      continue;
+    }
+    const uint64_t key =
+        std::strtoull(name.substr(0, KEY_DIGITS).c_str(), nullptr, 16);
+    if (name.length() > KEY_DIGITS + strlen(BODY_SUFFIX) ||
+        records_.count(key) == 0) {
+      std::filesystem::remove(file.path(), error);
+    }
+  }
+  while (bytes_ > max_bytes_ && !lru_.empty()) {
+    Erase(std::prev(lru_.end()));
+    ++evictions_;
+  }
+  LOG(INFO) << "Loaded " << records_.size() << " cached responses from "
+            << directory_;
+}
+
+void DiskCache::Erase(const Lru::iterator it) {
+  unlink(BodyPath(it->first).c_str());
+  bytes_ -= it->second.size;
+  records_.erase(it->first);
+  lru_.erase(it);
+  dirty_ = true;
+}
+
+std::optional<std::string> DiskCache::IndexIfDue(const bool force) {
+  const Clock::time_point now = Clock::now();
+  if (!dirty_ || (!force && now - saved_ < INDEX_SAVE_INTERVAL)) {
+    return std::nullopt;
+  }
+  std::ostringstream index;
+  index << INDEX_HEADER << '\n';
+  for (const auto &[key, record] : lru_) {
+    char name[KEY_DIGITS + 1];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)key);
+    index << name << '\t' << record.size << '\t' << record.expires << '\t'
+          << record.etag << '\t' << record.url << '\n';
+  }
+  dirty_ = false;
+  saved_ = now;
+  return index.str();
+}
+
+void DiskCache::WriteIndex(const std::string &index) {
+  if (!WriteFile(directory_ + "/" + INDEX_NAME, index)) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++write_errors_;
+    dirty_ = true;
+  }
+}
+
+std::shared_ptr<const Entry> DiskCache::OpenEntry(const uint64_t key,
+                                                  const Record &record) {
+  std::optional<Body> body = Body::Open(BodyPath(key));
+  if (!body.has_value() || body->size() != record.size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = records_.find(key);
+    // Unless its body was replaced meanwhile.
+    if (it != records_.end() && it->second->second.version == record.version) {
+      Erase(it->second);
+    }
+    return nullptr;
+  }
+  const auto remaining = std::chrono::seconds(record.expires -
+                                              SecondsSinceEpoch());
+  return std::make_shared<const Entry>(
+      Entry{200, std::move(*body), Clock::now() + remaining, record.etag});
+}
+
+std::shared_ptr<const Entry> DiskCache::Find(const std::string &url) {
+  std::call_once(loaded_, [this]() { Load(); });
+  const uint64_t key = UrlKey(url);
+  Record record;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = records_.find(key);
+    if (it == records_.end() || it->second->second.url != url) {
+      ++misses_;
+      return nullptr;
+    }
+    if (it->second != lru_.begin()) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+      dirty_ = true;
+    }
+    record = it->second->second;
+  }
+  auto entry = OpenEntry(key, record);
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (entry == nullptr) {
+    ++misses_;
+  } else if (entry->expires <= Clock::now()) {
+    ++stale_;
+  } else {
+    ++hits_;
+  }
+  return entry;
+}
+
+void DiskCache::Insert(const std::string &url, const Entry &entry) {
+  if (entry.http_code != 200 || entry.body.size() > max_bytes_) {
+    return;
+  }
+  std::call_once(loaded_, [this]() { Load(); });
+  const uint64_t key = UrlKey(url);
+  const std::string path = BodyPath(key);
+  // Written aside, and moved into place along with its record so that a
+  // Find, Remove or eviction of `key` meanwhile sees either both or neither.
+  const std::optional<std::string> temp = WriteTemp(path, entry.body.view());
+
+  std::optional<std::string> index;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!temp.has_value() || !RenameTemp(*temp, path)) {
+      ++write_errors_;
+      return;
+    }
+    Record record{url, entry.etag, entry.body.size(),
+                  SecondsSinceEpoch() + ttl_.count(), next_version_++};
+    const auto it = records_.find(key);
+    if (it != records_.end()) {
+      // The body was replaced already.
+      bytes_ -= it->second->second.size;
+      it->second->second = std::move(record);
+      lru_.splice(lru_.begin(), lru_, it->second);
+    } else {
+      lru_.emplace_front(key, std::move(record));
+      records_.emplace(key, lru_.begin());
+    }
+    bytes_ += entry.body.size();
+    dirty_ = true;
+    while (bytes_ > max_bytes_) {
+      Erase(std::prev(lru_.end()));
+      ++evictions_;
+    }
+    index = IndexIfDue(false);
+  }
+  if (index.has_value()) {
+    WriteIndex(*index);
+  }
+}
+
+std::shared_ptr<const Entry> DiskCache::Refresh(const std::string &url) {
+  std::call_once(loaded_, [this]() { Load(); });
+  const uint64_t key = UrlKey(url);
+  Record record;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = records_.find(key);
+    if (it == records_.end() || it->second->second.url != url) {
+      return nullptr;
+    }
+    it->second->second.expires = SecondsSinceEpoch() + ttl_.count();
+    lru_.splice(lru_.begin(), lru_, it->second);
+    dirty_ = true;
+    ++revalidated_;
+    record = it->second->second;
+  }
+  return OpenEntry(key, record);
+}
+
+void DiskCache::Remove(const std::string &url) {
+  std::call_once(loaded_, [this]() { Load(); });
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = records_.find(UrlKey(url));
+  if (it != records_.end() && it->second->second.url == url) {
+    Erase(it->second);
+  }
+}
+
+Json::Value DiskCache::Metrics() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Json::Value metrics;
+  metrics["directory"] = directory_;
+  metrics["max_bytes"] = Json::UInt64(max_bytes_);
+  metrics["ttl_seconds"] = Json::Int64(ttl_.count());
+  metrics["bytes"] = Json::UInt64(bytes_);
+  metrics["entries"] = Json::UInt64(records_.size());
+  metrics["hits"] = Json::UInt64(hits_);
+  metrics["stale"] = Json::UInt64(stale_);
+  metrics["misses"] = Json::UInt64(misses_);
+  metrics["revalidated"] = Json::UInt64(revalidated_);
+  metrics["evictions"] = Json::UInt64(evictions_);
+  metrics["write_errors"] = Json::UInt64(write_errors_);
+  return metrics;
+}
+
+} // namespace cache
@@ -0,0 +1,201 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <chrono>
+#include <json/json.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace cache {
+
+using Clock = std::chrono::steady_clock;
+
+// Bodies from this size on are sealed in a memfd, so reads can splice them to
+// the kernel instead of copying them. Smaller ones are not worth a descriptor.
+constexpr size_t SEALED_MIN_BYTES = 64 << 10;
+
+// The body of a response, held in memory or in a sealed memfd mapped
+// read-only. Sealed contents never change, so the descriptor can be handed to
+// the kernel while other threads read the mapping.
+class Body final {
+public:
+  explicit Body(std::string contents) : contents_(std::move(contents)) {}
+  // Seals `contents` in a memfd when it is large enough and memfd is
+  // available, and keeps it in memory otherwise.
+  static Body Sealed(std::string contents);
+  // Maps the file at `path`, which must not change while mapped, or reads it
+  // when small. Returns std::nullopt when it cannot be read.
+  static std::optional<Body> Open(const std::string &path);
+  Body(Body &&other);
+  Body(const Body &) = delete;
+  Body &operator=(const Body &) = delete;
+  ~Body();
+
+  std::string_view view() const {
+    return (fd_ >= 0) ? std::string_view(static_cast<const char *>(map_),
+                                         size_)
+                      : std::string_view(contents_);
+  }
+  size_t size() const { return (fd_ >= 0) ? size_ : contents_.size(); }
+  // The sealed memfd or the mapped file, or -1 when the body is held in
+  // memory.
+  int fd() const { return fd_; }
+
+private:
+  Body(const int fd, const void *map, const size_t size)
+      : fd_(fd), map_(map), size_(size) {}
+
+  std::string contents_;
+  int fd_ = -1;
+  const void *map_ = nullptr;
+  size_t size_ = 0;
+};
+
+struct Entry final {
+  int http_code;
+  Body body;
+  Clock::time_point expires;
+  // Empty when the server sent none.
+  std::string etag = "";
+};
+
+// Responses keyed by URL, as normalized by http::NormalizeUrl, evicted in
+// least recently used order once they take more than the memory budget. One
+// cache serves every mounted API. Only so many bodies are cached sealed, each
+// holding a descriptor; the others are kept in memory.
+class ResponseCache final {
+public:
+  // A zero `ttl` disables caching.
+  ResponseCache(const size_t max_bytes, const std::chrono::seconds ttl)
+      : max_bytes_(max_bytes), ttl_(ttl), bytes_(0), sealed_(0), hits_(0),
+        misses_(0), evictions_(0) {}
+  ResponseCache(const ResponseCache &) = delete;
+  ResponseCache &operator=(const ResponseCache &) = delete;
+
+  bool enabled() const { return ttl_.count() > 0 && max_bytes_ > 0; }
+
+  // Returns nullptr when `url` is not cached or expired.
+  std::shared_ptr<const Entry> Find(const std::string &url);
+  // Whether `url` is cached and fresh. Unlike Find, neither counts as a
+  // lookup nor makes the entry recently used.
+  bool Contains(const std::string &url) const;
+  // Returns the entry built for `body`, also when it is not cached.
+  std::shared_ptr<const Entry> Insert(const std::string &url,
+                                      const int http_code, std::string body,
+                                      std::string etag);
+  // Caches `entry` until it expires, such as an entry read from disk.
+  void Insert(const std::string &url, std::shared_ptr<const Entry> entry);
+  // Drops the response of `url`, such as after a write changed it.
+  void Remove(const std::string &url);
+
+  Json::Value Metrics() const;
+
+private:
+  using Lru = std::list<std::pair<std::string, std::shared_ptr<const Entry>>>;
+
+  // Whether no other sealed body may be cached.
+  bool SealedFull() const;
+  void Erase(const Lru::iterator it);
+
+  const size_t max_bytes_;
+  const std::chrono::seconds ttl_;
+
+  mutable std::mutex mutex_;
+  Lru lru_; // Most recently used first.
+  std::unordered_map<std::string, Lru::iterator> entries_;
+  size_t bytes_;
+  size_t sealed_;
+  size_t hits_;
+  size_t misses_;
+  size_t evictions_;
+};
+
+// Responses kept in a directory across restarts, behind the memory cache,
+// keyed the same way.
+//
+// Every body is a file named after the hash of its URL, written to a
+// temporary file and renamed so that a crash never leaves a partial body. An
+// index lists the URL, ETag, expiry and size of every body in least recently
+// used order; it is rewritten the same way at most once per second and on
+// destruction, and files it does not list are removed when it is loaded. The
+// index is loaded on first use, and bodies are mapped when looked up.
+//
+// Expired entries are still returned, so that they are revalidated with their
+// ETag instead of being fetched again.
+class DiskCache final {
+public:
+  // Bodies are kept `ttl` after they are written or revalidated, and evicted
+  // once they take more than `max_bytes`.
+  DiskCache(const std::string &directory, const size_t max_bytes,
+            const std::chrono::seconds ttl);
+  DiskCache(const DiskCache &) = delete;
+  DiskCache &operator=(const DiskCache &) = delete;
+  ~DiskCache();
+
+  // Returns nullptr when `url` is not stored. Check `expires` for staleness.
+  std::shared_ptr<const Entry> Find(const std::string &url);
+  // Stores `entry`, which must be a 200 response. Writes the body in the
+  // calling thread.
+  void Insert(const std::string &url, const Entry &entry);
+  // Extends the expiry of `url` after the server confirmed it is unchanged.
+  // Returns nullptr when it is no longer stored.
+  std::shared_ptr<const Entry> Refresh(const std::string &url);
+  // Drops the body of `url`, such as after a write changed it.
+  void Remove(const std::string &url);
+
+  Json::Value Metrics() const;
+
+private:
+  struct Record final {
+    std::string url;
+    std::string etag;
+    size_t size;
+    // Seconds since the epoch: steady clocks do not survive restarts.
+    int64_t expires;
+    // Of the body, which Insert replaces. Not stored in the index.
+    uint64_t version;
+  };
+  using Lru = std::list<std::pair<uint64_t, Record>>;
+
+  void Load();
+  // Returns the contents of the index when it changed and was not written in
+  // the last second, or whenever it changed when `force`. Must hold `mutex_`.
+  std::optional<std::string> IndexIfDue(const bool force);
+  void WriteIndex(const std::string &index);
+  // Removes the record and its body. Must hold `mutex_`.
+  void Erase(const Lru::iterator it);
+  std::string BodyPath(const uint64_t key) const;
+  // Maps the body of `record`, a copy of the record of `key`, or returns
+  // nullptr and drops the record when the body is gone. Must not hold
+  // `mutex_`: the body is opened without it.
+  std::shared_ptr<const Entry> OpenEntry(const uint64_t key,
+                                         const Record &record);
+
+  const std::string directory_;
+  const size_t max_bytes_;
+  const std::chrono::seconds ttl_;
+
+  std::once_flag loaded_;
+  mutable std::mutex mutex_;
+  Lru lru_; // Most recently used first.
+  std::unordered_map<uint64_t, Lru::iterator> records_;
+  size_t bytes_;
+  uint64_t next_version_;
+  bool dirty_;
+  Clock::time_point saved_;
+  size_t hits_;
+  size_t stale_;
+  size_t misses_;
+  size_t revalidated_;
+  size_t evictions_;
+  size_t write_errors_;
+};
+
+} // namespace cache
+
+#endif
@@ -0,0 +1,313 @@
+#include "collection.h"
+#include "logger.h"
+#include "openapi.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace collection {
+
+// Indexes unread for as many refresh intervals, and at least MIN_IDLE, are
+// dropped.
+constexpr int IDLE_REFRESHES = 10;
+constexpr std::chrono::seconds MIN_IDLE(300);
+// Delta refreshes between two full listings.
+constexpr size_t DELTAS_PER_LISTING = 10;
+
+static std::vector<std::string> SortedUnique(std::vector<std::string> ids) {
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+  return ids;
+}
+
+IdIndex IdIndex::FromIds(std::vector<std::string> ids) {
+  return IdIndex().Merge(std::move(ids));
+}
+
+IdIndex IdIndex::Merge(std::vector<std::string> ids) const {
+  const std::vector<std::string> added = SortedUnique(std::move(ids));
+  std::vector<std::string_view> merged;
+  merged.reserve(size() + added.size());
+  std::vector<std::string_view> current;
+  current.reserve(size());
+  for (size_t idx = 0; idx < size(); ++idx) {
+    current.push_back((*this)[idx]);
+  }
+  std::set_union(current.begin(), current.end(), added.begin(), added.end(),
+                 std::back_inserter(merged));
+
+  IdIndex index;
+  size_t bytes = 0;
+  for (const std::string_view id : merged) {
+    bytes += id.length();
+  }
+  CHECK_M(bytes <= UINT32_MAX, "Collection too large");
+  index.blob_.reserve(bytes);
+  index.offsets_.reserve(merged.size() + 1);
+  for (const std::string_view id : merged) {
+    index.blob_.append(id);
+    index.offsets_.push_back(index.blob_.length());
+  }
+  return index;
+}
+
+bool IsListable(const std::string_view id) {
+  return !id.empty() && id.find_first_of("/{},:") == id.npos;
+}
+
+bool IdIndex::contains(std::string_view id) const {
+  size_t low = 0, high = size();
+  while (low < high) {
+    const size_t mid = low + (high - low) / 2;
+    if ((*this)[mid] < id) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low < size() && (*this)[low] == id;
+}
+
+static const Json::Value &Member(const Json::Value &value,
+                                 const std::string &key) {
+  static const Json::Value null;
+  const Json::Value *found =
+      value.isObject() ? value.find(key.c_str(), key.c_str() + key.length())
+                       : nullptr;
+  return (found == nullptr) ? null : *found;
+}
+
+// Whether `member` of the collection `ref_dir` is absent or a string.
+static bool IsStringOrNull(const Json::Value &config, const std::string &member,
+                           const path::Path &ref_dir) {
+  const Json::Value &value = Member(config, member);
+  if (!value.isNull() && !value.isString()) {
+    LOG(ERROR) << "Invalid " << member << " for collection "
+               << ref_dir.string();
+    return false;
+  }
+  return true;
+}
+
+std::optional<ConfigMap> ConfigMapFromJsonValue(const Json::Value &value) {
+  if (!value.isObject()) {
+    LOG(ERROR) << "Collections must be an object";
+    return std::nullopt;
+  }
+  ConfigMap configs;
+  for (auto it = value.begin(), end = value.end(); it != end; ++it) {
+    const Json::Value &config = *it;
+    const path::Path ref_dir =
+        path::Path("/") / path::utils::PathToRefValueMap(it.name());
+    if (!path::utils::IsReference(ref_dir)) {
+      LOG(ERROR) << "Not a reference directory: " << ref_dir.string();
+      return std::nullopt;
+    }
+    if (!config.isObject() || !Member(config, "list_path").isString()) {
+      LOG(ERROR) << "Missing list_path for collection " << ref_dir.string();
+      return std::nullopt;
+    }
+    for (const char *member :
+         {"items_pointer", "id_field", "since_param", "since_pointer"}) {
+      if (!IsStringOrNull(config, member, ref_dir)) {
+        return std::nullopt;
+      }
+    }
+    const Json::Value &refresh_seconds = Member(config, "refresh_seconds");
+    if (!refresh_seconds.isNull() && !refresh_seconds.isInt()) {
+      LOG(ERROR) << "Invalid refresh_seconds for collection "
+                 << ref_dir.string();
+      return std::nullopt;
+    }
+    configs.emplace(
+        ref_dir,
+        Config{
+            .list_path = Member(config, "list_path").asString(),
+            .items_pointer =
+                Member(config, "items_pointer").asString().empty()
+                    ? path::Path("/")
+                    : path::Path(Member(config, "items_pointer").asString()),
+            .id_field = Member(config, "id_field").asString(),
+            .since_param = Member(config, "since_param").asString(),
+            .since_pointer = Member(config, "since_pointer").asString(),
+            .refresh_interval = std::chrono::seconds(
+                refresh_seconds.isNull() ? 60 : refresh_seconds.asInt()),
+        });
+  }
+  return configs;
+}
+
+Registry::Registry(ConfigMap configs, const std::string &url_prefix,
+                   const http::Headers *headers,
+                   scheduler::Scheduler *scheduler, worker::Pool *workers)
+    : configs_(std::move(configs)), url_prefix_(url_prefix),
+      headers_(headers), scheduler_(scheduler), workers_(workers) {}
+
+bool Registry::Fetch(const scheduler::Priority priority, const Config &config,
+                     const std::string &url, const std::string &since,
+                     std::vector<std::string> *ids,
+                     std::string *next_since) const {
+  std::string fetch_url = url;
+  if (!since.empty() && !config.since_param.empty()) {
+    // Tokens are opaque, and may hold '&', '=' or '+'.
+    std::string query = http::QueryString({{config.since_param, since}});
+    if (url.find('?') != url.npos) {
+      query[0] = '&';
+    }
+    fetch_url += query;
+  }
+  const http::Response response = scheduler_->Fetch(
+      priority, config.list_path.string(),
+      http::Request(rest::constants::GET, *headers_), fetch_url);
+  if (response.http_code != 200) {
+    LOG(WARNING) << "Failed to list " << fetch_url << " (Code "
+                 << response.http_code << ")";
+    return false;
+  }
+
+  Json::Value json;
+  Json::CharReaderBuilder builder;
+  std::string errors;
+  std::stringstream data(response.data.str());
+  if (!Json::parseFromStream(builder, data, &json, &errors)) {
+    LOG(WARNING) << "Invalid collection response from " << fetch_url << ": "
+                 << errors;
+    return false;
+  }
+
+  const Json::Value *items = openapi::FindAbsolutePath(json, config.items_pointer);
+  if (items == nullptr || !items->isArray()) {
+    LOG(WARNING) << "No items at " << config.items_pointer << " in "
+                 << fetch_url;
+    return false;
+  }
+  ids->reserve(ids->size() + items->size());
+  for (const Json::Value &item : *items) {
+    const Json::Value &id =
+        config.id_field.empty() ? item : Member(item, config.id_field);
+    if (id.isNull() || id.isObject() || id.isArray()) {
+      continue;
+    }
+    const std::string id_str = id.asString();
+    if (!IsListable(id_str)) {
+      continue;
+    }
+    ids->push_back(id_str);
+  }
+
+  if (!config.since_pointer.empty()) {
+    const Json::Value *token =
+        openapi::FindAbsolutePath(json, config.since_pointer);
+    if (token != nullptr && !token->isNull()) {
+      *next_since = token->asString();
+    }
+  }
+  return true;
+}
+
+std::shared_ptr<const IdIndex>
+Registry::Find(const path::Path &ref_dir, const path::RefValueMap &bindings) {
+  const auto config_it = configs_.find(ref_dir);
+  if (config_it == configs_.end()) {
+    return nullptr;
+  }
+  const Config &config = config_it->second;
+
+  bool bound = true;
+  const path::Path list_path = path::utils::BindRefs(
+      config.list_path,
+      [&bindings, &bound](const path::Ref &ref,
+                          const path::Value &value) -> const path::Ref {
+        const auto it = bindings.find(ref);
+        bound &= it != bindings.end() && !it->second.empty();
+        return bound ? it->second : "";
+      });
+  if (!bound) {
+    return nullptr;
+  }
+  const std::string url = url_prefix_ + list_path.string();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = entries_.find(url);
+    if (it != entries_.end() && it->second.index != nullptr) {
+      it->second.read = worker::Clock::now();
+      return it->second.index;
+    }
+  }
+
+  // First listing: fetch everything in the foreground, the worker pool keeps
+  // it fresh from here.
+  std::vector<std::string> ids;
+  std::string since;
+  if (!Fetch(scheduler::INTERACTIVE, config, url, "", &ids, &since)) {
+    return nullptr;
+  }
+  auto index = std::make_shared<const IdIndex>(IdIndex::FromIds(std::move(ids)));
+  LOG(INFO) << "Loaded " << index->size() << " ids from " << url << " ("
+            << index->memory_usage() << " bytes)";
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto [it, inserted] = entries_.try_emplace(
+        url, Entry{&config, since, index, worker::Clock::now(), 0});
+    if (!inserted) {
+      it->second.read = worker::Clock::now();
+      return it->second.index;
+    }
+  }
+  workers_->RunAt(worker::Clock::now() + config.refresh_interval,
+                  [this, url]() { Refresh(url); });
+  return index;
+}
+
+void Registry::Refresh(const std::string &url) {
+  const Config *config;
+  std::string since;
+  std::shared_ptr<const IdIndex> current;
+  size_t deltas;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = entries_.find(url);
+    const Entry &entry = it->second;
+    if (worker::Clock::now() - entry.read >
+        std::max<std::chrono::seconds>(
+            IDLE_REFRESHES * entry.config->refresh_interval, MIN_IDLE)) {
+      LOG(INFO) << "Dropping the ids of " << url << ", unread for a while";
+      entries_.erase(it);
+      return;
+    }
+    config = entry.config;
+    since = entry.since;
+    current = entry.index;
+    deltas = entry.deltas;
+  }
+
+  // Deltas only add IDs. Full listings, every refresh without a delta token
+  // and every DELTAS_PER_LISTING with one, also drop the IDs gone upstream.
+  const bool delta = !config->since_param.empty() && !since.empty() &&
+                     deltas < DELTAS_PER_LISTING;
+  std::vector<std::string> ids;
+  std::string next_since = since;
+  const bool fetched = Fetch(scheduler::REFRESH, *config, url,
+                             delta ? since : "", &ids, &next_since);
+  std::shared_ptr<const IdIndex> index = current;
+  if (fetched && (!delta || !ids.empty())) {
+    index = std::make_shared<const IdIndex>(
+        delta ? current->Merge(std::move(ids))
+              : IdIndex::FromIds(std::move(ids)));
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry &entry = entries_.at(url);
+    entry.index = index;
+    entry.since = next_since;
+    if (fetched) {
+      entry.deltas = delta ? entry.deltas + 1 : 0;
+    }
+  }
+  workers_->RunAt(worker::Clock::now() + config->refresh_interval,
+                  [this, url]() { Refresh(url); });
+}
+
+} // namespace collection
@@ -0,0 +1,125 @@
+#ifndef COLLECTION_H
+#define COLLECTION_H
+
+#include "http.h"
+#include "path.h"
+#include "scheduler.h"
+#include "worker.h"
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace collection {
+
+// Sorted and deduplicated set of IDs packed in a single buffer. An index is
+// immutable once built: refreshes produce a new one through Merge() and
+// readers keep using whatever snapshot they grabbed.
+class IdIndex final {
+public:
+  IdIndex() : offsets_({0}) {}
+
+  static IdIndex FromIds(std::vector<std::string> ids);
+  IdIndex Merge(std::vector<std::string> ids) const;
+
+  size_t size() const { return offsets_.size() - 1; }
+  std::string_view operator[](size_t idx) const {
+    return std::string_view(blob_).substr(offsets_[idx],
+                                          offsets_[idx + 1] - offsets_[idx]);
+  }
+  bool contains(std::string_view id) const;
+  size_t memory_usage() const {
+    return blob_.capacity() + offsets_.capacity() * sizeof(uint32_t);
+  }
+
+private:
+  std::string blob_;
+  std::vector<uint32_t> offsets_; // size() + 1 entries, offsets_[0] == 0
+};
+
+// Whether `id` can be listed as the value of a {ref:value} path segment and
+// read back as it is: it must not be empty, and must hold none of "/{}" nor
+// the ",:" that separate bindings.
+bool IsListable(std::string_view id);
+
+// How to list the concrete values of a reference directory.
+struct Config final {
+  // Collection endpoint. May hold references bound from the listed path.
+  path::Path list_path;
+  // JSON pointer to the array of items in the collection response.
+  path::Path items_pointer;
+  // Item member holding the ID. Empty when the items are the IDs themselves.
+  std::string id_field;
+  // Query parameter carrying the delta token. Empty refetches everything.
+  std::string since_param;
+  // JSON pointer to the next delta token in the collection response.
+  path::Path since_pointer;
+  std::chrono::seconds refresh_interval;
+};
+
+// Keyed by the canonical path of the reference directory, e.g.
+// /v2/order/capture/{soid}.
+using ConfigMap = std::map<path::Path, Config>;
+
+// Returns std::nullopt, after logging why, when `value` is not a valid
+// collections file.
+std::optional<ConfigMap> ConfigMapFromJsonValue(const Json::Value &value);
+
+// Holds one IdIndex per concrete collection URL. Indexes are loaded on first
+// use and then kept fresh from the worker pool, so listing a directory never
+// waits on the network after the first time. Indexes not read for a while
+// are dropped rather than refreshed, and delta refreshes are interleaved with
+// full listings that drop the IDs gone upstream. The pool must be shut down
+// before the registry goes away.
+class Registry final {
+public:
+  Registry(ConfigMap configs, const std::string &url_prefix,
+           const http::Headers *headers, scheduler::Scheduler *scheduler,
+           worker::Pool *workers);
+  Registry(const Registry &) = delete;
+  Registry &operator=(const Registry &) = delete;
+
+  bool HasCollection(const path::Path &ref_dir) const {
+    return configs_.count(ref_dir) > 0;
+  }
+
+  // Returns the IDs of the canonical reference directory `ref_dir`, taking
+  // references of the collection endpoint from `bindings`. Returns nullptr
+  // when there is no collection for it or its first fetch failed.
+  std::shared_ptr<const IdIndex> Find(const path::Path &ref_dir,
+                                      const path::RefValueMap &bindings);
+
+private:
+  struct Entry {
+    const Config *config;
+    std::string since;
+    std::shared_ptr<const IdIndex> index;
+    // Last returned by Find.
+    worker::Clock::time_point read;
+    // Delta refreshes since the last full listing.
+    size_t deltas;
+  };
+
+  bool Fetch(const scheduler::Priority priority, const Config &config,
+             const std::string &url, const std::string &since,
+             std::vector<std::string> *ids, std::string *next_since) const;
+  void Refresh(const std::string &url);
+
+  const ConfigMap configs_;
+  const std::string url_prefix_;
+  const http::Headers *const headers_;
+  scheduler::Scheduler *const scheduler_;
+  worker::Pool *const workers_;
+
+  std::mutex mutex_;
+  std::map<std::string, Entry> entries_; // keyed by collection URL
+};
+
+} // namespace collection
+
+#endif
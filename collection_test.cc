@@ -0,0 +1,77 @@
+#include "collection.h"
+#include "logger.h"
+
+static std::vector<std::string> IdsOf(const collection::IdIndex &index) {
+  std::vector<std::string> ids;
+  for (size_t idx = 0; idx < index.size(); ++idx) {
+    ids.emplace_back(index[idx]);
+  }
+  return ids;
+}
+
+static Json::Value Parse(const std::string &text) {
+  Json::Value value;
+  Json::CharReaderBuilder builder;
+  const std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+  CHECK(reader->parse(text.data(), text.data() + text.size(), &value,
+                      nullptr));
+  return value;
+}
+
+int main(int argc, char *argv[]) {
+  // Sorted and deduplicated.
+  const collection::IdIndex empty;
+  CHECK(empty.size() == 0);
+  CHECK(!empty.contains(""));
+  const collection::IdIndex index =
+      collection::IdIndex::FromIds({"b", "a", "10", "b", "9", "a"});
+  CHECK((IdsOf(index) == std::vector<std::string>{"10", "9", "a", "b"}));
+  for (const char *id : {"10", "9", "a", "b"}) {
+    CHECK(index.contains(id));
+  }
+  for (const char *id : {"", "1", "c", "ab"}) {
+    CHECK(!index.contains(id));
+  }
+
+  // Merging builds a new index and leaves the snapshot merged untouched.
+  const collection::IdIndex merged = index.Merge({"c", "a", "0", "c"});
+  CHECK((IdsOf(merged) ==
+         std::vector<std::string>{"0", "10", "9", "a", "b", "c"}));
+  CHECK((IdsOf(index) == std::vector<std::string>{"10", "9", "a", "b"}));
+  CHECK(IdsOf(index.Merge({})) == IdsOf(index));
+  CHECK(IdsOf(empty.Merge({"x"})) == std::vector<std::string>{"x"});
+
+  // IDs are listed as {ref:value} segments, which must read back as one
+  // binding of the whole ID.
+  for (const char *id : {"42", "a-b.c", "x y", "été"}) {
+    CHECK(collection::IsListable(id));
+  }
+  for (const char *id : {"", "a/b", "{a}", "a,b:c", "a,b", "a:b"}) {
+    CHECK(!collection::IsListable(id));
+  }
+
+  const std::optional<collection::ConfigMap> configs =
+      collection::ConfigMapFromJsonValue(Parse(R"({
+        "/v2/orders/{soid}": {"list_path": "/v2/orders", "id_field": "soid",
+                              "since_param": "since", "refresh_seconds": 5}
+      })"));
+  CHECK(configs.has_value() && configs->size() == 1);
+  const collection::Config &config = configs->at("/v2/orders/{soid}");
+  CHECK(config.list_path == "/v2/orders");
+  CHECK(config.items_pointer == "/");
+  CHECK(config.id_field == "soid");
+  CHECK(config.refresh_interval == std::chrono::seconds(5));
+
+  // Malformed collections are refused rather than aborting.
+  for (const char *text :
+       {"[]", R"({"/v2/orders": {"list_path": "/v2/orders"}})",
+        R"({"/v2/orders/{soid}": {}})", R"({"/v2/orders/{soid}": 1})",
+        R"({"/v2/orders/{soid}": {"list_path": "/v2/orders",
+                                  "id_field": {}}})",
+        R"({"/v2/orders/{soid}": {"list_path": "/v2/orders",
+                                  "refresh_seconds": "5"}})"}) {
+    CHECK(!collection::ConfigMapFromJsonValue(Parse(text)).has_value());
+  }
+  LOG(INFO) << "Success";
+  return 0;
+}
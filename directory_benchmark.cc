@@ -0,0 +1,139 @@
+#include "openapi.h"
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// Builds the directory of a synthetic spec with many resources, then reports
+// its footprint and the cost of looking paths up: paths with bound references
+// ({id:42}) and concrete paths (/42) through the route matcher, and bound
+// references through canonicalization and a map keyed by template.
+//
+// Every operation refers to `refs` shared parameters, each a chain of two
+// references, as specs generated from large code bases often do.
+//
+// Usage: directory_benchmark [resources] [refs]
+
+using Clock = std::chrono::steady_clock;
+
+// Shared parameters available to operations.
+constexpr size_t COMPONENT_PARAMETERS = 64;
+
+static Json::Value Operation(const std::string &summary, const size_t refs) {
+  Json::Value operation;
+  operation["summary"] = summary;
+  for (size_t idx = 0; idx < refs; ++idx) {
+    Json::Value parameter;
+    parameter["$ref"] = "#/components/parameters/Param" +
+                        std::to_string(idx % COMPONENT_PARAMETERS);
+    operation["parameters"].append(parameter);
+  }
+  operation["responses"]["200"]["description"] = "OK";
+  return operation;
+}
+
+static std::unique_ptr<Json::Value>
+SyntheticSpec(const size_t resources, const size_t refs,
+              std::vector<std::string> *paths,
+              std::vector<std::string> *concrete_paths) {
+  auto spec = std::make_unique<Json::Value>();
+  (*spec)["openapi"] = "3.0.0";
+  Json::Value &parameters = (*spec)["components"]["parameters"];
+  for (size_t idx = 0; idx < COMPONENT_PARAMETERS; ++idx) {
+    const std::string name = std::to_string(idx);
+    parameters["Param" + name]["$ref"] = "#/components/parameters/Base" + name;
+    parameters["Base" + name]["in"] = "query";
+    parameters["Base" + name]["name"] = "param" + name;
+    parameters["Base" + name]["required"] = false;
+  }
+  Json::Value &spec_paths = (*spec)["paths"];
+  for (size_t idx = 0; idx < resources; ++idx) {
+    const std::string collection = "/v" + std::to_string(idx % 4) +
+                                   "/group" + std::to_string(idx % 97) +
+                                   "/resource" + std::to_string(idx);
+    const std::string item = collection + "/{id}";
+    const std::string child = item + "/children/{child_id}";
+    spec_paths[collection]["get"] = Operation("list", refs);
+    spec_paths[collection]["post"] = Operation("create", refs);
+    spec_paths[item]["get"] = Operation("read", refs);
+    spec_paths[item]["put"] = Operation("update", refs);
+    spec_paths[child]["get"] = Operation("read child", refs);
+    paths->push_back(collection + "/get.json");
+    paths->push_back(collection + "/{id:" + std::to_string(idx) +
+                     "}/children/{child_id:7}/get.json");
+    concrete_paths->push_back(collection + "/get.json");
+    concrete_paths->push_back(collection + "/" + std::to_string(idx) +
+                              "/children/7/get.json");
+  }
+  return spec;
+}
+
+int main(int argc, char *argv[]) {
+  const size_t resources = (argc > 1) ? std::stoul(argv[1]) : 20000;
+  const size_t refs = (argc > 2) ? std::stoul(argv[2]) : 8;
+  std::vector<std::string> paths;
+  std::vector<std::string> concrete_paths;
+  std::unique_ptr<Json::Value> spec =
+      SyntheticSpec(resources, refs, &paths, &concrete_paths);
+
+  const Clock::time_point build_start = Clock::now();
+  const openapi::Directory directory(
+      openapi::NewDirectoryFromJsonValue("http://localhost", std::move(spec)));
+  const std::chrono::duration<double> build_time = Clock::now() - build_start;
+
+  const path::NodeTable &table = directory.table();
+  const size_t bytes = table.memory_usage();
+  std::cout << "resources: " << resources << std::endl;
+  std::cout << "refs per operation: " << refs << std::endl;
+  std::cout << "nodes: " << table.size() << std::endl;
+  std::cout << "table bytes: " << bytes << std::endl;
+  std::cout << "bytes per node: " << double(bytes) / table.size() << std::endl;
+  std::cout << "build seconds: " << build_time.count() << std::endl;
+
+  // Returns the mean nanoseconds taken by `find` over `paths`.
+  auto measure = [](const std::vector<std::string> &paths,
+                    const std::function<bool(const std::string &)> &find) {
+    const Clock::time_point start = Clock::now();
+    size_t found = 0;
+    for (const std::string &path : paths) {
+      found += find(path);
+    }
+    const std::chrono::duration<double, std::nano> time = Clock::now() - start;
+    CHECK_M(found == paths.size(), "Some paths were not found");
+    return time.count() / paths.size();
+  };
+
+  std::map<path::Path, path::NodeIndex> by_template;
+  for (auto it = directory.begin(); it != directory.end(); ++it) {
+    by_template.emplace(it->first, it->second.index());
+  }
+  std::cout << "canonicalize + map find ns: "
+            << measure(paths,
+                       [&by_template](const std::string &path) {
+                         path::RefValueMap bindings;
+                         return by_template.count(
+                                    path::utils::PathToRefValueMap(
+                                        path, &bindings)) > 0;
+                       })
+            << std::endl;
+  std::cout << "match bound ns: "
+            << measure(paths,
+                       [&directory](const std::string &path) {
+                         path::RefValueMap bindings;
+                         return directory.find(path, &bindings) !=
+                                directory.end();
+                       })
+            << std::endl;
+  std::cout << "match concrete ns: "
+            << measure(concrete_paths,
+                       [&directory](const std::string &path) {
+                         path::RefValueMap bindings;
+                         return directory.find(path, &bindings) !=
+                                directory.end();
+                       })
+            << std::endl;
+  return 0;
+}
@@ -1,17 +1,300 @@
 #include "http.h"
 #include "logger.h"
+#include "trace.h"
 #include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <iterator>
 #include <curl/curl.h>
 #include <sstream>
 
 namespace http {
+
+ConnectionPool::ConnectionPool() : share_(curl_share_init()) {
+  CHECK(share_ != nullptr);
+  CHECK(curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, Lock) == CURLSHE_OK);
+  CHECK(curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, Unlock) == CURLSHE_OK);
+  CHECK(curl_share_setopt(share_, CURLSHOPT_USERDATA, this) == CURLSHE_OK);
+  for (const curl_lock_data data :
+       {CURL_LOCK_DATA_CONNECT, CURL_LOCK_DATA_DNS,
+        CURL_LOCK_DATA_SSL_SESSION}) {
+    CHECK(curl_share_setopt(share_, CURLSHOPT_SHARE, data) == CURLSHE_OK);
+  }
+}
+
+void ConnectionPool::Lock(CURL *handle, curl_lock_data data,
+                          curl_lock_access access, void *pool) {
+  static_cast<ConnectionPool *>(pool)->mutexes_[data].lock();
+}
+
+void ConnectionPool::Unlock(CURL *handle, curl_lock_data data, void *pool) {
+  static_cast<ConnectionPool *>(pool)->mutexes_[data].unlock();
+}
+int ErrnoOf(const Response &response) {
+  if (response.curl_code == CURLE_OPERATION_TIMEDOUT) {
+    return ETIMEDOUT;
+  }
+  if (response.curl_code != CURLE_OK) {
+    return EIO;
+  }
+  switch (response.http_code) {
+  case 404:
+  case 410:
+    return ENOENT;
+  case 401:
+  case 403:
+    return EACCES;
+  case 408:
+  case 504:
+    return ETIMEDOUT;
+  }
+  return (response.http_code >= 200 && response.http_code < 400) ? 0 : EIO;
+}
+
+static bool IsUnreserved(const char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' ||
+         c == '~';
+}
+
+// Characters of a path that need no escape: unreserved ones, sub-delims, ':',
+// '@' and '/'.
+static bool IsPathCharacter(const char c) {
+  return IsUnreserved(c) || c == '/' || c == ':' || c == '@' ||
+         std::string_view("!$&'()*+,;=").find(c) != std::string_view::npos;
+}
+
+static int HexValue(const char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+// The character escaped at `at` of `text`, or -1 when there is no escape
+// there.
+static int EscapeAt(const std::string_view text, const size_t at) {
+  if (text[at] != '%' || at + 2 >= text.size() ||
+      HexValue(text[at + 1]) < 0 || HexValue(text[at + 2]) < 0) {
+    return -1;
+  }
+  return HexValue(text[at + 1]) * 16 + HexValue(text[at + 2]);
+}
+
+static void Escape(const unsigned char c, std::string *out) {
+  static constexpr char HEX_DIGITS[] = "0123456789ABCDEF";
+  out->push_back('%');
+  out->push_back(HEX_DIGITS[c >> 4]);
+  out->push_back(HEX_DIGITS[c & 15]);
+}
+
+// `text`, taken literally, with all but unreserved characters escaped.
+static void AppendEscaped(const std::string_view text, std::string *out) {
+  for (const char c : text) {
+    if (IsUnreserved(c)) {
+      out->push_back(c);
+    } else {
+      Escape(c, out);
+    }
+  }
+}
+
+// `text`, a component of a URL, with escapes of unreserved characters
+// decoded, the other escapes upper-cased, and the characters but
+// `IsPlain` ones escaped.
+static void AppendNormal(const std::string_view text, bool (*IsPlain)(char),
+                         std::string *out) {
+  for (size_t idx = 0; idx < text.size(); ++idx) {
+    const int escaped = EscapeAt(text, idx);
+    if (escaped >= 0) {
+      if (IsUnreserved(char(escaped))) {
+        out->push_back(char(escaped));
+      } else {
+        Escape(escaped, out);
+      }
+      idx += 2;
+    } else if (IsPlain(text[idx])) {
+      out->push_back(text[idx]);
+    } else {
+      Escape(text[idx], out);
+    }
+  }
+}
+
+// Characters of a query parameter that need no escape. '+' is kept as it is:
+// some servers read it as a space.
+static bool IsQueryCharacter(const char c) {
+  return IsPathCharacter(c) || c == '?';
+}
+
+std::string QueryString(const QueryParams &params) {
+  std::string query;
+  for (const auto &[name, value] : params) {
+    query.push_back(query.empty() ? '?' : '&');
+    AppendEscaped(name, &query);
+    query.push_back('=');
+    AppendEscaped(value, &query);
+  }
+  return query;
+}
+
+std::string NormalizeUrl(const std::string &url) {
+  std::string_view rest(url);
+  rest = rest.substr(0, rest.find('#'));
+  std::string normal;
+  normal.reserve(url.size());
+  const size_t scheme_end = rest.find("://");
+  if (scheme_end != rest.npos) {
+    const size_t host_end = std::min(rest.find_first_of("/?", scheme_end + 3),
+                                     rest.size());
+    const size_t user_end = rest.rfind('@', host_end);
+    const size_t host_begin = (user_end == rest.npos || user_end < scheme_end)
+                                  ? scheme_end + 3
+                                  : user_end + 1;
+    normal.append(rest.substr(0, host_begin));
+    const auto lower = [](const unsigned char c) { return std::tolower(c); };
+    std::transform(normal.begin(), normal.begin() + scheme_end, normal.begin(),
+                   lower);
+    const std::string_view host =
+        rest.substr(host_begin, host_end - host_begin);
+    std::transform(host.begin(), host.end(), std::back_inserter(normal), lower);
+    rest.remove_prefix(host_end);
+  }
+  const size_t query_begin = rest.find('?');
+  AppendNormal(rest.substr(0, query_begin), IsPathCharacter, &normal);
+  if (query_begin == rest.npos) {
+    return normal;
+  }
+
+  // Normalized parameters, by normalized name.
+  std::vector<std::pair<std::string, std::string>> params;
+  std::string_view query = rest.substr(query_begin + 1);
+  while (!query.empty()) {
+    const size_t end = std::min(query.find('&'), query.size());
+    const std::string_view param = query.substr(0, end);
+    query.remove_prefix(std::min(end + 1, query.size()));
+    if (param.empty()) {
+      continue;
+    }
+    const size_t equals = std::min(param.find('='), param.size());
+    std::string name, normal_param;
+    AppendNormal(param.substr(0, equals), IsQueryCharacter, &name);
+    normal_param = name;
+    if (equals < param.size()) {
+      normal_param.push_back('=');
+      AppendNormal(param.substr(equals + 1), IsQueryCharacter, &normal_param);
+    }
+    params.emplace_back(std::move(name), std::move(normal_param));
+  }
+  std::stable_sort(
+      params.begin(), params.end(),
+      [](const auto &a, const auto &b) { return a.first < b.first; });
+  for (size_t idx = 0; idx < params.size(); ++idx) {
+    normal.push_back((idx == 0) ? '?' : '&');
+    normal.append(params[idx].second);
+  }
+  return normal;
+}
+
+// Where the body of a transfer goes.
+struct BodyTarget final {
+  CURL *curl;
+  Response *response;
+  const BodySink *sink;
+};
+
 static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb,
-                                  Response *resp) {
+                                  BodyTarget *target) {
   const size_t realsize = size * nmemb;
-  resp->data << std::string((const char *)contents, realsize);
+  const std::string_view chunk(static_cast<const char *>(contents), realsize);
+  target->response->data << chunk;
+  if (target->sink == nullptr) {
+    return realsize;
+  }
+  long http_code = 0;
+  curl_easy_getinfo(target->curl, CURLINFO_RESPONSE_CODE, &http_code);
+  if (http_code / 100 == 2 && !(*target->sink)(chunk)) {
+    target->response->stopped = true;
+    return 0; // Fails the transfer with CURLE_WRITE_ERROR.
+  }
   return realsize;
 }
 
+static size_t HeaderCallback(char *buffer, size_t size, size_t nitems,
+                             Response *resp) {
+  const size_t realsize = size * nitems;
+  std::string line(buffer, realsize);
+  if (line.compare(0, 5, "HTTP/") == 0) { // Status line of a new response.
+    resp->headers.clear();
+    return realsize;
+  }
+  const size_t colon_pos = line.find(':');
+  if (colon_pos == line.npos) {
+    return realsize;
+  }
+  std::string name = line.substr(0, colon_pos);
+  std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+  const size_t value_begin = line.find_first_not_of(" \t", colon_pos + 1);
+  const size_t value_end = line.find_last_not_of(" \t\r\n");
+  resp->headers[name] =
+      (value_begin == line.npos || value_end < value_begin)
+          ? ""
+          : line.substr(value_begin, value_end - value_begin + 1);
+  return realsize;
+}
+
+// What aborts a transfer. `cancelled` is not read once `abandoned` is set.
+struct Cancellation final {
+  const std::atomic<bool> *abandoned;
+  const std::atomic<bool> *cancelled;
+};
+
+static int ProgressCallback(const Cancellation *cancellation,
+                            curl_off_t dltotal, curl_off_t dlnow,
+                            curl_off_t ultotal, curl_off_t ulnow) {
+  if (cancellation->abandoned != nullptr && *cancellation->abandoned) {
+    return 1;
+  }
+  return (cancellation->cancelled != nullptr && *cancellation->cancelled) ? 1
+                                                                           : 0;
+}
+
+// Records the phases of the transfer that started at `start`, from the
+// cumulative times curl measured since then.
+static void RecordPhases(CURL *curl, const int64_t start,
+                         const std::string &url) {
+  struct Phase {
+    const char *name;
+    CURLINFO end_info;
+  };
+  static constexpr Phase PHASES[] = {
+      {"dns", CURLINFO_NAMELOOKUP_TIME_T},
+      {"connect", CURLINFO_CONNECT_TIME_T},
+      {"tls", CURLINFO_APPCONNECT_TIME_T},
+      {"request", CURLINFO_PRETRANSFER_TIME_T},
+      {"ttfb", CURLINFO_STARTTRANSFER_TIME_T},
+      {"transfer", CURLINFO_TOTAL_TIME_T},
+  };
+  curl_off_t phase_start = 0;
+  for (const Phase &phase : PHASES) {
+    curl_off_t phase_end = 0;
+    // Phases that did not happen, such as TLS over http, report 0.
+    if (curl_easy_getinfo(curl, phase.end_info, &phase_end) != CURLE_OK ||
+        phase_end <= phase_start) {
+      continue;
+    }
+    trace::Record(phase.name, start + phase_start, phase_end - phase_start,
+                  url);
+    phase_start = phase_end;
+  }
+}
+
 Response Request::fetch(const std::string &url) const {
   Response response;
   CURL *curl = curl_.get();
@@ -22,19 +305,60 @@ Response Request::fetch(const std::string &url) const {
   LOG(INFO) << "OPERATION: " << operation_str;
   CHECK(curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, operation_str.c_str()) ==
         CURLE_OK);
+  // Otherwise curl waits for the body announced by Content-Length.
+  CHECK(curl_easy_setopt(curl, CURLOPT_NOBODY,
+                         long(operation_ == rest::constants::HEAD)) ==
+        CURLE_OK);
   CHECK(curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers_.headers()) ==
         CURLE_OK);
+  if (body_.has_value()) {
+    // Not copied: the request outlives the transfer.
+    CHECK(curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                           curl_off_t(body_->size())) == CURLE_OK);
+    CHECK(curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body_->data()) ==
+          CURLE_OK);
+  }
   CHECK(curl_easy_setopt(curl, CURLOPT_URL, url.c_str()) == CURLE_OK);
-  CHECK(curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5) == CURLE_OK);
+  CHECK(curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, long(timeout_.count())) ==
+        CURLE_OK);
   CHECK(curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L) == CURLE_OK);
   CHECK(curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback) ==
         CURLE_OK);
   // Below we set the parameter to be passed to WriteMemoryCallback
-  CHECK(curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response) == CURLE_OK);
+  BodyTarget body_target = {curl, &response, body_sink_};
+  CHECK(curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body_target) == CURLE_OK);
+  CHECK(curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback) ==
+        CURLE_OK);
+  CHECK(curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response) == CURLE_OK);
+  const Cancellation cancellation = {abandoned_, cancelled_};
+  CHECK(curl_easy_setopt(curl, CURLOPT_NOPROGRESS,
+                         long(cancelled_ == nullptr &&
+                              abandoned_ == nullptr)) == CURLE_OK);
+  CHECK(curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, ProgressCallback) ==
+        CURLE_OK);
+  CHECK(curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &cancellation) ==
+        CURLE_OK);
+  CHECK(curl_easy_setopt(curl, CURLOPT_SHARE,
+                         (pool_ == nullptr) ? nullptr : pool_->share()) ==
+        CURLE_OK);
   LOG(INFO) << "Fetching: " << url;
-  CHECK(curl_easy_perform(curl) == CURLE_OK);
-  CHECK(curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE,
-                          &(response.http_code)) == CURLE_OK);
+  const int64_t start = trace::NowMicros();
+  response.curl_code = curl_easy_perform(curl);
+  if (trace::Active()) {
+    RecordPhases(curl, start, url);
+  }
+  if (response.stopped) {
+    response.curl_code = CURLE_OK;
+  }
+  if (response.curl_code != CURLE_OK) {
+    LOG(WARNING) << "Failed fetching " << url << ": "
+                 << curl_easy_strerror(response.curl_code);
+    return response;
+  }
+  long http_code; // CURLINFO_RESPONSE_CODE expects a long.
+  CHECK(curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code) ==
+        CURLE_OK);
+  response.http_code = http_code;
   LOG(INFO) << "Fetched (Code: " << response.http_code << ")";
   return response;
 }
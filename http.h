@@ -1,28 +1,73 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <curl/curl.h>
 #include <functional>
 #include <json/json.h>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 #include "rest.h"
 
 namespace http {
 
 struct Response final {
-  Response() : http_code(-1), data() {}
+  Response() : curl_code(CURLE_OK), http_code(-1), data(), stopped(false) {}
+  // Anything other than CURLE_OK means no response was received.
+  CURLcode curl_code;
   int http_code;
   std::stringstream data;
+  // Header names are lower-cased. Only the headers of the last response are
+  // kept when redirects are followed.
+  std::map<std::string, std::string> headers;
+  // The body sink stopped the transfer: `data` holds the beginning of the
+  // body only.
+  bool stopped;
 };
 
+// The errno that file system operations fail with because of `response`, 0
+// when it succeeded: ENOENT for 404 and 410, EACCES for 401 and 403,
+// ETIMEDOUT for timeouts and EIO otherwise.
+int ErrnoOf(const Response &response);
+
+// Query parameters of a URL, names and values as they are meant, not escaped.
+using QueryParams = std::vector<std::pair<std::string, std::string>>;
+
+// "?a=1&q=x%20y" for `params`, in their order, or empty without parameters.
+// Names and values are taken literally: all but unreserved characters are
+// escaped, '%' and '+' included.
+std::string QueryString(const QueryParams &params);
+
+// The key responses of `url` are cached and shared by, the same for every
+// spelling of a URL that the server can't tell apart: scheme and host
+// lower-cased, escapes of unreserved characters decoded and the others
+// upper-cased, characters that need it escaped, query parameters sorted by
+// name (values of a name keep their order) and the fragment dropped. Bare
+// parameters ("flag") and '+' are kept as they are. Requests are sent to
+// `url` as it is.
+std::string NormalizeUrl(const std::string &url);
+
+// Sees the body of successful responses as it arrives. Returning false stops
+// the transfer.
+using BodySink = std::function<bool(std::string_view)>;
+
 using Callback = std::function<void(const Response &)>;
 
 class Headers {
 public:
   Headers() : headers_(nullptr) {}
+  Headers(const Headers &) = delete;
+  Headers &operator=(const Headers &) = delete;
   ~Headers() { curl_slist_free_all(headers_); }
   Headers &AppendHeaderLine(const std::string &header_line) {
     headers_storage_.push_back(header_line);
@@ -30,21 +75,79 @@ public:
     return *this;
   }
   const struct curl_slist *headers() const {return headers_; }
+  const std::vector<std::string> &lines() const { return headers_storage_; }
 
 private:
   std::vector<std::string> headers_storage_;
   struct curl_slist *headers_;
 };
 
+// Connections, DNS lookups and TLS sessions shared by every request that uses
+// the pool, whichever thread and API it comes from.
+class ConnectionPool final {
+public:
+  ConnectionPool();
+  ConnectionPool(const ConnectionPool &) = delete;
+  ConnectionPool &operator=(const ConnectionPool &) = delete;
+  ~ConnectionPool() { curl_share_cleanup(share_); }
+
+  CURLSH *share() const { return share_; }
+
+private:
+  static void Lock(CURL *handle, curl_lock_data data, curl_lock_access access,
+                   void *pool);
+  static void Unlock(CURL *handle, curl_lock_data data, void *pool);
+
+  CURLSH *const share_;
+  std::array<std::mutex, CURL_LOCK_DATA_LAST> mutexes_;
+};
+
 class Request final {
 public:
   Request(const rest::constants::OPERATIONS operation = rest::constants::GET,
           const Headers &headers = Headers())
-      : operation_(operation), curl_(curl_easy_init()), headers_(headers) {
+      : operation_(operation), curl_(curl_easy_init()), headers_(headers),
+        timeout_(DEFAULT_TIMEOUT), cancelled_(nullptr), abandoned_(nullptr),
+        body_sink_(nullptr), pool_(nullptr) {
+    CHECK(curl_ != NULL);
+  }
+  // Same request on a handle of its own, so both can be in flight at once.
+  Request(const Request &other) : Request(other, other.headers_) {}
+  // Same request with `headers` instead, which must outlive it.
+  Request(const Request &other, const Headers &headers)
+      : operation_(other.operation_), curl_(curl_easy_init()),
+        headers_(headers), timeout_(other.timeout_),
+        cancelled_(other.cancelled_), abandoned_(other.abandoned_),
+        body_sink_(other.body_sink_), pool_(other.pool_), body_(other.body_) {
     CHECK(curl_ != NULL);
   }
   Response fetch(const std::string &url) const;
 
+  rest::constants::OPERATIONS operation() const { return operation_; }
+  const Headers &headers() const { return headers_; }
+
+  void set_timeout(const std::chrono::milliseconds timeout) {
+    timeout_ = timeout;
+  }
+  // The transfer is aborted with CURLE_ABORTED_BY_CALLBACK soon after
+  // `*cancelled` becomes true.
+  void set_cancelled(const std::atomic<bool> *cancelled) {
+    cancelled_ = cancelled;
+  }
+  // Same as set_cancelled, for a copy whose sender may be gone: `*cancelled`
+  // is only read until `*abandoned` becomes true.
+  void set_abandoned(const std::atomic<bool> *abandoned) {
+    abandoned_ = abandoned;
+  }
+  // `*sink` must outlive the request.
+  void set_body_sink(const BodySink *sink) { body_sink_ = sink; }
+  const BodySink *body_sink() const { return body_sink_; }
+  void set_connection_pool(const ConnectionPool *pool) { pool_ = pool; }
+  // Sent as the body of the request, with its Content-Length.
+  void set_body(std::string body) { body_ = std::move(body); }
+
+  static constexpr std::chrono::milliseconds DEFAULT_TIMEOUT{5000};
+
 private:
   struct CurlCleanup {
     void operator()(CURL *curl) { curl_easy_cleanup(curl); }
@@ -52,6 +155,12 @@ private:
   const rest::constants::OPERATIONS operation_;
   const std::unique_ptr<CURL, CurlCleanup> curl_;
   const Headers &headers_;
+  std::chrono::milliseconds timeout_;
+  const std::atomic<bool> *cancelled_;
+  const std::atomic<bool> *abandoned_;
+  const BodySink *body_sink_;
+  const ConnectionPool *pool_;
+  std::optional<std::string> body_;
 };
 } // namespace http
 
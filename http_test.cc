@@ -0,0 +1,30 @@
+#include "http.h"
+#include "logger.h"
+
+int main(int argc, char *argv[]) {
+  // Parameters sorted by name, those of a name kept in order.
+  CHECK(http::NormalizeUrl("http://h/p?b=2&a=3&a=1") ==
+        "http://h/p?a=3&a=1&b=2");
+  // Bare parameters stay bare, empty ones go.
+  CHECK(http::NormalizeUrl("http://h/p?flag&a=&&") == "http://h/p?a=&flag");
+  // '+' may mean a space: it is neither escaped nor the same as %2B.
+  CHECK(http::NormalizeUrl("http://h/p?q=a+b") == "http://h/p?q=a+b");
+  CHECK(http::NormalizeUrl("http://h/p?q=a%2bb") == "http://h/p?q=a%2Bb");
+  // Escapes of unreserved characters are decoded, others upper-cased, and
+  // characters that need it escaped.
+  CHECK(http::NormalizeUrl("http://h/%7e%41/a b/%2f?q=%41%2c%zz") ==
+        "http://h/~A/a%20b/%2F?q=A%2C%25zz");
+  // Scheme and host are lower-cased, the path and user are not.
+  CHECK(http::NormalizeUrl("HTTP://User@Example.COM:8080/Path") ==
+        "http://User@example.com:8080/Path");
+  // Fragments are dropped.
+  CHECK(http::NormalizeUrl("http://h/p?q=1#top") == "http://h/p?q=1");
+  CHECK(http::NormalizeUrl("http://h/p#a?b") == "http://h/p");
+
+  // Query strings take names and values literally.
+  CHECK(http::QueryString({}).empty());
+  CHECK(http::QueryString({{"q", "a b+c"}, {"p", "%41"}}) ==
+        "?q=a%20b%2Bc&p=%2541");
+  LOG(INFO) << "Success";
+  return 0;
+}
@@ -13,10 +13,12 @@ Logger::Logger(const Level level, std::ostream *os)
 
 const Logger &Logger::printprefix() const {
   const time_t rawtime = time(nullptr);
-  const struct tm *timeinfo = localtime(&rawtime);
+  struct tm timeinfo;
+  localtime_r(&rawtime, &timeinfo);
 
-  static char buffer_[EXAMPLE_LEN];
-  strftime(buffer_, 80, TIME_FORMAT, timeinfo);
+  // Any thread may log.
+  thread_local char buffer_[EXAMPLE_LEN];
+  strftime(buffer_, sizeof(buffer_), TIME_FORMAT, &timeinfo);
   (*stream()) << level_char_ << LEVEL_CHAR_SEP << buffer_;
   return *this;
 }
@@ -0,0 +1,53 @@
+#include "lookup.h"
+
+#include <cerrno>
+
+namespace lookup {
+
+// Rejected names counted one by one, the first ones seen.
+constexpr size_t MAX_REJECTED_NAMES = 64;
+
+NameFilter::NameFilter(const route::Matcher &matcher, const IsOpen &is_open)
+    : matcher_(matcher) {
+  const path::NodeTable &table = matcher.table();
+  open_.reserve(table.size());
+  for (path::NodeIndex idx = 0; idx < table.size(); ++idx) {
+    open_.push_back(is_open(table.node(idx)));
+  }
+}
+
+void Counters::Rejected(const std::string_view path) {
+  const std::string_view name = path.substr(path.rfind('/') + 1);
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++lookups_;
+  ++rejected_;
+  const auto it = rejected_names_.find(name);
+  if (it != rejected_names_.end()) {
+    ++it->second;
+  } else if (rejected_names_.size() < MAX_REJECTED_NAMES) {
+    rejected_names_.emplace(name, 1);
+  }
+}
+
+void Counters::Resolved(const int result) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++lookups_;
+  if (result == -ENOENT) {
+    ++missed_;
+  }
+}
+
+Json::Value Counters::Metrics() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Json::Value metrics;
+  metrics["lookups"] = Json::UInt64(lookups_);
+  metrics["rejected"] = Json::UInt64(rejected_);
+  metrics["missed"] = Json::UInt64(missed_);
+  metrics["rejected_names"] = Json::Value(Json::objectValue);
+  for (const auto &[name, count] : rejected_names_) {
+    metrics["rejected_names"][name] = Json::UInt64(count);
+  }
+  return metrics;
+}
+
+} // namespace lookup
@@ -0,0 +1,76 @@
+#ifndef LOOKUP_H
+#define LOOKUP_H
+
+#include "path.h"
+#include "route.h"
+
+#include <functional>
+#include <json/json.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Turns away lookups of names that can't exist before they cost anything.
+//
+// Shells, file managers and IDEs probe every directory they visit for names
+// such as .git, .hidden, desktop.ini or autorun.inf. Those lookups outnumber
+// the ones that find something, and resolving each of them, logging
+// included, only to answer ENOENT is wasted work.
+namespace lookup {
+
+// Tells whether a path may match a node of the table of a route::Matcher,
+// through the parameters the matcher compiled. It neither splits the path
+// into strings nor collects the values of parameters, which makes turning a
+// probe away cost a few binary searches.
+class NameFilter final {
+public:
+  // Called for nodes below which any path may exist, such as directories
+  // whose content is not in the table.
+  using IsOpen = std::function<bool(const path::Node &)>;
+
+  // `matcher` must outlive the filter.
+  NameFilter(const route::Matcher &matcher, const IsOpen &is_open);
+  NameFilter(const NameFilter &) = delete;
+  NameFilter &operator=(const NameFilter &) = delete;
+
+  // Whether `path`, relative to the root of the table, may match one of its
+  // nodes. Paths it rejects surely match nothing.
+  bool MayMatch(std::string_view path) const {
+    return matcher_.MayMatch(path, open_);
+  }
+
+private:
+  const route::Matcher &matcher_;
+  std::vector<bool> open_;
+};
+
+// Counts lookups by outcome, and how often the first names rejected were.
+// Thread-safe.
+class Counters final {
+public:
+  Counters() : lookups_(0), rejected_(0), missed_(0) {}
+  Counters(const Counters &) = delete;
+  Counters &operator=(const Counters &) = delete;
+
+  // A lookup of `path` turned away by a NameFilter.
+  void Rejected(std::string_view path);
+  // A lookup that went through, with the result of the operation.
+  void Resolved(const int result);
+
+  Json::Value Metrics() const;
+
+private:
+  mutable std::mutex mutex_;
+  size_t lookups_;
+  size_t rejected_;
+  // Lookups that went through and found nothing.
+  size_t missed_;
+  // Rejections by file name, for the first names seen.
+  std::map<std::string, size_t, std::less<>> rejected_names_;
+};
+
+} // namespace lookup
+
+#endif
@@ -0,0 +1,69 @@
+#include "lookup.h"
+#include "route.h"
+
+static path::NodeTable NewTable(const std::vector<std::string> &dirs) {
+  path::NodeTableBuilder builder;
+  for (const std::string &dir : dirs) {
+    CHECK(builder.Insert(dir, path::DirNode(path::Path(dir).filename(),
+                                            nullptr)));
+  }
+  return builder.Build();
+}
+
+int main(int argc, char *argv[]) {
+  const path::NodeTable table =
+      NewTable({"/users", "/users/me", "/users/{id}", "/users/{id}/posts",
+                "/search", "/search/{q}.get.json", "/search/{q}.get.json.d",
+                "/data", "/data/get.json.d"});
+  const route::Matcher matcher(table);
+  const lookup::NameFilter filter(matcher, [](const path::Node &node) {
+    const std::string_view name = node.name();
+    return name.size() > 2 && name.substr(name.size() - 2) == ".d";
+  });
+
+  // Whatever matches goes through.
+  for (const char *path :
+       {"/", "/users", "/users/me", "/users/42/posts", "/users/{id:42}/posts",
+        "/search/shoes.get.json", "/search//{q:a}.get.json"}) {
+    CHECK(matcher.Match(path) != path::NO_NODE || std::string(path) == "/");
+    CHECK(filter.MayMatch(path));
+  }
+  CHECK(filter.MayMatch(""));
+
+  // Below open directories, anything does.
+  CHECK(filter.MayMatch("/data/get.json.d/items/0/.git"));
+  CHECK(filter.MayMatch("/search/shoes.get.json.d/a/b"));
+
+  // Probes of names that don't exist are turned away.
+  for (const char *path :
+       {"/.git", "/desktop.ini", "/users/.hidden/x", "/users/me/.git",
+        "/search/.get.json", "/search/x.txt", "/users/{other:42}.json",
+        "/users/42/posts/1", "/users/{id:42,x:1}/posts"}) {
+    CHECK(matcher.Match(path) == path::NO_NODE);
+    CHECK(!filter.MayMatch(path));
+  }
+
+  // Parameters take hidden and probed names only when spelled as bindings.
+  for (const char *path :
+       {"/users/.git", "/users/.hidden/posts", "/users/Desktop.ini",
+        "/users/autorun.inf", "/search/.x.get.json"}) {
+    CHECK(matcher.Match(path) == path::NO_NODE);
+    CHECK(!filter.MayMatch(path));
+  }
+  CHECK(filter.MayMatch("/users/{id:.git}"));
+  CHECK(matcher.Match("/users/{id:desktop.ini}/posts") != path::NO_NODE);
+  CHECK(filter.MayMatch("/users/git"));
+
+  lookup::Counters counters;
+  counters.Rejected("/a/.git");
+  counters.Rejected("/b/.git");
+  counters.Resolved(0);
+  counters.Resolved(-ENOENT);
+  const Json::Value metrics = counters.Metrics();
+  CHECK(metrics["lookups"].asUInt64() == 4);
+  CHECK(metrics["rejected"].asUInt64() == 2);
+  CHECK(metrics["missed"].asUInt64() == 1);
+  CHECK(metrics["rejected_names"][".git"].asUInt64() == 2);
+  LOG(INFO) << "Success";
+  return 0;
+}
@@ -2,24 +2,40 @@
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
+#include "batch.h"
+#include "cache.h"
+#include "collection.h"
 #include "http.h"
 #include "logger.h"
+#include "lookup.h"
+#include "mount.h"
 #include "openapi.h"
 #include "path.h"
+#include "prefetch.h"
+#include "probe.h"
+#include "projection.h"
 #include "rest.h"
+#include "scheduler.h"
+#include "trace.h"
+#include "worker.h"
+#include "writeback.h"
 
 #include <algorithm>
+#include <csignal>
+#include <cstring>
 #include <curl/curl.h>
 #include <filesystem>
-#include <fstream>
+#include <functional>
 #include <fuse3/fuse.h>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <sstream>
 #include <string.h>
 #include <string>
 #include <unistd.h>
 #include <unordered_set>
+#include <vector>
 
 ABSL_FLAG(std::string, api_spec_addr, "/dev/null",
           "Address of the API spec (openapi.json). May be local path or url "
@@ -34,9 +50,193 @@ ABSL_FLAG(std::string, mount_location, "",
 ABSL_FLAG(std::string, header_file_addr, "/dev/null",
           "List of headers to be attached");
 
+ABSL_FLAG(std::string, collections_addr, "",
+          "Address of a JSON file mapping reference directories (e.g. "
+          "/v2/order/capture/{soid}) to the collection endpoints listing their "
+          "values. May be local path or url starting with 'http'.");
+
+ABSL_FLAG(double, host_qps, 0,
+          "Requests per second allowed for each upstream host. 0 means "
+          "unlimited.");
+
+ABSL_FLAG(double, host_burst, 0,
+          "Requests that may be sent at once to a host after it was idle. "
+          "Defaults to --host_qps.");
+
+ABSL_FLAG(double, endpoint_qps, 0,
+          "Requests per second allowed for each endpoint (path template). 0 "
+          "means unlimited.");
+
+ABSL_FLAG(double, endpoint_burst, 0,
+          "Requests that may be sent at once to an endpoint after it was "
+          "idle. Defaults to --endpoint_qps.");
+
+ABSL_FLAG(int, max_retries, 3,
+          "Retries of requests throttled by the upstream (429/503).");
+
+ABSL_FLAG(int, max_retry_after_seconds, 60,
+          "Upper bound for the delays asked by the upstream through "
+          "Retry-After.");
+
+ABSL_FLAG(double, hedge_budget, 0,
+          "Fraction of GET/HEAD requests that may be sent a second time when "
+          "they run past the p95 latency of their endpoint. 0 disables "
+          "hedging.");
+
+ABSL_FLAG(int, hedge_parallelism, 4,
+          "Second copies of hedged requests sent at once. The first copy is "
+          "sent from the thread of the request.");
+
+ABSL_FLAG(double, timeout_multiplier, 3,
+          "Requests time out after this many times the p99 latency of their "
+          "endpoint.");
+
+ABSL_FLAG(int, min_timeout_ms, 500, "Lower bound for adaptive timeouts.");
+
+ABSL_FLAG(int, max_timeout_ms, 5000,
+          "Upper bound for adaptive timeouts, also used for endpoints without "
+          "latency history.");
+
+ABSL_FLAG(int, breaker_failures, 5,
+          "Failed requests in a row, by transport errors or 5xx responses, "
+          "after which requests to an endpoint fail right away. 0 disables "
+          "the circuit breakers.");
+
+ABSL_FLAG(int, breaker_open_seconds, 10,
+          "How long requests to a failing endpoint fail right away before "
+          "one is let through to check whether it recovered.");
+
+ABSL_FLAG(int, negative_cache_ms, 2000,
+          "How long a failed GET, 404s included, is answered with the same "
+          "failure without a request. 0 disables it.");
+
+// Failed GETs remembered at most.
+constexpr size_t NEGATIVE_CACHE_ENTRIES = 10000;
+
+ABSL_FLAG(std::string, manifest_addr, "",
+          "Address of a JSON manifest listing several APIs to mount, each "
+          "under its own subdirectory: [{\"spec\": ..., \"host\": ..., "
+          "\"headers\": ..., \"collections\": ..., \"subdirectory\": "
+          "...}]. Takes the place of --api_spec_addr, --api_host_addr, "
+          "--header_file_addr and --collections_addr.");
+
+ABSL_FLAG(int64_t, cache_bytes, 64 << 20,
+          "Memory budget of the response cache shared by all mounted APIs.");
+
+ABSL_FLAG(int, cache_ttl_seconds, 0,
+          "How long GET responses are served from the cache. 0 disables "
+          "caching.");
+
+ABSL_FLAG(std::string, disk_cache_dir, "",
+          "Directory keeping GET responses across restarts. Responses older "
+          "than --cache_ttl_seconds are revalidated with their ETag. Empty "
+          "disables it.");
+
+ABSL_FLAG(int64_t, disk_cache_bytes, int64_t(1) << 30,
+          "Disk budget of --disk_cache_dir.");
+
+ABSL_FLAG(int, worker_threads, 4,
+          "Threads running background work for all mounted APIs.");
+
+ABSL_FLAG(bool, watch_specs, true,
+          "Reload the API specs when they change, without remounting.");
+
+ABSL_FLAG(int, spec_poll_seconds, 60,
+          "How often specs served over http are checked for changes. 0 "
+          "disables polling them.");
+
+ABSL_FLAG(double, trace_sample_rate, 0,
+          "Fraction of file system operations traced, 0 disabling tracing. "
+          "The spans are read from /.restfs/trace.json.");
+
+ABSL_FLAG(int, trace_buffer_events, 16384,
+          "Spans kept per thread for /.restfs/trace.json.");
+
+ABSL_FLAG(std::string, trace_file, "",
+          "Where SIGUSR1 dumps the spans. Empty leaves SIGUSR1 alone.");
+
+ABSL_FLAG(int64_t, size_probe_entries, 100000,
+          "URLs whose response size is remembered so that GET files report "
+          "it. Unknown sizes are probed in the background with HEAD "
+          "requests. 0 disables probing.");
+
+ABSL_FLAG(int, size_probe_parallelism, 16,
+          "HEAD requests probing sizes sent at once, within the limits of the "
+          "scheduler.");
+
+ABSL_FLAG(bool, readdirplus, true,
+          "Lists directories with the attributes of every entry, sizes of "
+          "GET files included, so that ls -l costs no getattr per entry. "
+          "Listing the values of a reference also probes the sizes of the "
+          "GET files below them, all at once.");
+
+ABSL_FLAG(int, batch_parallelism, 16,
+          "Requests in flight per batch file read. See batch.h.");
+
+ABSL_FLAG(int64_t, projection_prefix_bytes, 16 << 20,
+          "Memory for the beginnings of responses whose transfer stopped "
+          "once a projected value was read. Kept for --cache_ttl_seconds.");
+
+ABSL_FLAG(double, negative_lookup_seconds, 5,
+          "How long the kernel remembers that a name does not exist, so that "
+          "the probes of shells and IDEs for names such as .git are answered "
+          "without asking restfs again. Paths added by a spec reload may show "
+          "up that late.");
+
+ABSL_FLAG(int, prefetch_links, 0,
+          "Resources a GET response links to, through members named after a "
+          "path parameter such as \"soid\", prefetched into the response "
+          "cache at most per response. Needs --cache_ttl_seconds. 0 disables "
+          "prefetching. See prefetch.h.");
+
+ABSL_FLAG(int, prefetch_budget, 64,
+          "Prefetches queued or in flight at most. Links past it are "
+          "dropped.");
+
+ABSL_FLAG(double, prefetch_min_hit_rate, 0.25,
+          "Fraction of the prefetched responses that must be read for "
+          "prefetching not to be turned down.");
+
+ABSL_FLAG(bool, write_behind, false,
+          "Sends what is written to operation files, such as post.json, in "
+          "the background: close returns once the body is queued, and fsync "
+          "waits until it was answered. Failures are listed by "
+          "/.restfs/writes.json. See writeback.h.");
+
+ABSL_FLAG(int, write_behind_queue, 1024,
+          "Writes queued or in flight at most. Closing more files waits for "
+          "room.");
+
+ABSL_FLAG(int, write_behind_parallelism, 8,
+          "Writes sent at once, each to a different resource. Writes to one "
+          "resource are sent one at a time, in order.");
+
+ABSL_FLAG(std::string, write_behind_journal, "",
+          "Directory where queued writes are stored until answered, so that "
+          "writes left when restfs stops are sent when it starts again. "
+          "Empty keeps them in memory only.");
+
+// Prefetches sent at once, leaving the workers to interactive traffic.
+constexpr size_t PREFETCH_PARALLELISM = 2;
+
 struct PrivateContext {
-  const openapi::Directory dir_;
-  const http::Headers headers_;
+  const mount::Table &mounts_;
+  scheduler::Scheduler &scheduler_;
+  cache::ResponseCache &cache_;
+  // Null when responses are not kept on disk.
+  cache::DiskCache *disk_cache_;
+  probe::SizeProber &sizes_;
+  projection::PrefixCache &prefixes_;
+  worker::Pool &workers_;
+  batch::Table &batches_;
+  lookup::Counters &lookups_;
+  prefetch::Prefetcher &prefetcher_;
+  // Null when writes are sent as files are flushed.
+  writeback::Queue *writes_;
+  // Null when specs are not watched.
+  mount::Watcher *watcher_;
+  // Set once fuse is initialized.
+  struct fuse *fuse_;
 };
 
 const PrivateContext *private_context() {
@@ -45,23 +245,158 @@ const PrivateContext *private_context() {
   return ctx;
 }
 
-const openapi::Directory &directory() {
-  return private_context()->dir_;
+const mount::Table &mounts() { return private_context()->mounts_; }
+
+scheduler::Scheduler &request_scheduler() {
+  return private_context()->scheduler_;
 }
 
-const http::Headers &headers() {
-  return private_context()->headers_;
+cache::ResponseCache &response_cache() { return private_context()->cache_; }
+
+cache::DiskCache *disk_cache() { return private_context()->disk_cache_; }
+
+probe::SizeProber &size_prober() { return private_context()->sizes_; }
+
+batch::Table &batches() { return private_context()->batches_; }
+
+lookup::Counters &lookup_counters() { return private_context()->lookups_; }
+
+prefetch::Prefetcher &prefetcher() { return private_context()->prefetcher_; }
+
+writeback::Queue *write_queue() { return private_context()->writes_; }
+
+projection::PrefixCache &projection_prefixes() {
+  return private_context()->prefixes_;
 }
 
-int api_getattr(const char *path, struct stat *stat,
-                struct fuse_file_info *fi) {
-  LOG(INFO) << "api_get_attr: " << path;
-  auto found = directory().find(path);
-  if (found == directory().end()) {
-    LOG(INFO) << path << " - NOT FOUND!";
-    return -ENOENT;
+// Makes the kernel drop what it cached about `path`. Runs on a worker: the
+// kernel may wait for operations on `path` in flight, such as the caller.
+void InvalidateLater(const path::Path &path) {
+  struct fuse *fuse = private_context()->fuse_;
+  private_context()->workers_.Run(
+      [fuse, path]() { fuse_invalidate_path(fuse, path.c_str()); });
+}
+
+// Virtual files under STATUS_DIR report the internal state of the mount.
+const path::Path STATUS_DIR = "/.restfs";
+using StatusFile = std::function<Json::Value()>;
+
+const std::map<std::string, StatusFile> &status_files() {
+  static const std::map<std::string, StatusFile> files = {
+      {"cache.json", []() { return response_cache().Metrics(); }},
+      {"disk_cache.json",
+       []() {
+         return (disk_cache() == nullptr) ? Json::Value()
+                                          : disk_cache()->Metrics();
+       }},
+      {"lookups.json", []() { return lookup_counters().Metrics(); }},
+      {"prefetch.json", []() { return prefetcher().Metrics(); }},
+      {"projections.json",
+       []() { return projection_prefixes().Metrics(); }},
+      {"scheduler.json", []() { return request_scheduler().Metrics(); }},
+      {"sizes.json", []() { return size_prober().Metrics(); }},
+      {"trace.json", []() { return trace::ChromeTrace(); }},
+      {"writes.json",
+       []() {
+         return (write_queue() == nullptr) ? Json::Value()
+                                           : write_queue()->Metrics();
+       }},
+  };
+  return files;
+}
+
+// Returns nullptr when `path` is not a status file.
+const StatusFile *FindStatusFile(const path::Path &path) {
+  if (path.parent_path() != STATUS_DIR) {
+    return nullptr;
   }
-  *stat = found->second.stat();
+  const auto it = status_files().find(path.filename());
+  return (it == status_files().end()) ? nullptr : &it->second;
+}
+
+const std::string ReadStatusFile(const StatusFile &status_file) {
+  Json::StreamWriterBuilder builder;
+  builder["indentation"] = "  ";
+  return Json::writeString(builder, status_file());
+}
+
+// Operation of a file such as /v2/orders/{soid}/get.json, or
+// {q}.get.json when it has required query parameters. Returns INVALID for
+// other files, metadata and batch files included.
+rest::constants::OPERATIONS OperationOf(const path::Path &template_path) {
+  if (template_path.extension() != ".json") {
+    return rest::constants::INVALID;
+  }
+  const std::string stem = template_path.filename().stem();
+  const size_t dot = stem.rfind('.');
+  const auto find_it = rest::constants::operations_map().find(
+      (dot == stem.npos) ? stem : stem.substr(dot + 1));
+  return (find_it == rest::constants::operations_map().end())
+             ? rest::constants::INVALID
+             : find_it->second;
+}
+
+bool IsBatchFile(const path::Path &template_path) {
+  return template_path.filename() == openapi::BATCH_FILENAME;
+}
+
+// URL of the operation file at `path` within `directory`. References the path
+// of the operation doesn't take, such as q and limit of
+// /search/{q:shoes,limit:10}.get.json, are sent as query parameters. Caches
+// key the responses by http::NormalizeUrl of it, which all the spellings of
+// `path` share.
+std::string OperationUrl(const openapi::Directory &directory,
+                         const path::Path &path) {
+  const path::Path value_path =
+      path::utils::BindRefs(path, path::utils::ValueBinder);
+  std::string url =
+      directory.directory_url_prefix() + value_path.parent_path().string();
+  path::RefValueMap bindings;
+  const auto it = directory.find(path, &bindings);
+  if (it != directory.end()) {
+    const path::RefSet path_refs =
+        path::utils::RefSetFromPath(it->first.parent_path());
+    http::QueryParams query;
+    for (auto &[ref, value] : bindings) {
+      if (!value.empty() && path_refs.count(ref) == 0) {
+        query.emplace_back(ref, std::move(value));
+      }
+    }
+    std::sort(query.begin(), query.end());
+    url += http::QueryString(query);
+  }
+  return url;
+}
+
+// Size of the response of the GET file at `path`, 0 while unknown: such files
+// are opened with direct_io. Files whose parameters all have values are
+// probed in the background, and their attributes invalidated once the size
+// is known.
+size_t OperationSize(const mount::Mount &mount,
+                     const openapi::Directory &directory,
+                     const path::Path &path, const path::Path &template_path,
+                     const path::RefValueMap &bindings) {
+  const std::string url = OperationUrl(directory, path);
+  const std::string key = http::NormalizeUrl(url);
+  if (const auto size = size_prober().Find(key)) {
+    return *size;
+  }
+  if (const auto cached = response_cache().Find(key)) {
+    size_prober().Learn(key, cached->body.size());
+    return cached->body.size();
+  }
+  for (const auto &[ref, value] : bindings) {
+    if (value.empty()) {
+      return 0;
+    }
+  }
+  struct fuse *fuse = private_context()->fuse_;
+  size_prober().Probe(
+      url, key, mount.name() + template_path.parent_path().string(),
+      &mount.headers(),
+      [fuse, full_path = mount.FullPath(path)]() {
+        fuse_invalidate_path(fuse, full_path.c_str());
+      });
   return 0;
 }
 
@@ -71,8 +406,9 @@ inline bool ends_with(const std::string &value, const std::string &ending) {
   return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
 }
 
-int str_to_buffer(const std::string &content, char *buf, size_t size,
+int str_to_buffer(const std::string_view content, char *buf, size_t size,
                   off_t offset) {
+  const trace::Span span("copy");
   const size_t len = content.length();
 
   if (offset >= (off_t)len) {
@@ -80,107 +416,940 @@ int str_to_buffer(const std::string &content, char *buf, size_t size,
   }
 
   if (offset + size > len) {
-    memcpy(buf, content.c_str() + offset, len - offset);
+    memcpy(buf, content.data() + offset, len - offset);
     return len - offset;
   }
 
-  memcpy(buf, content.c_str() + offset, size);
+  memcpy(buf, content.data() + offset, size);
   return size;
 }
 
-const std::string ReadMetadataNode(const path::Path &path,
-                                   const path::Node &node) {
-  const Json::Value *data = node.data<Json::Value>();
-  Json::StreamWriterBuilder builder;
-  builder["indentation"] = "  "; // assume default for comments is None
-  const std::string result = Json::writeString(builder, *data);
-  return result;
-}
-
 const std::string ReadEntityNode(const path::Path &path,
                                  const path::Node &node) {
   const openapi::Entity *v = node.data<openapi::Entity>();
   return v->path.string();
 }
 
-const std::string ReadOperationNode(const path::Path &path,
-                                    const path::Node &node) {
-  const path::Path filestem = node.path().filename().stem();
-  const std::string operation_str =
-      (filestem.has_extension()) ? filestem.extension() : filestem.stem();
-  const auto find_it = rest::constants::operations_map().find(operation_str);
-  if (find_it == rest::constants::operations_map().end()) {
+// Links of a response of `mount` to the GET files taking a member of it as
+// parameter, such as /v2/orders/42/get.json for {"soid": "42"}. The other
+// parameters of those files take their values from `bindings`, those of the
+// response, or the file is not linked. Runs on the threads of the prefetcher.
+prefetch::Resolve
+LinkResolver(const mount::Mount &mount,
+             std::shared_ptr<const openapi::Directory> directory,
+             path::RefValueMap bindings) {
+  return [&mount, directory = std::move(directory),
+          bindings = std::move(bindings)](const std::string &key,
+                                          const std::string &value) {
+    std::vector<prefetch::Link> links;
+    for (const path::NodeIndex index : directory->GetsTaking(key)) {
+      const path::Path template_path = directory->table().PathOf(index);
+      bool bound = true;
+      const path::Path path = path::utils::BindRefs(
+          template_path,
+          [&](const path::Ref &ref, const std::string &) -> const path::Ref {
+            if (ref == key) {
+              return value;
+            }
+            const auto it = bindings.find(ref);
+            if (it == bindings.end() || it->second.empty()) {
+              bound = false;
+              return ref;
+            }
+            return it->second;
+          });
+      if (bound) {
+        links.push_back(
+            {directory->directory_url_prefix() + path.parent_path().string(),
+             mount.name() + template_path.parent_path().string()});
+      }
+    }
+    return links;
+  };
+}
+
+// Returns the response of the operation file at `path`, from the cache when
+// possible, or nullptr with the negated errno in `error` when the request
+// fails.
+//
+// Responses that are not cached are read through `sink`, when given. Returns
+// nullptr with no error when the sink stopped the transfer: the body is not
+// complete, nor cached.
+std::shared_ptr<const cache::Entry>
+FetchOperation(const mount::Mount &mount,
+               const std::shared_ptr<const openapi::Directory> &directory,
+               const path::Path &path, const path::Path &template_path,
+               int *error, const http::BodySink *sink = nullptr) {
+  *error = 0;
+  const rest::constants::OPERATIONS operation = OperationOf(template_path);
+  if (operation == rest::constants::INVALID) {
     LOG(INFO) << "Unexpected file name";
-    return "";
+    *error = -EINVAL;
+    return nullptr;
+  }
+  const std::string url = OperationUrl(*directory, path);
+  const std::string key = http::NormalizeUrl(url);
+  const trace::Span span("fetch", url);
+  const bool cacheable = operation == rest::constants::GET;
+  auto learn_size = [&mount, &path, &key](auto entry) {
+    if (size_prober().Learn(key, entry->body.size())) {
+      InvalidateLater(mount.FullPath(path));
+    }
+    return entry;
+  };
+  std::shared_ptr<const cache::Entry> stored;
+  if (cacheable) {
+    auto cached = response_cache().Find(key);
+    if (cached != nullptr) {
+      prefetcher().Used(key);
+      return cached;
+    }
+    if (disk_cache() != nullptr) {
+      const trace::Span span("disk_cache");
+      stored = disk_cache()->Find(key);
+    }
+    if (stored != nullptr && stored->expires > cache::Clock::now()) {
+      response_cache().Insert(key, stored);
+      return learn_size(stored);
+    }
   }
-  const path::Path value_path =
-      path::utils::BindRefs(path, path::utils::ValueBinder);
 
-  const http::Response response =
-      http::Request(find_it->second, headers())
-          .fetch(directory().directory_url_prefix() +
-                 value_path.parent_path().string());
+  // Stale bodies are revalidated rather than sent again.
+  const bool revalidate = stored != nullptr && !stored->etag.empty();
+  http::Headers conditional_headers;
+  if (revalidate) {
+    for (const std::string &line : mount.headers().lines()) {
+      conditional_headers.AppendHeaderLine(line);
+    }
+    conditional_headers.AppendHeaderLine("If-None-Match: " + stored->etag);
+  }
+  http::Request request(operation,
+                        revalidate ? conditional_headers : mount.headers());
+  request.set_body_sink(sink);
+  const http::Response response = request_scheduler().Fetch(
+      scheduler::INTERACTIVE,
+      mount.name() + template_path.parent_path().string(), request, url);
+  if (response.stopped) {
+    return nullptr;
+  }
+  if (revalidate && response.http_code == 304) {
+    auto refreshed = disk_cache()->Refresh(key);
+    if (refreshed == nullptr) {
+      refreshed = stored;
+    }
+    response_cache().Insert(key, refreshed);
+    return learn_size(refreshed);
+  }
   if (response.http_code != 200) {
     LOG(INFO) << response.data.str();
-    return "";
+    // A stale body beats no body while the server is failing.
+    if (stored != nullptr &&
+        (response.curl_code != CURLE_OK || response.http_code >= 500)) {
+      LOG(WARNING) << "Serving a stale response of " << url;
+      return stored;
+    }
+    const int code = http::ErrnoOf(response);
+    *error = -((code != 0) ? code : EIO);
+    return nullptr;
+  }
+  if (!cacheable) {
+    return std::make_shared<const cache::Entry>(cache::Entry{
+        response.http_code, cache::Body(response.data.str()),
+        cache::Clock::now()});
+  }
+  const auto etag_it = response.headers.find("etag");
+  auto entry = response_cache().Insert(
+      key, response.http_code, response.data.str(),
+      (etag_it == response.headers.end()) ? "" : etag_it->second);
+  if (cache::DiskCache *disk = disk_cache()) {
+    private_context()->workers_.Run(
+        [disk, key, entry]() { disk->Insert(key, *entry); });
+  }
+  if (prefetcher().enabled()) {
+    path::RefValueMap bindings;
+    directory->find(path, &bindings);
+    prefetcher().Follow(entry, &mount.headers(),
+                        LinkResolver(mount, directory, std::move(bindings)));
+  }
+  return learn_size(entry);
+}
+
+// A path below the projection directory of a GET file, such as
+// /v2/orders/42/get.json.d/items/0/name: the value at /items/0/name in the
+// response of /v2/orders/42/get.json.
+struct Projection final {
+  path::Path path;
+  path::Path template_path;
+  // Unescaped tokens of the pointer, none for the directory itself.
+  std::vector<std::string> pointer;
+};
+
+std::optional<Projection> FindProjection(const openapi::Directory &directory,
+                                         const path::Path &path) {
+  const std::string suffix = std::string(".json") + openapi::PROJECTION_SUFFIX;
+  if (path.string().find(suffix) == std::string::npos) {
+    return std::nullopt;
+  }
+  path::Path prefix;
+  for (auto part = path.begin(); part != path.end(); ++part) {
+    const std::string name = part->string();
+    if (name.size() > suffix.size() &&
+        name.compare(name.size() - suffix.size(), suffix.size(), suffix) ==
+            0) {
+      const path::Path operation_path =
+          prefix / name.substr(0, name.size() -
+                                      strlen(openapi::PROJECTION_SUFFIX));
+      const auto it = directory.find(operation_path);
+      if (it != directory.end() &&
+          OperationOf(it->first) == rest::constants::GET) {
+        Projection projection = {operation_path, it->first, {}};
+        for (++part; part != path.end(); ++part) {
+          if (!part->empty()) {
+            projection.pointer.push_back(
+                projection::UnescapeToken(part->string()));
+          }
+        }
+        return projection;
+      }
+    }
+    prefix /= *part;
+  }
+  return std::nullopt;
+}
+
+// Extracts the value of `projection` from the cached response, or from the
+// response as it arrives, stopping the transfer once the value is complete.
+// The beginning that was read is kept: the values below the one read are
+// looked up next, one path segment at a time.
+//
+// Sets `error` to the negated errno unless the value was found.
+projection::Extractor
+Project(const mount::Mount &mount,
+        const std::shared_ptr<const openapi::Directory> &directory,
+        const Projection &projection, int *error) {
+  const std::string url = OperationUrl(*directory, projection.path);
+  const std::string key = http::NormalizeUrl(url);
+  const trace::Span span("project", url);
+  auto set_error = [error](const projection::Extractor &extractor) {
+    *error = (extractor.status() == projection::FOUND)     ? 0
+             : (extractor.status() == projection::MISSING) ? -ENOENT
+                                                           : -EIO;
+  };
+  if (const auto prefix = projection_prefixes().Find(key)) {
+    projection::Extractor extractor(projection.pointer);
+    if (extractor.Feed(*prefix) != projection::MORE) {
+      set_error(extractor);
+      return extractor;
+    }
+  }
+  projection::Extractor extractor(projection.pointer);
+  std::string received;
+  bool streamed = false;
+  const http::BodySink sink = [&extractor, &received,
+                               &streamed](const std::string_view chunk) {
+    streamed = true;
+    received.append(chunk);
+    return extractor.Feed(chunk) == projection::MORE;
+  };
+  const auto entry = FetchOperation(mount, directory, projection.path,
+                                    projection.template_path, error, &sink);
+  if (*error != 0) {
+    return extractor;
+  }
+  if (!streamed && entry != nullptr) {
+    extractor.Feed(entry->body.view());
+  } else if (streamed && entry == nullptr &&
+             extractor.status() != projection::MORE) {
+    projection_prefixes().Insert(key, std::move(received));
+  }
+  extractor.Finish();
+  set_error(extractor);
+  return extractor;
+}
+
+bool IsContainer(const std::string &value) {
+  return !value.empty() && (value[0] == '{' || value[0] == '[');
+}
+
+// Objects and arrays are directories, other values files of their JSON text.
+int ProjectionAttributes(
+    const mount::Mount &mount,
+    const std::shared_ptr<const openapi::Directory> &directory,
+    const path::Path &path, const Projection &projection, struct stat *stat) {
+  if (projection.pointer.empty()) {
+    *stat = path::DirNode(path.filename(), nullptr).stat();
+    return 0;
+  }
+  int error = 0;
+  const projection::Extractor extractor =
+      Project(mount, directory, projection, &error);
+  if (error != 0) {
+    return error;
+  }
+  *stat = IsContainer(extractor.value())
+              ? path::DirNode(path.filename(), nullptr).stat()
+              : path::SimpleFileNode(path.filename(), nullptr,
+                                     extractor.value().size(), {S_IREAD})
+                    .stat();
+  return 0;
+}
+
+// Lists the keys of an object, escaped, or the indexes of an array.
+int ReadProjectionDir(
+    const mount::Mount &mount,
+    const std::shared_ptr<const openapi::Directory> &directory,
+    const Projection &projection, void *buf, fuse_fill_dir_t filler) {
+  int error = 0;
+  const projection::Extractor extractor =
+      Project(mount, directory, projection, &error);
+  if (error != 0) {
+    return error;
+  }
+  const std::string &text = extractor.value();
+  if (!IsContainer(text)) {
+    return -ENOTDIR;
+  }
+  Json::CharReaderBuilder builder;
+  const std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+  Json::Value value;
+  if (!reader->parse(text.data(), text.data() + text.size(), &value,
+                     nullptr)) {
+    return -EIO;
+  }
+  std::vector<std::string> names;
+  if (value.isObject()) {
+    for (const std::string &key : value.getMemberNames()) {
+      // Not file names.
+      if (!key.empty() && key != "." && key != "..") {
+        names.push_back(projection::EscapeToken(key));
+      }
+    }
+  } else {
+    for (Json::ArrayIndex idx = 0; idx < value.size(); ++idx) {
+      names.push_back(std::to_string(idx));
+    }
+  }
+  for (const std::string &name : names) {
+    if (filler(buf, name.c_str(), nullptr, 0, (fuse_fill_dir_flags)0)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Reads the batch file at `path` within `mount`, `full_path` as mounted. Its
+// IDs name the GET files next to it: ID 42 of /v2/orders/batch.get.ndjson
+// is /v2/orders/42/get.json.
+int ReadBatchFile(const mount::Mount &mount,
+                  const openapi::Directory &directory, const path::Path &path,
+                  const std::string &full_path, char *buf, size_t size,
+                  off_t offset) {
+  const auto start = [&mount, &directory,
+                      &path](const std::vector<std::string> &ids) {
+    std::vector<batch::Item> items;
+    for (const std::string &id : ids) {
+      batch::Item item = {id, "", ""};
+      const path::Path item_path = path.parent_path() / id / "get.json";
+      const auto it = (id.find('/') == id.npos && id != "." && id != "..")
+                          ? directory.find(item_path)
+                          : directory.end();
+      if (it != directory.end() &&
+          OperationOf(it->first) == rest::constants::GET) {
+        item.url = OperationUrl(directory, item_path);
+        item.endpoint = mount.name() + it->first.parent_path().string();
+      }
+      items.push_back(std::move(item));
+    }
+    return std::make_unique<batch::Batch>(
+        std::move(items), mount.headers(),
+        absl::GetFlag(FLAGS_batch_parallelism), &request_scheduler(),
+        &response_cache());
+  };
+  return batches().Get(full_path, start)->Read(buf, size, offset);
+}
+
+// Whether `path` surely names nothing. Most probes of shells and IDEs end
+// here, before the path is resolved or even logged.
+bool IsUnknownName(const std::string_view path) {
+  const std::string_view status_dir = STATUS_DIR.native();
+  if (path.substr(0, status_dir.size()) == status_dir &&
+      (path.size() == status_dir.size() || path[status_dir.size()] == '/')) {
+    return false;
+  }
+  std::string_view relative;
+  const mount::Mount *mount = mounts().Find(path, &relative);
+  return mount != nullptr && !mount->directory()->MayFind(relative);
+}
+
+// Sets what the node attributes of the file at `path` lack: the size its
+// reads return.
+void CompleteAttributes(const mount::Mount &mount,
+                        const openapi::Directory &directory,
+                        const path::Path &path,
+                        const path::Path &template_path,
+                        const path::RefValueMap &bindings,
+                        struct stat *stat) {
+  if (IsBatchFile(template_path)) {
+    stat->st_size = 0;
+  } else if (OperationOf(template_path) == rest::constants::GET) {
+    stat->st_size =
+        OperationSize(mount, directory, path, template_path, bindings);
+  }
+}
+
+int GetAttributes(const char *path, struct stat *stat) {
+  LOG(INFO) << "api_get_attr: " << path;
+  const trace::Span span("getattr", path);
+  if (path == STATUS_DIR) {
+    *stat = path::DirNode(STATUS_DIR, nullptr).stat();
+    return 0;
+  }
+  if (const StatusFile *status_file = FindStatusFile(path)) {
+    *stat = path::SimpleFileNode(path, nullptr,
+                                 ReadStatusFile(*status_file).length(),
+                                 {S_IREAD})
+                .stat();
+    return 0;
+  }
+  if (mounts().IsMountPoint(path)) {
+    *stat = path::DirNode(path, nullptr).stat();
+    return 0;
+  }
+  path::Path relative;
+  const mount::Mount *mount = mounts().Find(path, &relative);
+  if (mount == nullptr) {
+    LOG(INFO) << path << " - NOT FOUND!";
+    return -ENOENT;
+  }
+  // One tree for the whole lookup, even if the spec is reloaded meanwhile.
+  const auto directory = mount->directory();
+  if (const auto projection = FindProjection(*directory, relative)) {
+    return ProjectionAttributes(*mount, directory, relative, *projection,
+                                stat);
+  }
+  path::RefValueMap bindings;
+  auto found = directory->find(relative, &bindings);
+  if (found == directory->end()) {
+    LOG(INFO) << path << " - NOT FOUND!";
+    return -ENOENT;
+  }
+  *stat = found->second.stat();
+  CompleteAttributes(*mount, *directory, relative, found->first, bindings,
+                     stat);
+  return 0;
+}
+
+int api_getattr(const char *path, struct stat *stat,
+                struct fuse_file_info *fi) {
+  if (IsUnknownName(path)) {
+    lookup_counters().Rejected(path);
+    return -ENOENT;
+  }
+  const int result = GetAttributes(path, stat);
+  lookup_counters().Resolved(result);
+  return result;
+}
+
+// Bodies written to operation files larger than this fail with EFBIG.
+constexpr size_t MAX_WRITE_BYTES = 64 << 20;
+
+// What is written to an operation file such as post.json through one handle,
+// sent as the body of its request when the handle is flushed. Held by fi->fh
+// of the files opened for writing, as snapshots are by that of status files.
+struct OperationWrite final {
+  const mount::Mount *mount;
+  std::string url;
+  std::string endpoint;
+  rest::constants::OPERATIONS operation;
+  // The GET file of the same resource, as seen from the mount point, whose
+  // attributes a successful write makes stale.
+  path::Path get_path;
+  std::string body;
+  // Written since last sent.
+  bool dirty;
+  // Of the writes queued that fsync did not wait for yet.
+  std::vector<uint64_t> sequences;
+  // Guards the members above: fuse may run several operations on one handle
+  // at once.
+  std::mutex mutex;
+};
+
+// Returns nullptr unless `path` was opened for writing an operation.
+OperationWrite *OperationWriteOf(const char *path,
+                                 const struct fuse_file_info *fi) {
+  if (fi == nullptr || fi->fh == 0 || FindStatusFile(path) != nullptr) {
+    return nullptr;
+  }
+  return reinterpret_cast<OperationWrite *>(fi->fh);
+}
+
+// Drops the responses of `url` kept by restfs, which a write to it made
+// stale.
+void ForgetResponses(cache::ResponseCache *cache, cache::DiskCache *disk,
+                     probe::SizeProber *sizes,
+                     projection::PrefixCache *prefixes,
+                     const std::string &url) {
+  const std::string key = http::NormalizeUrl(url);
+  cache->Remove(key);
+  if (disk != nullptr) {
+    disk->Remove(key);
+  }
+  sizes->Forget(key);
+  prefixes->Remove(key);
+}
+
+// Sends what was written through `write` since last sent, or queues it with
+// write-behind. Returns 0 or the negated errno the request failed with. Must
+// hold `write->mutex`.
+int SendWrite(OperationWrite *write) {
+  if (!write->dirty) {
+    return 0;
+  }
+  write->dirty = false;
+  if (writeback::Queue *queue = write_queue()) {
+    cache::ResponseCache *cache = &response_cache();
+    cache::DiskCache *disk = disk_cache();
+    probe::SizeProber *sizes = &size_prober();
+    projection::PrefixCache *prefixes = &projection_prefixes();
+    struct fuse *fuse = private_context()->fuse_;
+    uint64_t sequence = 0;
+    const int result = queue->Submit(
+        {write->mount->name(), write->url, write->endpoint, write->operation,
+         write->body},
+        [cache, disk, sizes, prefixes, fuse, url = write->url,
+         get_path = write->get_path]() {
+          ForgetResponses(cache, disk, sizes, prefixes, url);
+          fuse_invalidate_path(fuse, get_path.c_str());
+        },
+        &sequence);
+    if (result == 0) {
+      write->sequences.push_back(sequence);
+    }
+    return result;
+  }
+  http::Request request(write->operation, write->mount->headers());
+  request.set_body(write->body);
+  const http::Response response = request_scheduler().Fetch(
+      scheduler::INTERACTIVE, write->endpoint, request, write->url);
+  if (response.curl_code != CURLE_OK || response.http_code < 200 ||
+      response.http_code >= 400) {
+    LOG(INFO) << response.data.str();
+    const int code = http::ErrnoOf(response);
+    return -((code != 0) ? code : EIO);
   }
-  return response.data.str();
+  ForgetResponses(&response_cache(), disk_cache(), &size_prober(),
+                  &projection_prefixes(), write->url);
+  InvalidateLater(write->get_path);
+  return 0;
+}
+
+int api_open(const char *path, struct fuse_file_info *fi) {
+  LOG(INFO) << "api_open " << path;
+  const trace::Span span("open", path);
+  if (const StatusFile *status_file = FindStatusFile(path)) {
+    // The content may change between getattr and read. Reads are served from
+    // a snapshot taken now, so that they see one consistent document even
+    // when it changes while being read, as trace.json does.
+    fi->direct_io = 1;
+    fi->fh = reinterpret_cast<uint64_t>(
+        new std::string(ReadStatusFile(*status_file)));
+    return 0;
+  }
+  path::Path relative;
+  const mount::Mount *mount = mounts().Find(path, &relative);
+  if (mount == nullptr) {
+    return -ENOENT;
+  }
+  const auto directory = mount->directory();
+  if (FindProjection(*directory, relative)) {
+    fi->direct_io = 1;
+    return 0;
+  }
+  const auto it = directory->find(relative);
+  if (it == directory->end()) {
+    return -ENOENT;
+  }
+  const rest::constants::OPERATIONS operation = OperationOf(it->first);
+  if ((fi->flags & O_ACCMODE) != O_RDONLY && !IsBatchFile(it->first) &&
+      operation != rest::constants::INVALID &&
+      operation != rest::constants::GET &&
+      operation != rest::constants::HEAD) {
+    fi->direct_io = 1;
+    fi->fh = reinterpret_cast<uint64_t>(new OperationWrite{
+        mount, OperationUrl(*directory, relative),
+        mount->name() + it->first.parent_path().string(), operation,
+        mount->FullPath(relative.parent_path() / "get.json"), "", false, {}});
+    return 0;
+  }
+  if (IsBatchFile(it->first)) {
+    batches().Open(path);
+  }
+  // Reads must not stop at a size that is not the real one.
+  if (IsBatchFile(it->first) ||
+      (OperationOf(it->first) == rest::constants::GET &&
+       !size_prober()
+            .Find(http::NormalizeUrl(OperationUrl(*directory, relative)))
+            .has_value())) {
+    fi->direct_io = 1;
+  }
+  return 0;
 }
 
 int api_read(const char *in_path, char *buf, size_t size, off_t offset,
              struct fuse_file_info *fi) {
   LOG(INFO) << "api_read " << in_path;
-  const path::Path ref_path =
-      path::utils::BindRefs(in_path, path::utils::ReferenceBinder);
-  const auto it = directory().find(ref_path);
-  if (it == directory().end()) {
+  const trace::Span span("read", in_path);
+  if (const StatusFile *status_file = FindStatusFile(in_path)) {
+    if (fi != nullptr && fi->fh != 0) {
+      return str_to_buffer(*reinterpret_cast<const std::string *>(fi->fh), buf,
+                           size, offset);
+    }
+    return str_to_buffer(ReadStatusFile(*status_file), buf, size, offset);
+  }
+  path::Path relative;
+  const mount::Mount *mount = mounts().Find(in_path, &relative);
+  if (mount == nullptr) {
+    return -ENOENT;
+  }
+  const auto directory = mount->directory();
+  if (const auto projection = FindProjection(*directory, relative)) {
+    int error = 0;
+    const projection::Extractor extractor =
+        Project(*mount, directory, *projection, &error);
+    if (error != 0) {
+      return error;
+    }
+    return str_to_buffer(extractor.value(), buf, size, offset);
+  }
+  const auto it = directory->find(relative);
+  if (it == directory->end()) {
     return -ENOENT;
   }
   const path::Path path = it->first;
+  if (IsBatchFile(path)) {
+    return ReadBatchFile(*mount, *directory, relative, in_path, buf, size,
+                         offset);
+  }
   if (ends_with(path.filename().string(), "metadata.json")) {
-    return str_to_buffer(ReadMetadataNode(path, it->second), buf, size, offset);
+    return str_to_buffer(directory->Metadata(it->second), buf, size, offset);
   }
 
   if (ends_with(path.filename().string(), "entity.json")) {
     return str_to_buffer(ReadEntityNode(path, it->second), buf, size, offset);
   }
 
-  return str_to_buffer(ReadOperationNode(path, it->second), buf, size, offset);
+  int error = 0;
+  const auto entry = FetchOperation(*mount, directory, relative, path, &error);
+  if (entry == nullptr) {
+    return error;
+  }
+  return str_to_buffer(entry->body.view(), buf, size, offset);
+}
+
+// Keeps the body handed out by the last read_buf of this thread alive: fuse
+// splices it after read_buf returns, and the cache may drop it meanwhile. The
+// next read of a thread starts once the reply of the previous one is sent.
+thread_local std::shared_ptr<const cache::Entry> spliced_entry;
+
+// Serves sealed cached bodies as a descriptor, which fuse splices to the
+// kernel without copying it. Other files are copied as api_read does.
+int api_read_buf(const char *in_path, struct fuse_bufvec **bufp, size_t size,
+                 off_t offset, struct fuse_file_info *fi) {
+  LOG(INFO) << "api_read_buf " << in_path;
+  const trace::Span span("read_buf", in_path);
+  spliced_entry.reset();
+  bool operation = false;
+  std::shared_ptr<const cache::Entry> entry;
+  path::Path relative;
+  const mount::Mount *mount = (FindStatusFile(in_path) == nullptr)
+                                  ? mounts().Find(in_path, &relative)
+                                  : nullptr;
+  if (mount != nullptr) {
+    const auto directory = mount->directory();
+    const auto it = directory->find(relative);
+    if (it != directory->end() &&
+        OperationOf(it->first) == rest::constants::GET) {
+      operation = true;
+      int error = 0;
+      entry = FetchOperation(*mount, directory, relative, it->first, &error);
+      if (entry == nullptr) {
+        return error;
+      }
+    }
+  }
+
+  struct fuse_bufvec *bufv =
+      static_cast<struct fuse_bufvec *>(malloc(sizeof(struct fuse_bufvec)));
+  if (bufv == nullptr) {
+    return -ENOMEM;
+  }
+  if (entry != nullptr && entry->body.fd() >= 0) {
+    const size_t length =
+        (offset >= (off_t)entry->body.size())
+            ? 0
+            : std::min(size, entry->body.size() - offset);
+    *bufv = FUSE_BUFVEC_INIT(length);
+    bufv->buf[0].flags =
+        static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    bufv->buf[0].fd = entry->body.fd();
+    bufv->buf[0].pos = offset;
+    spliced_entry = entry;
+    *bufp = bufv;
+    return 0;
+  }
+
+  *bufv = FUSE_BUFVEC_INIT(size);
+  bufv->buf[0].mem = malloc(size);
+  if (bufv->buf[0].mem == nullptr) {
+    free(bufv);
+    return -ENOMEM;
+  }
+  const int read =
+      !operation ? api_read(in_path, static_cast<char *>(bufv->buf[0].mem),
+                            size, offset, fi)
+      : str_to_buffer(entry->body.view(),
+                      static_cast<char *>(bufv->buf[0].mem), size, offset);
+  if (read < 0) {
+    free(bufv->buf[0].mem);
+    free(bufv);
+    return read;
+  }
+  bufv->buf[0].size = read;
+  *bufp = bufv;
+  return 0;
 }
 
 int api_write(const char *in_path, const char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi) {
-  const path::Path ref_path =
-      path::utils::BindRefs(in_path, path::utils::ReferenceBinder);
-  const auto it = directory().find(ref_path);
-  if (it == directory().end()) {
+  const trace::Span span("write", in_path);
+  path::Path relative;
+  const mount::Mount *mount = mounts().Find(in_path, &relative);
+  if (mount == nullptr) {
     return -ENOENT;
   }
-
+  const auto directory = mount->directory();
+  const auto it = directory->find(relative);
+  if (it == directory->end()) {
+    return -ENOENT;
+  }
+  if (IsBatchFile(it->first)) {
+    batches().Write(in_path, std::string_view(buf, size), offset);
+  } else if (OperationWrite *write = OperationWriteOf(in_path, fi)) {
+    if (offset + size > MAX_WRITE_BYTES) {
+      return -EFBIG;
+    }
+    std::lock_guard<std::mutex> lock(write->mutex);
+    if (write->body.size() < offset + size) {
+      write->body.resize(offset + size);
+    }
+    memcpy(write->body.data() + offset, buf, size);
+    write->dirty = true;
+  }
   return size;
 }
 
+// Called on every close of a handle: close fails with what this returns.
+int api_flush(const char *path, struct fuse_file_info *fi) {
+  OperationWrite *write = OperationWriteOf(path, fi);
+  if (write == nullptr) {
+    return 0;
+  }
+  const trace::Span span("flush", path);
+  std::lock_guard<std::mutex> lock(write->mutex);
+  return SendWrite(write);
+}
+
+int api_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  OperationWrite *write = OperationWriteOf(path, fi);
+  if (write == nullptr) {
+    return 0;
+  }
+  const trace::Span span("fsync", path);
+  std::vector<uint64_t> sequences;
+  {
+    std::lock_guard<std::mutex> lock(write->mutex);
+    if (const int result = SendWrite(write); result != 0) {
+      return result;
+    }
+    sequences.swap(write->sequences);
+  }
+  // Waits for every write of the handle, so that none keeps its error.
+  int result = 0;
+  for (const uint64_t sequence : sequences) {
+    const int error = write_queue()->Wait(sequence);
+    if (result == 0) {
+      result = error;
+    }
+  }
+  return result;
+}
+
+int api_release(const char *path, struct fuse_file_info *fi) {
+  if (FindStatusFile(path) != nullptr) {
+    delete reinterpret_cast<std::string *>(fi->fh);
+    fi->fh = 0;
+  } else if (OperationWrite *write = OperationWriteOf(path, fi)) {
+    {
+      std::lock_guard<std::mutex> lock(write->mutex);
+      // Flushed on close already, unless written through a mapping since.
+      if (const int result = SendWrite(write); result != 0) {
+        LOG(WARNING) << "Failed writing " << path << ": " << strerror(-result);
+      }
+      // Failures are still listed by /.restfs/writes.json.
+      for (const uint64_t sequence : write->sequences) {
+        write_queue()->Forget(sequence);
+      }
+    }
+    delete write;
+    fi->fh = 0;
+  } else if (path::Path(path).filename() == openapi::BATCH_FILENAME) {
+    batches().Release(path);
+  }
+  return 0;
+}
+
 int api_statfs(const char *path, struct statvfs *statv) {
   LOG(INFO) << "api_statfs " << path << ", " << statv;
   return 0;
 }
 
+// Starts probing the sizes of the GET files directly below every value `ids`
+// of the reference directory `child`, such as /v2/orders/{soid:42}/get.json,
+// which ls -l of those values reads next. The probes go out concurrently.
+//
+// Listings may hold many thousands of values: URLs are built from the one of
+// `relative`, and nothing is allocated for those already known or probing.
+// Their attributes are not invalidated one by one once probed; the sizes
+// show once the attributes listed expire.
+void ProbeValueSizes(const mount::Mount &mount,
+                     const openapi::Directory &directory,
+                     const path::Path &relative,
+                     const path::Path &template_dir, const path::Node &child,
+                     const path::RefValueMap &bindings,
+                     const collection::IdIndex &ids) {
+  bool has_get = false;
+  for (const path::Node file : child.children()) {
+    const path::Path template_path = template_dir / file.path();
+    has_get = has_get ||
+              (!file.is_directory() && !path::utils::IsReference(file.path()) &&
+               !IsBatchFile(template_path) &&
+               OperationOf(template_path) == rest::constants::GET);
+  }
+  for (const auto &[ref, value] : bindings) {
+    if (value.empty()) {
+      return;
+    }
+  }
+  if (!has_get) {
+    return;
+  }
+  // The GET files of a value all read the URL of the value.
+  std::string base =
+      directory.directory_url_prefix() +
+      path::utils::BindRefs(relative, path::utils::ValueBinder).string();
+  if (base.empty() || base.back() != '/') {
+    base.push_back('/');
+  }
+  const std::string endpoint = mount.name() + template_dir.string();
+  std::string url = base;
+  for (size_t idx = 0; idx < ids.size(); ++idx) {
+    url.resize(base.size());
+    url.append(ids[idx]);
+    // Sizes of cached responses are learned when their files are looked up.
+    const std::string key = http::NormalizeUrl(url);
+    if (!response_cache().Contains(key)) {
+      size_prober().Probe(url, key, endpoint, &mount.headers(), nullptr);
+    }
+  }
+}
+
 int api_readdir(const char *path_str, void *buf, fuse_fill_dir_t filler,
                 off_t offset, struct fuse_file_info *fi,
                 enum fuse_readdir_flags flag) {
-  const path::Path path(path::utils::PathToRefValueMap(path_str));
+  const trace::Span span("readdir", path_str);
+  const path::Path path(path_str);
   const path::Path &filename(path.filename());
 
-  auto it = directory().find(path);
-  if (it == directory().end()) {
+  if (path == STATUS_DIR) {
+    for (const auto &[name, status_file] : status_files()) {
+      if (filler(buf, name.c_str(), nullptr, 0, (fuse_fill_dir_flags)0)) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  if (path == "/" && filler(buf, STATUS_DIR.filename().c_str(), nullptr, 0,
+                            (fuse_fill_dir_flags)0)) {
+    return -1;
+  }
+  if (mounts().IsMountPoint(path)) {
+    for (const auto &mount : mounts().mounts()) {
+      if (filler(buf, mount->name().c_str(), nullptr, 0,
+                 (fuse_fill_dir_flags)0)) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  path::Path relative;
+  mount::Mount *mount = mounts().Find(path, &relative);
+  if (mount == nullptr) {
+    return -ENOENT;
+  }
+  const auto directory = mount->directory();
+  if (const auto projection = FindProjection(*directory, relative)) {
+    return ReadProjectionDir(*mount, directory, *projection, buf, filler);
+  }
+  path::RefValueMap bindings;
+  auto it = directory->find(relative, &bindings);
+  if (it == directory->end()) {
     return -ENOENT;
   }
 
-  for (auto child : it->second.children()) {
-    if (filler(buf, child->path().filename().c_str(), &(child->stat()), 0,
-               (fuse_fill_dir_flags)0)) { // Error filling the buffer.
+  // With readdirplus, the kernel keeps the attributes of every entry and
+  // asks for none of them afterwards: they must be complete.
+  const bool plus = (flag & FUSE_READDIR_PLUS) != 0;
+  const fuse_fill_dir_flags fill_flags =
+      plus ? FUSE_FILL_DIR_PLUS : (fuse_fill_dir_flags)0;
+  collection::Registry &collections = mount->collections();
+  const path::Path dir_path = it->first;
+  for (const path::Node child : it->second.children()) {
+    const path::Path child_name = child.path();
+    struct stat child_stat = child.stat();
+    if (plus && !path::utils::IsReference(child_name)) {
+      CompleteAttributes(*mount, *directory, relative / child_name,
+                         dir_path / child_name, bindings, &child_stat);
+    }
+    if (filler(buf, child_name.c_str(), &child_stat, 0,
+               fill_flags)) { // Error filling the buffer.
       return -1;
     }
+
+    if (!path::utils::IsReference(child_name) ||
+        !collections.HasCollection(dir_path / child_name)) {
+      continue;
+    }
+    // List the known values of the reference as {ref:value} siblings.
+    const auto ids = collections.Find(dir_path / child_name, bindings);
+    if (ids == nullptr) {
+      continue;
+    }
+    const path::Ref ref = *path::utils::RefSetFromPath(child_name).begin();
+    std::string entry_name = "{" + ref + ":";
+    const size_t entry_prefix_len = entry_name.length();
+    for (size_t idx = 0; idx < ids->size(); ++idx) {
+      entry_name.resize(entry_prefix_len);
+      entry_name.append((*ids)[idx]).push_back('}');
+      if (filler(buf, entry_name.c_str(), &child_stat, 0, fill_flags)) {
+        return -1;
+      }
+    }
+    if (plus) {
+      ProbeValueSizes(*mount, *directory, relative, dir_path / child_name,
+                      child, bindings, *ids);
+    }
   }
 
   return 0; // Tell Fuse we're done.
@@ -191,69 +1360,234 @@ static int api_readlink(const char *path, char *buf, size_t size) {
   return 0;
 }
 
-std::stringstream read_content(const std::string &address) {
-  static const std::string HTTP_PREFIX = "http";
-  http::Request request;
-  const std::string prefix = address.substr(0, HTTP_PREFIX.length());
-  if (prefix == HTTP_PREFIX) {
-    http::Response response = request.fetch(address);
-    CHECK(response.http_code == 200);
-    return std::move(response.data);
+std::vector<mount::Spec> LoadSpecsFromFlags() {
+  const std::string &manifest_addr = absl::GetFlag(FLAGS_manifest_addr);
+  if (manifest_addr.empty()) {
+    return {{
+        .name = "",
+        .spec_addr = absl::GetFlag(FLAGS_api_spec_addr),
+        .host_addr = absl::GetFlag(FLAGS_api_host_addr),
+        .headers_addr = absl::GetFlag(FLAGS_header_file_addr),
+        .collections_addr = absl::GetFlag(FLAGS_collections_addr),
+    }};
   }
-
-  std::ifstream stream;
-  stream.open(address.c_str());
-  CHECK_M(stream.is_open(), "Failed to open: " + address + "");
-  std::stringstream buffer;
-  buffer << stream.rdbuf();
-  return buffer;
-}
-
-openapi::Directory LoadDirectoryFromFlags() {
-  std::stringstream api_spec_stream =
-      read_content(absl::GetFlag(FLAGS_api_spec_addr));
-  const std::string &api_host_addr = absl::GetFlag(FLAGS_api_host_addr);
-
-  auto json_data = std::make_unique<Json::Value>();
-  api_spec_stream >> *json_data;
-
-  return openapi::NewDirectoryFromJsonValue(api_host_addr,
-                                            std::move(json_data));
+  std::optional<std::stringstream> manifest_stream =
+      mount::ReadContent(manifest_addr);
+  CHECK_M(manifest_stream.has_value(), "Failed to read " + manifest_addr);
+  Json::Value manifest;
+  *manifest_stream >> manifest;
+  return mount::SpecsFromJsonValue(manifest);
 }
 
 int api_truncate(const char *path, off_t off, struct fuse_file_info *fi) {
   LOG(INFO) << "api_truncate " << path << ", " << off;
+  const trace::Span span("truncate", path);
+  path::Path relative;
+  const mount::Mount *mount = mounts().Find(path, &relative);
+  if (mount == nullptr) {
+    return -ENOENT;
+  }
+  const auto directory = mount->directory();
+  const auto it = directory->find(relative);
+  if (it == directory->end()) {
+    return -ENOENT;
+  }
+  if (IsBatchFile(it->first)) {
+    batches().Truncate(path, off);
+  } else if (OperationWrite *write = OperationWriteOf(path, fi)) {
+    if (size_t(off) > MAX_WRITE_BYTES) {
+      return -EFBIG;
+    }
+    std::lock_guard<std::mutex> lock(write->mutex);
+    write->body.resize(off);
+    write->dirty = true;
+  }
   return 0;
 }
 
+void *api_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+  PrivateContext *ctx =
+      static_cast<PrivateContext *>(fuse_get_context()->private_data);
+  struct fuse *fuse = fuse_get_context()->fuse;
+  ctx->fuse_ = fuse;
+  cfg->negative_timeout = absl::GetFlag(FLAGS_negative_lookup_seconds);
+  // Every listing carries full attributes rather than when the kernel guesses
+  // they are wanted.
+  if (absl::GetFlag(FLAGS_readdirplus) &&
+      (conn->capable & FUSE_CAP_READDIRPLUS) != 0) {
+    conn->want |= FUSE_CAP_READDIRPLUS;
+    conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+  } else {
+    conn->want &= ~FUSE_CAP_READDIRPLUS;
+  }
+  if (ctx->watcher_ != nullptr) {
+    ctx->watcher_->Start([fuse](const path::Path &path) {
+      // Paths the kernel doesn't know about yet are not an error.
+      fuse_invalidate_path(fuse, path.c_str());
+    });
+  }
+  return ctx;
+}
+
+void api_destroy(void *private_data) {
+  PrivateContext *ctx = static_cast<PrivateContext *>(private_data);
+  // Writes invalidate paths once sent, which needs fuse.
+  if (ctx->writes_ != nullptr) {
+    ctx->writes_->Drain();
+  }
+}
+
 int main(int argc, char *argv[]) {
   struct fuse_operations fuse = {
       .getattr = api_getattr,
       .readlink = api_readlink,
       .truncate = api_truncate,
+      .open = api_open,
       .read = api_read,
       .write = api_write,
       .statfs = api_statfs,
+      .flush = api_flush,
+      .release = api_release,
+      .fsync = api_fsync,
       .readdir = api_readdir,
+      .init = api_init,
+      .destroy = api_destroy,
+      .read_buf = api_read_buf,
   };
 
   // If the command-line contains a value for logtostderr, use that.
   // Otherwise, use the default (as set above).
   absl::ParseCommandLine(argc, argv);
+  // Requests are sent from background threads.
+  CHECK(curl_global_init(CURL_GLOBAL_ALL) == CURLE_OK);
+  trace::Configure(absl::GetFlag(FLAGS_trace_sample_rate),
+                   absl::GetFlag(FLAGS_trace_buffer_events));
+  std::unique_ptr<trace::SignalDumper> trace_dumper;
+  if (!absl::GetFlag(FLAGS_trace_file).empty()) {
+    trace_dumper = std::make_unique<trace::SignalDumper>(
+        SIGUSR1, absl::GetFlag(FLAGS_trace_file));
+  }
 
-  std::stringstream headers_file_stream =
-      read_content(absl::GetFlag(FLAGS_header_file_addr));
-  http::Headers headers;
-  for (std::string line; std::getline(headers_file_stream, line);) {
-    headers.AppendHeaderLine(line);
+  scheduler::Scheduler scheduler({
+      .host_qps = absl::GetFlag(FLAGS_host_qps),
+      .host_burst = absl::GetFlag(FLAGS_host_burst),
+      .endpoint_qps = absl::GetFlag(FLAGS_endpoint_qps),
+      .endpoint_burst = absl::GetFlag(FLAGS_endpoint_burst),
+      .max_retries = absl::GetFlag(FLAGS_max_retries),
+      .max_retry_after =
+          std::chrono::seconds(absl::GetFlag(FLAGS_max_retry_after_seconds)),
+      .hedge_budget = absl::GetFlag(FLAGS_hedge_budget),
+      .hedge_parallelism =
+          size_t(std::max(absl::GetFlag(FLAGS_hedge_parallelism), 1)),
+      .timeout_multiplier = absl::GetFlag(FLAGS_timeout_multiplier),
+      .min_timeout =
+          std::chrono::milliseconds(absl::GetFlag(FLAGS_min_timeout_ms)),
+      .max_timeout =
+          std::chrono::milliseconds(absl::GetFlag(FLAGS_max_timeout_ms)),
+      .breakers =
+          {
+              .failure_threshold = absl::GetFlag(FLAGS_breaker_failures),
+              .open_duration = std::chrono::seconds(
+                  absl::GetFlag(FLAGS_breaker_open_seconds)),
+              .negative_ttl = std::chrono::milliseconds(
+                  absl::GetFlag(FLAGS_negative_cache_ms)),
+              .negative_entries = NEGATIVE_CACHE_ENTRIES,
+          },
+  });
+  cache::ResponseCache cache(
+      absl::GetFlag(FLAGS_cache_bytes),
+      std::chrono::seconds(absl::GetFlag(FLAGS_cache_ttl_seconds)));
+  std::unique_ptr<cache::DiskCache> disk;
+  if (!absl::GetFlag(FLAGS_disk_cache_dir).empty()) {
+    disk = std::make_unique<cache::DiskCache>(
+        absl::GetFlag(FLAGS_disk_cache_dir),
+        absl::GetFlag(FLAGS_disk_cache_bytes),
+        std::chrono::seconds(absl::GetFlag(FLAGS_cache_ttl_seconds)));
+  }
+  mount::Table mounts;
+  // Declared after the mounts so that no background work outlives them.
+  worker::Pool workers(absl::GetFlag(FLAGS_worker_threads));
+  for (const mount::Spec &spec : LoadSpecsFromFlags()) {
+    // APIs that fail to load are left out rather than taking the others down.
+    if (auto mount = mount::LoadMount(spec, &scheduler, &workers)) {
+      mounts.Add(std::move(mount));
+    }
+  }
+  CHECK_M(!mounts.mounts().empty(), "No API could be mounted");
+  // Null when specs are not watched, sparing its inotify descriptor.
+  std::unique_ptr<mount::Watcher> watcher;
+  if (absl::GetFlag(FLAGS_watch_specs)) {
+    watcher = std::make_unique<mount::Watcher>(
+        mounts, std::chrono::seconds(absl::GetFlag(FLAGS_spec_poll_seconds)));
+  }
+  probe::SizeProber sizes(
+      absl::GetFlag(FLAGS_size_probe_entries),
+      std::max(absl::GetFlag(FLAGS_size_probe_parallelism), 1), &scheduler);
+  projection::PrefixCache prefixes(
+      absl::GetFlag(FLAGS_projection_prefix_bytes),
+      std::chrono::seconds(absl::GetFlag(FLAGS_cache_ttl_seconds)));
+  // Declared after the scheduler and the caches its batches use.
+  batch::Table batches;
+  lookup::Counters lookups;
+  size_t prefetch_links = std::max(absl::GetFlag(FLAGS_prefetch_links), 0);
+  if (prefetch_links > 0 && !cache.enabled()) {
+    LOG(WARNING) << "--prefetch_links needs --cache_ttl_seconds, not "
+                    "prefetching";
+    prefetch_links = 0;
+  }
+  // Declared after the scheduler, the cache and the mounts it prefetches
+  // with.
+  prefetch::Prefetcher prefetcher(
+      {
+          .max_links = prefetch_links,
+          .budget = size_t(std::max(absl::GetFlag(FLAGS_prefetch_budget), 1)),
+          .parallelism = PREFETCH_PARALLELISM,
+          .min_hit_rate = absl::GetFlag(FLAGS_prefetch_min_hit_rate),
+      },
+      &scheduler, &cache);
+  // Declared after the caches that writes sent make stale.
+  std::unique_ptr<writeback::Queue> writes;
+  if (absl::GetFlag(FLAGS_write_behind)) {
+    writes = std::make_unique<writeback::Queue>(
+        writeback::Options{
+            .max_queued = size_t(
+                std::max(absl::GetFlag(FLAGS_write_behind_queue), 1)),
+            .parallelism = size_t(
+                std::max(absl::GetFlag(FLAGS_write_behind_parallelism), 1)),
+            .journal_dir = absl::GetFlag(FLAGS_write_behind_journal),
+        },
+        &scheduler, [&mounts](const std::string &name) -> const http::Headers * {
+          for (const auto &mount : mounts.mounts()) {
+            if (mount->name() == name) {
+              return &mount->headers();
+            }
+          }
+          return nullptr;
+        });
+  } else if (!absl::GetFlag(FLAGS_write_behind_journal).empty()) {
+    LOG(WARNING) << "--write_behind_journal needs --write_behind, not "
+                    "journaling";
   }
   PrivateContext private_context = {
-      LoadDirectoryFromFlags(),
-      headers,
+      mounts,
+      scheduler,
+      cache,
+      disk.get(),
+      sizes,
+      prefixes,
+      workers,
+      batches,
+      lookups,
+      prefetcher,
+      writes.get(),
+      watcher.get(),
+      nullptr,
   };
 
   std::string mount_location = absl::GetFlag(FLAGS_mount_location);
-  char *args[] = {argv[0] /* argv[0] = program name */, "-s", "-f",
+  // Operations run on several threads, so that one waiting, such as fsync
+  // with write-behind or a batch read, does not hold up the others.
+  char *args[] = {argv[0] /* argv[0] = program name */, "-f",
                   const_cast<char *>(mount_location.c_str())};
   return fuse_main(sizeof(args) / sizeof(char *), args, &fuse,
                    &private_context);
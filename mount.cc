@@ -0,0 +1,386 @@
+#include "mount.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <poll.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace mount {
+
+static std::string MemberString(const Json::Value &value,
+                                const std::string &key) {
+  const Json::Value *found =
+      value.find(key.c_str(), key.c_str() + key.length());
+  return (found == nullptr) ? "" : found->asString();
+}
+
+std::vector<Spec> SpecsFromJsonValue(const Json::Value &manifest) {
+  CHECK_M(manifest.isArray(), "The manifest must be a JSON array");
+  std::vector<Spec> specs;
+  for (const Json::Value &entry : manifest) {
+    CHECK_M(entry.isObject(), "Manifest entries must be JSON objects");
+    Spec spec{
+        .name = MemberString(entry, "subdirectory"),
+        .spec_addr = MemberString(entry, "spec"),
+        .host_addr = MemberString(entry, "host"),
+        .headers_addr = MemberString(entry, "headers"),
+        .collections_addr = MemberString(entry, "collections"),
+    };
+    CHECK_M(!spec.name.empty() && spec.name.find('/') == spec.name.npos &&
+                spec.name[0] != '.',
+            "Invalid subdirectory: '" + spec.name + "'");
+    CHECK_M(!spec.spec_addr.empty(), "Missing spec for " + spec.name);
+    specs.push_back(std::move(spec));
+  }
+  return specs;
+}
+
+static bool IsRemote(const std::string &address) {
+  return address.compare(0, 4, "http") == 0;
+}
+
+std::optional<std::stringstream> ReadContent(const std::string &address,
+                                             std::string *etag,
+                                             bool *unchanged) {
+  if (IsRemote(address)) {
+    http::Headers headers;
+    if (etag != nullptr && !etag->empty()) {
+      headers.AppendHeaderLine("If-None-Match: " + *etag);
+    }
+    http::Response response =
+        http::Request(rest::constants::GET, headers).fetch(address);
+    if (response.curl_code == CURLE_OK && response.http_code == 304 &&
+        etag != nullptr && !etag->empty()) {
+      *unchanged = true;
+      return std::stringstream();
+    }
+    if (response.curl_code != CURLE_OK || response.http_code != 200) {
+      LOG(ERROR) << "Failed to fetch " << address << ": "
+                 << ((response.curl_code != CURLE_OK)
+                         ? curl_easy_strerror(response.curl_code)
+                         : std::to_string(response.http_code));
+      return std::nullopt;
+    }
+    if (etag != nullptr) {
+      const auto etag_it = response.headers.find("etag");
+      *etag = (etag_it == response.headers.end()) ? "" : etag_it->second;
+    }
+    return std::move(response.data);
+  }
+
+  std::ifstream stream;
+  stream.open(address.c_str());
+  if (!stream.is_open()) {
+    LOG(ERROR) << "Failed to open " << address;
+    return std::nullopt;
+  }
+  if (etag != nullptr) {
+    etag->clear();
+  }
+  std::stringstream buffer;
+  buffer << stream.rdbuf();
+  return buffer;
+}
+
+bool ReadSpecIfChanged(const std::string &address, SpecVersion *version,
+                       Json::Value *spec) {
+  std::string etag = version->etag;
+  bool unchanged = false;
+  std::optional<std::stringstream> stream =
+      ReadContent(address, &etag, &unchanged);
+  if (!stream || unchanged) {
+    return false;
+  }
+  const std::string content = stream->str();
+
+  // Servers without ETags and touched files may send the same content again.
+  const size_t hash = std::hash<std::string>()(content);
+  if (hash == version->hash) {
+    version->etag = etag;
+    return false;
+  }
+  Json::CharReaderBuilder builder;
+  std::string errors;
+  const std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+  if (!reader->parse(content.data(), content.data() + content.length(), spec,
+                     &errors)) {
+    LOG(WARNING) << "Failed to parse " << address << ": " << errors;
+    return false;
+  }
+  *version = {.etag = etag, .hash = hash};
+  return true;
+}
+
+Mount::Mount(const Spec &spec,
+             std::shared_ptr<const openapi::Directory> directory,
+             const SpecVersion &spec_version,
+             const std::vector<std::string> &header_lines,
+             collection::ConfigMap collections,
+             scheduler::Scheduler *scheduler, worker::Pool *workers)
+    : spec_(spec), directory_(std::move(directory)),
+      spec_version_(spec_version), headers_(),
+      collections_(std::move(collections),
+                   directory_->directory_url_prefix(), &headers_, scheduler,
+                   workers) {
+  for (const std::string &line : header_lines) {
+    headers_.AppendHeaderLine(line);
+  }
+}
+
+path::Path Mount::FullPath(const path::Path &relative) const {
+  return name().empty() ? relative
+                        : path::Path("/") / name() / relative.relative_path();
+}
+
+std::vector<path::Path> Mount::Reload() {
+  auto json_data = std::make_unique<Json::Value>();
+  if (!ReadSpecIfChanged(spec_.spec_addr, &spec_version_, json_data.get())) {
+    return {};
+  }
+  std::shared_ptr<const openapi::Directory> next(new openapi::Directory(
+      openapi::NewDirectoryFromJsonValue(spec_.host_addr, std::move(json_data))));
+  const std::shared_ptr<const openapi::Directory> previous =
+      std::atomic_exchange(&directory_, next);
+  std::vector<path::Path> changed = openapi::ChangedPaths(*previous, *next);
+  LOG(INFO) << "Reloaded " << spec_.spec_addr << ": " << changed.size()
+            << " paths changed";
+  return changed;
+}
+
+std::unique_ptr<Mount> LoadMount(const Spec &spec,
+                                 scheduler::Scheduler *scheduler,
+                                 worker::Pool *workers) {
+  SpecVersion spec_version;
+  std::shared_ptr<const openapi::Directory> directory;
+  if (const auto *compiled = openapi::FindCompiledSpec(spec.spec_addr)) {
+    directory.reset(new openapi::Directory(
+        openapi::NewDirectoryFromCompiledSpec(spec.host_addr, *compiled)));
+  } else {
+    auto json_data = std::make_unique<Json::Value>();
+    if (!ReadSpecIfChanged(spec.spec_addr, &spec_version, json_data.get())) {
+      LOG(ERROR) << "Failed to load " << spec.spec_addr;
+      return nullptr;
+    }
+    directory.reset(new openapi::Directory(openapi::NewDirectoryFromJsonValue(
+        spec.host_addr, std::move(json_data))));
+  }
+
+  std::vector<std::string> header_lines;
+  if (!spec.headers_addr.empty()) {
+    std::optional<std::stringstream> headers_stream =
+        ReadContent(spec.headers_addr);
+    if (!headers_stream) {
+      return nullptr;
+    }
+    for (std::string line; std::getline(*headers_stream, line);) {
+      header_lines.push_back(line);
+    }
+  }
+
+  collection::ConfigMap collections;
+  if (!spec.collections_addr.empty()) {
+    std::optional<std::stringstream> collections_stream =
+        ReadContent(spec.collections_addr);
+    if (!collections_stream) {
+      return nullptr;
+    }
+    Json::Value collections_json;
+    Json::CharReaderBuilder builder;
+    std::string errors;
+    if (!Json::parseFromStream(builder, *collections_stream,
+                               &collections_json, &errors)) {
+      LOG(ERROR) << "Failed to parse " << spec.collections_addr << ": "
+                 << errors;
+      return nullptr;
+    }
+    std::optional<collection::ConfigMap> configs =
+        collection::ConfigMapFromJsonValue(collections_json);
+    if (!configs) {
+      LOG(ERROR) << "Invalid collections in " << spec.collections_addr;
+      return nullptr;
+    }
+    collections = std::move(*configs);
+  }
+
+  LOG(INFO) << "Mounting " << spec.spec_addr << " at /" << spec.name;
+  return std::make_unique<Mount>(spec, std::move(directory), spec_version,
+                                 header_lines, std::move(collections),
+                                 scheduler, workers);
+}
+
+void Table::Add(std::unique_ptr<Mount> mount) {
+  CHECK_M(!single(), "An API mounted at the root can't share the mount point");
+  CHECK_M(mounts_.empty() || !mount->name().empty(),
+          "Only a single API can be mounted at the root");
+  if (!mount->name().empty()) {
+    CHECK_M(by_name_.emplace(mount->name(), mount.get()).second,
+            "Duplicated subdirectory: " + mount->name());
+  }
+  mounts_.push_back(std::move(mount));
+}
+
+Mount *Table::Find(const path::Path &path, path::Path *relative) const {
+  if (single()) {
+    *relative = path;
+    return mounts_[0].get();
+  }
+  auto part_it = path.begin();
+  if (part_it == path.end() || *part_it != "/" || ++part_it == path.end()) {
+    return nullptr;
+  }
+  const auto mount_it = by_name_.find(part_it->string());
+  if (mount_it == by_name_.end()) {
+    return nullptr;
+  }
+  *relative = "/";
+  for (++part_it; part_it != path.end(); ++part_it) {
+    *relative /= *part_it;
+  }
+  return mount_it->second;
+}
+
+Mount *Table::Find(const std::string_view path,
+                   std::string_view *relative) const {
+  if (single()) {
+    *relative = path;
+    return mounts_[0].get();
+  }
+  if (path.empty() || path[0] != '/') {
+    return nullptr;
+  }
+  const size_t name_end = std::min(path.find('/', 1), path.size());
+  const auto mount_it = by_name_.find(path.substr(1, name_end - 1));
+  if (mount_it == by_name_.end()) {
+    return nullptr;
+  }
+  *relative = path.substr(name_end);
+  return mount_it->second;
+}
+
+// Editors save files in several steps: reload once they are done.
+constexpr std::chrono::milliseconds SETTLE_DELAY(100);
+
+Watcher::Watcher(const Table &table, const std::chrono::seconds poll_interval)
+    : poll_interval_(poll_interval),
+      inotify_fd_(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {
+  CHECK_M(pipe2(wake_fds_, O_CLOEXEC) == 0, strerror(errno));
+  if (inotify_fd_ < 0) {
+    LOG(WARNING) << "Local specs won't be reloaded: " << strerror(errno);
+  }
+  for (const auto &mount : table.mounts()) {
+    const std::string &address = mount->spec().spec_addr;
+    // Compiled specs only change with the binary.
+    if (openapi::FindCompiledSpec(address) != nullptr) {
+      continue;
+    }
+    if (IsRemote(address)) {
+      remote_.push_back(mount.get());
+      continue;
+    }
+    if (inotify_fd_ < 0) {
+      continue;
+    }
+    // Watch the directory, as specs are often replaced rather than written.
+    const path::Path spec_path = std::filesystem::absolute(address);
+    const int wd = inotify_add_watch(inotify_fd_,
+                                     spec_path.parent_path().c_str(),
+                                     IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+    if (wd < 0) {
+      LOG(WARNING) << "Failed to watch " << address << ": " << strerror(errno);
+      continue;
+    }
+    watches_[wd].emplace_back(spec_path.filename(), mount.get());
+  }
+}
+
+Watcher::~Watcher() {
+  if (thread_.joinable()) {
+    CHECK(write(wake_fds_[1], "", 1) == 1);
+    thread_.join();
+  }
+  close(wake_fds_[0]);
+  close(wake_fds_[1]);
+  if (inotify_fd_ >= 0) {
+    close(inotify_fd_);
+  }
+}
+
+void Watcher::Start(Invalidate invalidate) {
+  CHECK(!thread_.joinable());
+  invalidate_ = std::move(invalidate);
+  thread_ = std::thread(&Watcher::Loop, this);
+}
+
+void Watcher::Loop() {
+  const bool polling = !remote_.empty() && poll_interval_.count() > 0;
+  Clock::time_point next_poll = Clock::now() + poll_interval_;
+  while (true) {
+    int timeout_ms = -1;
+    if (polling) {
+      timeout_ms = std::max<int64_t>(
+          0, std::chrono::duration_cast<std::chrono::milliseconds>(
+                 next_poll - Clock::now())
+                 .count());
+    }
+    struct pollfd fds[] = {{.fd = wake_fds_[0], .events = POLLIN},
+                           {.fd = inotify_fd_, .events = POLLIN}};
+    if (poll(fds, inotify_fd_ < 0 ? 1 : 2, timeout_ms) < 0) {
+      CHECK_M(errno == EINTR, strerror(errno));
+      continue;
+    }
+    if (fds[0].revents != 0) {
+      return;
+    }
+    if (fds[1].revents != 0) {
+      std::this_thread::sleep_for(SETTLE_DELAY);
+      for (Mount *mount : ReadEvents()) {
+        Reload(mount);
+      }
+    }
+    if (polling && Clock::now() >= next_poll) {
+      for (Mount *mount : remote_) {
+        Reload(mount);
+      }
+      next_poll = Clock::now() + poll_interval_;
+    }
+  }
+}
+
+std::vector<Mount *> Watcher::ReadEvents() {
+  std::vector<Mount *> touched;
+  alignas(struct inotify_event) char buffer[4096];
+  ssize_t length;
+  while ((length = read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+    for (ssize_t offset = 0; offset < length;) {
+      const auto *event =
+          reinterpret_cast<const struct inotify_event *>(buffer + offset);
+      offset += sizeof(struct inotify_event) + event->len;
+      const auto watch_it = watches_.find(event->wd);
+      if (watch_it == watches_.end() || event->len == 0) {
+        continue;
+      }
+      for (const auto &[filename, mount] : watch_it->second) {
+        if (filename == event->name &&
+            std::find(touched.begin(), touched.end(), mount) ==
+                touched.end()) {
+          touched.push_back(mount);
+        }
+      }
+    }
+  }
+  return touched;
+}
+
+void Watcher::Reload(Mount *mount) {
+  for (const path::Path &path : mount->Reload()) {
+    invalidate_(mount->FullPath(path));
+  }
+}
+
+} // namespace mount
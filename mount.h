@@ -0,0 +1,175 @@
+#ifndef MOUNT_H
+#define MOUNT_H
+
+#include "collection.h"
+#include "http.h"
+#include "openapi.h"
+#include "path.h"
+#include "scheduler.h"
+#include "worker.h"
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace mount {
+
+// Where to find one API and where to expose it.
+struct Spec final {
+  // Top-level directory of the API. Empty when it is the only API and takes
+  // the whole mount point.
+  std::string name;
+  std::string spec_addr;
+  std::string host_addr;
+  std::string headers_addr;
+  std::string collections_addr;
+};
+
+// Reads a manifest: a JSON array of objects with the "spec", "host",
+// "headers", "collections" and "subdirectory" of every API to mount.
+std::vector<Spec> SpecsFromJsonValue(const Json::Value &manifest);
+
+// Reads `address`, a local path or an url starting with 'http'. Returns
+// std::nullopt when it can't be read; failures are logged.
+//
+// With `etag`, which requires `unchanged`, remote content is asked for
+// unless its ETag is still a non-empty `*etag`. When it is, `*unchanged` is
+// set and nothing is read. Otherwise `*etag` is set to the ETag of what was
+// read, empty when it has none.
+std::optional<std::stringstream> ReadContent(const std::string &address,
+                                             std::string *etag = nullptr,
+                                             bool *unchanged = nullptr);
+
+// Identifies the content of a spec as last read.
+struct SpecVersion final {
+  // Sent back to remote specs so they answer 304 while unchanged.
+  std::string etag;
+  size_t hash = 0;
+};
+
+// Reads the spec at `address` into `*spec` unless it is still at `*version`,
+// which is updated otherwise. Returns false when the spec is unchanged or
+// could not be read or parsed; failures are logged.
+bool ReadSpecIfChanged(const std::string &address, SpecVersion *version,
+                       Json::Value *spec);
+
+// One API exposed under the mount point.
+class Mount final {
+public:
+  Mount(const Spec &spec, std::shared_ptr<const openapi::Directory> directory,
+        const SpecVersion &spec_version,
+        const std::vector<std::string> &header_lines,
+        collection::ConfigMap collections, scheduler::Scheduler *scheduler,
+        worker::Pool *workers);
+  Mount(const Mount &) = delete;
+  Mount &operator=(const Mount &) = delete;
+
+  const std::string &name() const { return spec_.name; }
+  const Spec &spec() const { return spec_; }
+  // The tree is replaced when the spec is reloaded: operations keep the
+  // snapshot they started with, which is freed once the last of them is done.
+  std::shared_ptr<const openapi::Directory> directory() const {
+    return std::atomic_load(&directory_);
+  }
+  const http::Headers &headers() const { return headers_; }
+  collection::Registry &collections() { return collections_; }
+
+  // `relative` as seen from the mount point.
+  path::Path FullPath(const path::Path &relative) const;
+
+  // Rebuilds the tree when the spec changed and returns the paths that
+  // changed. Not thread-safe: only one thread may reload a mount.
+  std::vector<path::Path> Reload();
+
+private:
+  const Spec spec_;
+  std::shared_ptr<const openapi::Directory> directory_;
+  SpecVersion spec_version_;
+  http::Headers headers_;
+  collection::Registry collections_;
+};
+
+// Returns nullptr when the spec, headers or collections of `spec` can't be
+// read, so that the other APIs are still mounted.
+std::unique_ptr<Mount> LoadMount(const Spec &spec,
+                                 scheduler::Scheduler *scheduler,
+                                 worker::Pool *workers);
+
+// Every API served by the process, each under its own top-level directory.
+class Table final {
+public:
+  Table() = default;
+  Table(const Table &) = delete;
+  Table &operator=(const Table &) = delete;
+
+  void Add(std::unique_ptr<Mount> mount);
+
+  // Returns the mount serving `path` and sets `*relative` to `path` within
+  // that mount. Returns nullptr for unknown top-level directories and for
+  // the mount point itself when it holds several APIs.
+  Mount *Find(const path::Path &path, path::Path *relative) const;
+  // Same as above, with `*relative` viewing `path` rather than building a
+  // path. It is empty for the top-level directory of a mount.
+  Mount *Find(std::string_view path, std::string_view *relative) const;
+
+  // Whether `path` is the mount point listing the APIs.
+  bool IsMountPoint(const path::Path &path) const {
+    return path == "/" && !single();
+  }
+
+  const std::vector<std::unique_ptr<Mount>> &mounts() const {
+    return mounts_;
+  }
+
+private:
+  bool single() const { return mounts_.size() == 1 && mounts_[0]->name().empty(); }
+
+  std::vector<std::unique_ptr<Mount>> mounts_;
+  std::map<std::string, Mount *, std::less<>> by_name_;
+};
+
+// Reloads the specs of the mounts when they change. Local specs are watched
+// through inotify and remote ones polled with conditional requests.
+class Watcher final {
+public:
+  // Called with the paths, as seen from the mount point, whose content
+  // changed.
+  using Invalidate = std::function<void(const path::Path &)>;
+
+  // A zero `poll_interval` disables polling remote specs.
+  Watcher(const Table &table, const std::chrono::seconds poll_interval);
+  Watcher(const Watcher &) = delete;
+  Watcher &operator=(const Watcher &) = delete;
+  ~Watcher();
+
+  // Starts watching on a background thread.
+  void Start(Invalidate invalidate);
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  void Loop();
+  // Returns the mounts whose spec was touched.
+  std::vector<Mount *> ReadEvents();
+  void Reload(Mount *mount);
+
+  const std::chrono::seconds poll_interval_;
+  Invalidate invalidate_;
+  int inotify_fd_;
+  int wake_fds_[2]; // Written to stop the thread.
+  // Watched directories to the file name of the specs they hold.
+  std::map<int, std::vector<std::pair<std::string, Mount *>>> watches_;
+  std::vector<Mount *> remote_;
+  std::thread thread_;
+};
+
+} // namespace mount
+
+#endif
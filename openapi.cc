@@ -1,29 +1,26 @@
 #include "openapi.h"
+#include "trace.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
 #include <unistd.h>
 #include <unordered_map>
 
-std::ostream &operator<<(std::ostream &os,
-                         const openapi::PathToNodeMap &path_to_node_map) {
-  os << "{" << std::endl;
-  for (auto it = path_to_node_map.begin(); it != path_to_node_map.end(); ++it) {
+std::ostream &operator<<(std::ostream &os, const openapi::Directory &d) {
+  os << "Root: " << d.root() << std::endl;
+  os << "Map: {" << std::endl;
+  for (auto it = d.begin(); it != d.end(); ++it) {
     os << it->first << ":" << it->second << std::endl;
-    CHECK(it->second.stat().st_gid == getgid());
   }
   os << "}" << std::endl;
   return os;
 }
 
-std::ostream &operator<<(std::ostream &os, const openapi::Directory &d) {
-  os << "Root: " << d.root() << std::endl;
-  os << "Map: " << d.path_to_node_map() << std::endl;
-  return os;
-}
-
 namespace path {
 template <>
-Node SimpleFileNode<Json::Value>(const path::Path &path,
-                                 const Json::Value *data,
-                                 const std::initializer_list<NodeMode> &modes) {
+NodeData
+SimpleFileNode<Json::Value>(const path::Path &path, const Json::Value *data,
+                            const std::initializer_list<NodeMode> &modes) {
   Json::StreamWriterBuilder builder;
   builder["indentation"] = "  "; // assume default for comments is None
   const std::string filecontent = Json::writeString(builder, *data);
@@ -43,12 +40,11 @@ std::string join(InputIt first, InputIt last, const std::string &separator = "",
   }
 
   std::stringstream ss;
-  ss << starter << *first << [&first, &last, &separator, &ss]() {
-    for (; first != last; ++first) {
-      ss << separator << *first;
-    }
-    return "";
-  }() << concluder;
+  ss << starter << *first;
+  for (++first; first != last; ++first) {
+    ss << separator << *first;
+  }
+  ss << concluder;
 
   return ss.str();
 }
@@ -72,8 +68,8 @@ static const Json::Value &FindOrDie(const Json::Value &value,
   return *found;
 }
 
-static const Json::Value *FindAbsolutePath(const Json::Value &root,
-                                           const path::Path &path) {
+const Json::Value *FindAbsolutePath(const Json::Value &root,
+                                    const path::Path &path) {
   const Json::Value *current = &root;
   auto parts_it = path.begin();
   CHECK(parts_it != path.end());
@@ -104,26 +100,144 @@ static const Json::Value &FindAbsolutePath(const Json::Value &root,
   return *value;
 }
 
+// Decodes one reference token of a JSON pointer held in a URI fragment:
+// percent-encoding first, then ~1 for '/' and ~0 for '~'.
+static std::string DecodePointerToken(const std::string_view token) {
+  auto is_hex = [](const char c) {
+    return std::isxdigit(static_cast<unsigned char>(c)) != 0;
+  };
+  std::string decoded;
+  decoded.reserve(token.length());
+  for (size_t idx = 0; idx < token.length(); ++idx) {
+    if (token[idx] == '%' && idx + 2 < token.length() &&
+        is_hex(token[idx + 1]) && is_hex(token[idx + 2])) {
+      decoded.push_back(static_cast<char>(
+          std::stoi(std::string(token.substr(idx + 1, 2)), nullptr, 16)));
+      idx += 2;
+    } else {
+      decoded.push_back(token[idx]);
+    }
+  }
+  std::string unescaped;
+  unescaped.reserve(decoded.length());
+  for (size_t idx = 0; idx < decoded.length(); ++idx) {
+    if (decoded[idx] == '~' && idx + 1 < decoded.length() &&
+        (decoded[idx + 1] == '0' || decoded[idx + 1] == '1')) {
+      unescaped.push_back(decoded[idx + 1] == '0' ? '~' : '/');
+      ++idx;
+    } else {
+      unescaped.push_back(decoded[idx]);
+    }
+  }
+  return unescaped;
+}
+
+// Resolves "$ref"s within a spec. Every reference is walked once: the node it
+// leads to, after following chained references, is remembered for the next
+// operations sharing it.
+class RefResolver final {
+public:
+  explicit RefResolver(const Json::Value *root) : root_(root) {}
+  RefResolver(const RefResolver &) = delete;
+  RefResolver &operator=(const RefResolver &) = delete;
+
+  // Returns `value`, or what it refers to when it is a reference. References
+  // that are external, missing or cyclic resolve to null.
+  const Json::Value &Resolve(const Json::Value &value) {
+    const Json::Value *ref = value.isObject() ? Find(value, "$ref") : nullptr;
+    if (ref == nullptr || !ref->isString()) {
+      return value;
+    }
+    const Json::Value *target = Lookup(ref->asString());
+    return (target == nullptr) ? Json::Value::nullSingleton() : *target;
+  }
+
+private:
+  const Json::Value *Lookup(const std::string &ref) {
+    const auto cached = resolved_.find(ref);
+    if (cached != resolved_.end()) {
+      return cached->second;
+    }
+    std::vector<std::string> chain;
+    const Json::Value *target = nullptr;
+    for (std::string pointer = ref;;) {
+      const auto resolved_it = resolved_.find(pointer);
+      if (resolved_it != resolved_.end()) {
+        target = resolved_it->second;
+        break;
+      }
+      if (std::find(chain.begin(), chain.end(), pointer) != chain.end()) {
+        LOG(WARNING) << "Cyclic $ref: " << ref;
+        target = nullptr;
+        break;
+      }
+      chain.push_back(pointer);
+      target = Walk(pointer);
+      if (target == nullptr) {
+        LOG(WARNING) << "Unresolved $ref: " << pointer;
+        break;
+      }
+      const Json::Value *next =
+          target->isObject() ? Find(*target, "$ref") : nullptr;
+      if (next == nullptr || !next->isString()) {
+        break;
+      }
+      pointer = next->asString();
+    }
+    for (std::string &pointer : chain) {
+      resolved_.emplace(std::move(pointer), target);
+    }
+    return target;
+  }
+
+  // Walks the JSON pointer in the fragment of `ref`. Returns nullptr for
+  // external references and missing nodes.
+  const Json::Value *Walk(const std::string &ref) const {
+    if (ref.empty() || ref[0] != '#') {
+      return nullptr;
+    }
+    const std::string_view pointer = std::string_view(ref).substr(1);
+    if (!pointer.empty() && pointer[0] != '/') {
+      return nullptr;
+    }
+    const Json::Value *current = root_;
+    for (size_t begin = 1; begin <= pointer.length();) {
+      const size_t end = std::min(pointer.find('/', begin), pointer.length());
+      const std::string token =
+          DecodePointerToken(pointer.substr(begin, end - begin));
+      begin = end + 1;
+      if (current->isObject()) {
+        current = Find(*current, token);
+      } else if (current->isArray() && !token.empty() &&
+                 token.length() < 10 &&
+                 std::all_of(token.begin(), token.end(), ::isdigit) &&
+                 std::stoul(token) < current->size()) {
+        current = &(*current)[Json::ArrayIndex(std::stoul(token))];
+      } else {
+        current = nullptr;
+      }
+      if (current == nullptr) {
+        return nullptr;
+      }
+    }
+    return current;
+  }
+
+  const Json::Value *root_;
+  // Targets of the references walked so far, null when unresolved.
+  std::unordered_map<std::string, const Json::Value *> resolved_;
+};
+
 class NodeFactory final {
 public:
-  NodeFactory(const Json::Value *root) : root_(root) {}
+  NodeFactory(const Json::Value *root) : root_(root), refs_(root) {}
   ~NodeFactory() {}
 
   const Json::Value &ResolveRef(const Json::Value &value) const {
-    const Json::Value *sub = Find(value, "$ref");
-    if (sub == nullptr) {
-      return value;
-    }
-
-    const std::string &ref_value = sub->asString();
-    CHECK(ref_value[0] == '#');
-    const path::Path ref_value_path(ref_value.substr(1));
-    sub = FindAbsolutePath(*root_, ref_value_path);
-    CHECK_M(sub != nullptr, "Couldn't find path " + ref_value_path.string());
-    return *sub;
+    return refs_.Resolve(value);
   }
 
-  path::Node WriteOperationNode(const path::Path &path,
+  path::NodeData WriteOperationNode(const path::Path &path,
                                 const Json::Value *json) const {
     // const Json::Value &content =
     //     FindAbsolutePath(*json, "/requestBody/content", Json::Value::null);
@@ -134,7 +248,7 @@ public:
     return path::SimpleFileNode(path, json, {S_IWRITE});
   }
 
-  path::Node ReadOperationNode(const path::Path &path,
+  path::NodeData ReadOperationNode(const path::Path &path,
                                const Json::Value *json) const {
     // const Json::Value &content =
     //     FindAbsolutePath(*json, "/responses/200/content", Json::Value::null);
@@ -168,7 +282,7 @@ public:
     return required_query_params;
   }
 
-  path::Node OperationNode(const rest::constants::OPERATIONS op,
+  path::NodeData OperationNode(const rest::constants::OPERATIONS op,
                            const Json::Value *json) const {
     std::vector<std::string> required_query_params =
         FindRequiredQueryParams(json);
@@ -194,37 +308,27 @@ public:
       break;
     }
     LOG(FATAL) << "Unsupported operation: " << op;
-    return path::Node({{}, {}, nullptr}); // Unreachable
+    return {}; // Unreachable
   }
 
-  path::Node EntityOperationNode(const path::Path &path,
+  path::NodeData EntityOperationNode(const path::Path &path,
                                  const Entity *entity) const {
     return path::SimpleFileNode(path, entity, {entity->modes});
   }
 
 private:
   const Json::Value *root_;
+  mutable RefResolver refs_;
 }; // namespace openapi
 
 Directory
 NewDirectoryFromJsonValue(const std::string &host,
                           std::unique_ptr<const Json::Value> json_data) {
   NodeFactory factory(json_data.get());
-  PathToNodeMap path_to_node_map;
-  auto insert_it =
-      path_to_node_map.emplace(path::Path("/"), path::DirNode("/", nullptr));
-  CHECK(insert_it.second);
-  path::Node *root = &insert_it.first->second;
-  auto insert_node = [root, &path_to_node_map](const path::Path &in_path,
-                                               const path::Node &&node) {
-    const auto path = path::utils::PathToRefValueMap(in_path);
-    auto insert_pair = path_to_node_map.emplace(path, node);
-    if (insert_pair.second) {
-      auto parent = path_to_node_map.find(path.parent_path());
-      CHECK(parent != path_to_node_map.end());
-      parent->second.mutable_children()->push_back(&insert_pair.first->second);
-    }
-    return insert_pair;
+  path::NodeTableBuilder builder;
+  auto insert_node = [&builder](const path::Path &in_path,
+                                const path::NodeData &&node) {
+    return builder.Insert(path::utils::PathToRefValueMap(in_path), node);
   };
 
   auto insert_rest_operations_metadata = [&insert_node, &factory](
@@ -234,17 +338,38 @@ NewDirectoryFromJsonValue(const std::string &host,
       const auto &op_json = value[op_name];
       const auto it = rest::constants::operations_map().find(op_name);
       CHECK(it != rest::constants::operations_map().end());
-      const path::Node node = factory.OperationNode(it->second, &op_json);
-      const auto node_path = node.path();
+      const path::NodeData node = factory.OperationNode(it->second, &op_json);
+      const auto node_path = node.path;
       insert_node(directory_path / node_path, std::move(node));
 
       const path::Path meta_json =
           directory_path /
           (node_path.filename().stem().string() + ".metadata.json");
-      auto insert_pair = insert_node(
-          meta_json, path::SimpleFileNode(meta_json.filename(),
-                                          node.data<Json::Value>(), {S_IREAD}));
-      CHECK_M(insert_pair.second, "Path already exists: " + meta_json.string());
+      // Reads the same value as the operation: reuse its serialized size.
+      const bool inserted = insert_node(
+          meta_json, path::SimpleFileNode(meta_json.filename(), node.data,
+                                          node.size, {S_IREAD}));
+      CHECK_M(inserted, "Path already exists: " + meta_json.string());
+
+      if (it->second == rest::constants::GET) {
+        const path::Path projections =
+            directory_path / (node_path.string() + PROJECTION_SUFFIX);
+        insert_node(projections,
+                    path::DirNode(projections.filename(), nullptr));
+      }
+
+      const std::string directory = directory_path.string();
+      const bool single_parameter =
+          std::count(directory.begin(), directory.end(), '{') == 1 &&
+          directory_path.filename().string()[0] == '{';
+      if (it->second == rest::constants::GET && single_parameter &&
+          node_path == "get.json") {
+        // Several parameters of one directory may have a GET: the first one
+        // gets the batch file.
+        const path::Path batch = directory_path.parent_path() / BATCH_FILENAME;
+        insert_node(batch, path::SimpleFileNode(batch.filename(), &op_json,
+                                                {S_IREAD, S_IWRITE}));
+      }
     }
   };
   const path::Path root_meta_json("/metadata.json");
@@ -256,14 +381,11 @@ NewDirectoryFromJsonValue(const std::string &host,
     const path::Path path = path::utils::PathToRefValueMap(it.key().asString());
     const Json::Value &value = *it;
 
-    [&path, &value, &root, &insert_node, &insert_rest_operations_metadata]() {
-      const path::Node *parent = root;
-      auto current_path = parent->path();
+    [&path, &value, &insert_node, &insert_rest_operations_metadata]() {
+      path::Path current_path = "/";
       for (const path::Path &part : path) {
         current_path /= part;
-        auto insert_pair =
-            insert_node(current_path, path::DirNode(part, nullptr));
-        parent = &insert_pair.first->second;
+        insert_node(current_path, path::DirNode(part, nullptr));
       }
       insert_rest_operations_metadata(current_path, value);
     }();
@@ -283,10 +405,59 @@ NewDirectoryFromJsonValue(const std::string &host,
   //               &entity));
   // }
 
-  return Directory(host, std::move(path_to_node_map), std::move(entities),
+  return Directory(host, builder.Build(), std::move(entities),
                    std::move(json_data));
 }
 
+// Compiled specs by name. Filled by static initializers, hence a function
+// static.
+static std::map<std::string, const CompiledSpec *> &CompiledSpecs() {
+  static std::map<std::string, const CompiledSpec *> specs;
+  return specs;
+}
+
+bool RegisterCompiledSpec(const CompiledSpec *spec) {
+  CHECK_M(CompiledSpecs().emplace(spec->name, spec).second,
+          std::string("Duplicated compiled spec: ") + spec->name);
+  return true;
+}
+
+const CompiledSpec *FindCompiledSpec(const std::string &address) {
+  const size_t scheme_length = strlen(COMPILED_SPEC_SCHEME);
+  if (address.compare(0, scheme_length, COMPILED_SPEC_SCHEME) != 0) {
+    return nullptr;
+  }
+  const auto it = CompiledSpecs().find(address.substr(scheme_length));
+  return (it == CompiledSpecs().end()) ? nullptr : it->second;
+}
+
+Directory NewDirectoryFromCompiledSpec(const std::string &host,
+                                       const CompiledSpec &spec) {
+  return Directory(host, path::NodeTable(spec.columns), {}, nullptr);
+}
+
+std::string MetadataText(const Json::Value &value) {
+  Json::StreamWriterBuilder builder;
+  builder["indentation"] = "  ";
+  return Json::writeString(builder, value);
+}
+
+std::string Directory::Metadata(const path::Node &node) const {
+  if (value_ == nullptr) {
+    const std::string_view *text = node.data<std::string_view>();
+    return (text == nullptr) ? "" : std::string(*text);
+  }
+  const Json::Value *value = node.data<Json::Value>();
+  return (value == nullptr) ? "" : MetadataText(*value);
+}
+
+bool IsProjectionDirectory(const path::Node &node) {
+  const std::string_view name = node.name();
+  const std::string suffix = std::string(".json") + PROJECTION_SUFFIX;
+  return node.is_directory() && name.size() > suffix.size() &&
+         name.substr(name.size() - suffix.size()) == suffix;
+}
+
 const Json::Value JsonValueFromPath(const path::Path &path) {
   Json::Value val;
   path::utils::BindRefs(path,
@@ -298,10 +469,103 @@ const Json::Value JsonValueFromPath(const path::Path &path) {
   return val;
 }
 
-PathToNodeMap::const_iterator Directory::find(const path::Path &path) const {
-  auto canonical_path = path::utils::PathToRefValueMap(path);
-  const Json::Value from_path = JsonValueFromPath(path);
-  return path_to_node_map_.find(canonical_path);
+std::map<std::string, std::vector<path::NodeIndex>>
+GetsByRef(const path::NodeTable &table) {
+  std::map<std::string, std::vector<path::NodeIndex>> gets;
+  for (path::NodeIndex idx = 0; idx < table.size(); ++idx) {
+    if (table.node(idx).name() != "get.json") {
+      continue;
+    }
+    for (const path::Ref &ref :
+         path::utils::RefSetFromPath(table.PathOf(idx))) {
+      gets[ref].push_back(idx);
+    }
+  }
+  return gets;
+}
+
+const std::vector<path::NodeIndex> &
+Directory::GetsTaking(const std::string &ref) const {
+  static const std::vector<path::NodeIndex> NONE;
+  const auto it = gets_by_ref_.find(ref);
+  return (it == gets_by_ref_.end()) ? NONE : it->second;
+}
+
+Directory::const_iterator Directory::find(const path::Path &path,
+                                          path::RefValueMap *bindings) const {
+  const trace::Span span("match");
+  const path::NodeIndex index = matcher_.Match(path, bindings);
+  return (index == path::NO_NODE) ? end() : const_iterator(&table_, index);
+}
+
+// Nodes are the same when they look the same to the kernel and would be read
+// the same.
+static bool SameNode(const path::Node &before, const path::Node &after) {
+  if (before.mode() != after.mode() || before.size() != after.size()) {
+    return false;
+  }
+  const Json::Value *before_data = before.data<Json::Value>();
+  const Json::Value *after_data = after.data<Json::Value>();
+  if (before_data == nullptr || after_data == nullptr) {
+    return before_data == after_data;
+  }
+  return *before_data == *after_data;
+}
+
+static void InsertSubtree(const path::Path &path, const path::Node &node,
+                          std::vector<path::Path> *changed) {
+  changed->push_back(path);
+  for (const path::Node child : node.children()) {
+    InsertSubtree(path / child.name(), child, changed);
+  }
+}
+
+// Walks both trees at once: siblings are sorted by name in both.
+static void ChangedChildren(const path::Path &path, const path::Node &before,
+                            const path::Node &after,
+                            std::vector<path::Path> *changed) {
+  const path::NodeRange before_children = before.children();
+  const path::NodeRange after_children = after.children();
+  auto before_it = before_children.begin();
+  auto after_it = after_children.begin();
+  bool listing_changed = false;
+  while (before_it != before_children.end() ||
+         after_it != after_children.end()) {
+    const int compared =
+        (before_it == before_children.end())  ? 1
+        : (after_it == after_children.end()) ? -1
+                                               : (*before_it).name().compare(
+                                                     (*after_it).name());
+    if (compared < 0) {
+      InsertSubtree(path / (*before_it).name(), *before_it, changed);
+      listing_changed = true;
+      ++before_it;
+    } else if (compared > 0) {
+      InsertSubtree(path / (*after_it).name(), *after_it, changed);
+      listing_changed = true;
+      ++after_it;
+    } else {
+      const path::Path child_path = path / (*after_it).name();
+      if (!SameNode(*before_it, *after_it)) {
+        changed->push_back(child_path);
+      }
+      ChangedChildren(child_path, *before_it, *after_it, changed);
+      ++before_it;
+      ++after_it;
+    }
+  }
+  if (listing_changed) {
+    changed->push_back(path);
+  }
+}
+
+std::vector<path::Path> ChangedPaths(const Directory &before,
+                                     const Directory &after) {
+  std::vector<path::Path> changed;
+  ChangedChildren("/", before.root(), after.root(), &changed);
+  std::sort(changed.begin(), changed.end());
+  changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+  return changed;
 }
 
 } // namespace openapi
@@ -1,9 +1,11 @@
 #ifndef OPENAPI_H
 #define OPENAPI_H
 
+#include "lookup.h"
 #include "path.h"
-
 #include "rest.h"
+#include "route.h"
+
 #include <ext/pb_ds/assoc_container.hpp>
 #include <ext/pb_ds/tag_and_trait.hpp>
 #include <ext/pb_ds/trie_policy.hpp>
@@ -24,14 +26,54 @@ std::ostream &operator<<(std::ostream &os, const openapi::Directory &d);
 
 namespace openapi {
 
-using PathToNodeMap = std::map<path::Path, path::Node>;
-
 class Directory;
 
+// Name of the batch file of a GET operation with a single path parameter,
+// next to the parameter: /v2/orders/batch.get.ndjson for
+// /v2/orders/{soid}/get.json. See batch.h.
+constexpr char BATCH_FILENAME[] = "batch.get.ndjson";
+
+// Appended to the name of a GET file to name the directory of projections of
+// its response: /v2/orders/{soid}/get.json.d. See projection.h.
+constexpr char PROJECTION_SUFFIX[] = ".d";
+
+// Whether `node` is the projection directory of a GET file. What lies below
+// it comes from the response rather than from the spec.
+bool IsProjectionDirectory(const path::Node &node);
+
 Directory
 NewDirectoryFromJsonValue(const std::string &host_name,
                           std::unique_ptr<const Json::Value> json_data);
+
+// A spec compiled into the binary by spec_compiler (see restfs.bzl): the node
+// table NewDirectoryFromJsonValue would build, as static arrays. The data of
+// every node is the std::string_view its metadata file reads.
+struct CompiledSpec final {
+  const char *name;
+  path::NodeColumns columns;
+};
+
+// Compiled specs are mounted through the address "compiled:<name>".
+constexpr char COMPILED_SPEC_SCHEME[] = "compiled:";
+
+// Makes `spec`, which must outlive the process, available to
+// FindCompiledSpec. Called by the static initializers spec_compiler
+// generates.
+bool RegisterCompiledSpec(const CompiledSpec *spec);
+// Returns nullptr unless `address` names a compiled spec.
+const CompiledSpec *FindCompiledSpec(const std::string &address);
+
+// Borrows the arrays of `spec` rather than parsing anything.
+Directory NewDirectoryFromCompiledSpec(const std::string &host_name,
+                                       const CompiledSpec &spec);
+
+// What the metadata file of a node holding `value` reads.
+std::string MetadataText(const Json::Value &value);
 const Json::Value JsonValueFromPath(const path::Path &path);
+// Resolves the absolute JSON pointer `path` under `root`. Returns nullptr when
+// some part of it is missing.
+const Json::Value *FindAbsolutePath(const Json::Value &root,
+                                    const path::Path &path);
 
 struct Entity final {
   const path::Path path;
@@ -41,23 +83,73 @@ struct Entity final {
   const path::NodeMode modes;
 };
 
+// The GET files of `table` by the parameters their paths take.
+std::map<std::string, std::vector<path::NodeIndex>>
+GetsByRef(const path::NodeTable &table);
+
 class Directory final {
 public:
-  Directory(const std::string &directory_url_prefix,
-            PathToNodeMap path_to_node_map,
+  // A node along with its absolute path.
+  struct Entry final {
+    path::Path first;
+    path::Node second;
+  };
+
+  // Visits the nodes breadth first. Entries are built when dereferenced.
+  class const_iterator final {
+  public:
+    struct Arrow final {
+      Entry entry;
+      const Entry *operator->() const { return &entry; }
+    };
+
+    const_iterator(const path::NodeTable *table, const path::NodeIndex index)
+        : table_(table), index_(index) {}
+    Entry operator*() const {
+      return {table_->PathOf(index_), table_->node(index_)};
+    }
+    Arrow operator->() const { return {**this}; }
+    const_iterator &operator++() {
+      ++index_;
+      return *this;
+    }
+    bool operator==(const const_iterator &other) const {
+      return index_ == other.index_;
+    }
+    bool operator!=(const const_iterator &other) const {
+      return index_ != other.index_;
+    }
+
+  private:
+    const path::NodeTable *table_;
+    path::NodeIndex index_;
+  };
+
+  // `value` is null for compiled specs, whose nodes hold their metadata
+  // already serialized.
+  Directory(const std::string &directory_url_prefix, path::NodeTable table,
             const std::vector<Entity> &&entities,
             std::unique_ptr<const Json::Value> value)
-      : directory_url_prefix_(directory_url_prefix),
-        path_to_node_map_(std::move(path_to_node_map)),
-        entities_(std::move(entities)), value_(std::move(value)) {}
-
-  PathToNodeMap::const_iterator find(const path::Path &path) const;
-
-  PathToNodeMap::const_iterator begin() const {
-    return path_to_node_map_.begin();
+      : directory_url_prefix_(directory_url_prefix), table_(std::move(table)),
+        matcher_(table_), names_(matcher_, IsProjectionDirectory),
+        gets_by_ref_(GetsByRef(table_)), entities_(std::move(entities)),
+        value_(std::move(value)) {}
+
+  // Resolves `path`, whose parameters may be concrete values or bound
+  // references ({ref:value}). Their values are set in `*bindings` when not
+  // null.
+  const_iterator find(const path::Path &path,
+                      path::RefValueMap *bindings = nullptr) const;
+
+  // Whether `path` may be found. False means find() surely returns end(),
+  // which is told far cheaper than by find() itself.
+  bool MayFind(const std::string_view path) const {
+    return names_.MayMatch(path);
   }
 
-  PathToNodeMap::const_iterator end() const { return path_to_node_map_.end(); }
+  const_iterator begin() const { return const_iterator(&table_, 0); }
+
+  const_iterator end() const { return const_iterator(&table_, table_.size()); }
 
   const std::string &directory_url_prefix() const {
     return directory_url_prefix_;
@@ -69,23 +161,32 @@ public:
     return ss.str();
   }
 
-  const path::Node &root() const {
-    auto root_it = path_to_node_map_.find("/");
-    CHECK(root_it != path_to_node_map_.end())
-    return root_it->second;
-  }
+  path::Node root() const { return table_.root(); }
 
-  const openapi::PathToNodeMap path_to_node_map() const {
-    return path_to_node_map_;
-  }
+  // What the metadata file at `node` reads.
+  std::string Metadata(const path::Node &node) const;
+
+  const path::NodeTable &table() const { return table_; }
+
+  // GET files whose path takes the parameter `ref`, such as
+  // /v2/orders/{soid}/get.json for soid.
+  const std::vector<path::NodeIndex> &GetsTaking(const std::string &ref) const;
 
 private:
   const std::string directory_url_prefix_;
-  const openapi::PathToNodeMap path_to_node_map_;
+  const path::NodeTable table_;
+  const route::Matcher matcher_;
+  const lookup::NameFilter names_;
+  const std::map<std::string, std::vector<path::NodeIndex>> gets_by_ref_;
   const std::vector<Entity> entities_;
   const std::unique_ptr<const Json::Value> value_;
 };
 
+// Paths added, removed or changed from `before` to `after`, along with the
+// directories whose listing changed.
+std::vector<path::Path> ChangedPaths(const Directory &before,
+                                     const Directory &after);
+
 } // namespace openapi
 
 #endif
\ No newline at end of file
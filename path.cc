@@ -2,7 +2,7 @@
 
 #include "path.h"
 
-#include <cmath>
+#include <algorithm>
 #include <functional>
 #include <regex>
 #include <string>
@@ -25,8 +25,8 @@ std::ostream &operator<<(std::ostream &os, const struct stat &s) {
 std::ostream &operator<<(std::ostream &os, const path::Node &n) {
 
   os << n.path() << ": [";
-  for (const auto &child : n.children()) {
-    os << *child << ",";
+  for (const path::Node child : n.children()) {
+    os << child << ",";
   }
   os << "]";
   return os;
@@ -34,40 +34,186 @@ std::ostream &operator<<(std::ostream &os, const path::Node &n) {
 
 namespace path {
 
-path::Node SimpleFileNode(const path::Path &path, const void *data,
-                          const size_t data_size,
-                          const std::initializer_list<NodeMode> &modes) {
+struct stat MakeStat(const NodeMode mode, const size_t size, const ino_t ino) {
   struct stat s {};
   s.st_dev = 0;
-  s.st_ino = std::hash<path::Path>{}(path); /* Inode number */
-  s.st_uid = getuid();                      /* User ID of owner */
-  s.st_gid = getgid();                      /* Group ID of owner */
-  s.st_mode = S_IFREG | 0000;               /* File type and mode */
-  for (const NodeMode mode : modes) {
-    s.st_mode |= mode;
-  }
+  s.st_ino = ino;           /* Inode number */
+  s.st_uid = getuid();      /* User ID of owner */
+  s.st_gid = getgid();      /* Group ID of owner */
+  s.st_mode = mode;         /* File type and mode */
   s.st_nlink = 0;           /* Number of hard links */
   s.st_rdev = 0;            /* ID of device containing file */
-  s.st_size = data_size;    /* Total size, in bytes */
+  s.st_size = size;         /* Total size, in bytes */
   s.st_blksize = s.st_size; /* Block size for filesystem I/O */
-  s.st_blocks =
-      std::ceil(s.st_size / 512); /* Number of 512B blocks allocated */
-  return path::Node({path, s, data});
+  s.st_blocks = (s.st_size + 511) / 512; /* Number of 512B blocks allocated */
+  return s;
 }
 
-path::Node DirNode(const path::Path &path, const void *data) {
-  struct stat s {};
-  s.st_dev = 0;
-  s.st_ino = std::hash<std::string>{}(path); /* Inode number */
-  s.st_uid = getuid();                       /* User ID of owner */
-  s.st_gid = getgid();                       /* Group ID of owner */
-  s.st_mode = S_IFDIR | 0755;                /* File type and mode */
-  s.st_nlink = 0;                            /* Number of hard links */
-  s.st_rdev = 0;                             /* ID of device containing file */
-  s.st_size = 0;                             /* Total size, in bytes */
-  s.st_blksize = 0;                          /* Block size for filesystem I/O */
-  s.st_blocks = 0; /* Number of 512B blocks allocated */
-  return path::Node({path, s, data});
+struct stat NodeData::stat() const {
+  return MakeStat(mode, size, std::filesystem::hash_value(path));
+}
+
+NodeData SimpleFileNode(const path::Path &path, const void *data,
+                        const size_t data_size,
+                        const std::initializer_list<NodeMode> &modes) {
+  NodeMode mode = S_IFREG | 0000;
+  for (const NodeMode node_mode : modes) {
+    mode |= node_mode;
+  }
+  return {path, mode, data_size, data};
+}
+
+NodeData DirNode(const path::Path &path, const void *data) {
+  return {path, S_IFDIR | 0755, 0, data};
+}
+
+NodeTable::NodeTable(std::unique_ptr<const Storage> storage)
+    : columns_({
+          .size = static_cast<NodeIndex>(storage->names.size()),
+          .names = storage->names.data(),
+          .parents = storage->parents.data(),
+          .child_begins = storage->child_begins.data(),
+          .attributes = storage->attributes.data(),
+          .payloads = storage->payloads.data(),
+          .data_size = static_cast<uint32_t>(storage->data.size()),
+          .data = storage->data.data(),
+          .segments =
+              static_cast<uint32_t>(storage->segment_offsets.size() - 1),
+          .segment_chars = storage->segment_chars.data(),
+          .segment_offsets = storage->segment_offsets.data(),
+      }),
+      storage_(std::move(storage)) {}
+
+NodeIndex NodeTable::FindChild(const NodeIndex parent,
+                               const std::string_view name) const {
+  NodeIndex low = columns_.child_begins[parent];
+  NodeIndex high = columns_.child_begins[parent + 1];
+  while (low < high) {
+    const NodeIndex middle = low + (high - low) / 2;
+    const int compared = this->name(middle).compare(name);
+    if (compared == 0) {
+      return middle;
+    }
+    if (compared < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return NO_NODE;
+}
+
+NodeIndex NodeTable::Find(const Path &path) const {
+  auto part_it = path.begin();
+  if (size() == 0 || part_it == path.end() || *part_it != "/") {
+    return NO_NODE;
+  }
+  NodeIndex current = 0;
+  for (++part_it; part_it != path.end() && current != NO_NODE; ++part_it) {
+    current = FindChild(current, part_it->native());
+  }
+  return current;
+}
+
+Path NodeTable::PathOf(NodeIndex index) const {
+  std::vector<std::string_view> names;
+  for (; index != 0; index = columns_.parents[index]) {
+    names.push_back(name(index));
+  }
+  Path path = "/";
+  for (auto name_it = names.rbegin(); name_it != names.rend(); ++name_it) {
+    path /= *name_it;
+  }
+  return path;
+}
+
+size_t NodeTable::memory_usage() const {
+  const size_t per_node = sizeof(*columns_.names) + sizeof(*columns_.parents) +
+                          sizeof(*columns_.child_begins) +
+                          sizeof(*columns_.attributes) +
+                          sizeof(*columns_.payloads);
+  return columns_.size * per_node + sizeof(*columns_.child_begins) +
+         columns_.data_size * sizeof(*columns_.data) +
+         columns_.segment_offsets[columns_.segments] +
+         (columns_.segments + 1) * sizeof(*columns_.segment_offsets);
+}
+
+NodeTableBuilder::NodeTableBuilder() {
+  const NodeData root = DirNode("/", nullptr);
+  nodes_.push_back({"/", 0, root.mode, root.size, root.data, {}});
+}
+
+bool NodeTableBuilder::Insert(const Path &path, const NodeData &data) {
+  auto part_it = path.begin();
+  CHECK_M(part_it != path.end() && *part_it == "/",
+          "Not an absolute path: " + path.string());
+  size_t parent = 0;
+  std::string name;
+  for (++part_it; part_it != path.end();) {
+    name = part_it->string();
+    if (++part_it == path.end()) {
+      break;
+    }
+    const auto child_it = nodes_[parent].children.find(name);
+    CHECK_M(child_it != nodes_[parent].children.end(),
+            "Missing parent of " + path.string());
+    parent = child_it->second;
+  }
+  if (name.empty() || nodes_[parent].children.count(name) > 0) {
+    return false;
+  }
+  CHECK_M(data.size >> (64 - ATTRIBUTE_SIZE_SHIFT) == 0,
+          "Node too large: " + path.string());
+  nodes_[parent].children.emplace(name, nodes_.size());
+  nodes_.push_back({name, parent, data.mode, data.size, data.data, {}});
+  return true;
+}
+
+NodeTable NodeTableBuilder::Build() const {
+  CHECK(nodes_.size() < NO_NODE);
+  // Breadth first, so that the children of every node are contiguous.
+  std::vector<size_t> order = {0};
+  std::vector<NodeIndex> index_of(nodes_.size());
+  for (size_t idx = 0; idx < order.size(); ++idx) {
+    index_of[order[idx]] = idx;
+    for (const auto &[name, child] : nodes_[order[idx]].children) {
+      order.push_back(child);
+    }
+  }
+
+  auto storage = std::make_unique<NodeTable::Storage>();
+  storage->names.reserve(order.size());
+  storage->parents.reserve(order.size());
+  storage->child_begins.reserve(order.size() + 1);
+  storage->attributes.reserve(order.size());
+  storage->payloads.reserve(order.size());
+  storage->segment_offsets.push_back(0);
+  std::unordered_map<std::string_view, uint32_t> segments;
+  NodeIndex child_begin = 1;
+  for (const size_t pending_idx : order) {
+    const Pending &pending = nodes_[pending_idx];
+    const auto [segment_it, interned] =
+        segments.emplace(pending.name, segments.size());
+    if (interned) {
+      storage->segment_chars.append(pending.name);
+      storage->segment_offsets.push_back(storage->segment_chars.length());
+    }
+    storage->names.push_back(segment_it->second);
+    storage->parents.push_back(pending_idx == 0 ? NO_NODE
+                                                : index_of[pending.parent]);
+    storage->child_begins.push_back(child_begin);
+    child_begin += pending.children.size();
+    storage->attributes.push_back(
+        pending.mode | (uint64_t(pending.size) << ATTRIBUTE_SIZE_SHIFT));
+    if (pending.data == nullptr) {
+      storage->payloads.push_back(NO_PAYLOAD);
+    } else {
+      storage->payloads.push_back(storage->data.size());
+      storage->data.push_back(pending.data);
+    }
+  }
+  storage->child_begins.push_back(child_begin);
+  return NodeTable(std::move(storage));
 }
 
 namespace utils {
@@ -153,5 +299,28 @@ const ::path::RefSet RefSetFromPath(const path::Path &path) {
            });
   return ref_set;
 }
+
+Bindings SplitBindings(const std::string_view bindings) {
+  Bindings split;
+  size_t begin = 0;
+  while (begin <= bindings.size()) {
+    const size_t end = std::min(bindings.find(',', begin), bindings.size());
+    const std::string_view piece = bindings.substr(begin, end - begin);
+    const size_t colon = piece.find(':');
+    if (colon == piece.npos && !split.empty() &&
+        split.back().second.data() != nullptr) {
+      // Part of the value before: widened up to the end of `piece`.
+      const char *value = split.back().second.data();
+      split.back().second =
+          std::string_view(value, piece.data() + piece.size() - value);
+    } else if (colon == piece.npos) {
+      split.emplace_back(piece, std::string_view());
+    } else {
+      split.emplace_back(piece.substr(0, colon), piece.substr(colon + 1));
+    }
+    begin = end + 1;
+  }
+  return split;
+}
 } // namespace utils
 } // namespace path
@@ -3,12 +3,18 @@
 
 #include "logger.h"
 
+#include <cstdint>
 #include <filesystem>
 #include <functional>
+#include <limits>
+#include <map>
 #include <memory>
+#include <string>
+#include <string_view>
 #include <sys/stat.h>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 namespace path {
 using Path = std::filesystem::path;
@@ -25,59 +31,238 @@ using ReferenceSet = std::unordered_set<path::Ref>;
 using RefValueMap = std::unordered_map<path::Ref, Value>;
 using RefSet = ReferenceSet;
 
-} // namespace path
+typedef __mode_t NodeMode;
+
+// Attributes reported for a node. Ownership and times are the same for every
+// node, so they are not kept per node.
+struct stat MakeStat(const NodeMode mode, const size_t size, const ino_t ino);
+
+// A node before it is added to a NodeTable.
+struct NodeData final {
+  // Name of the node within its parent.
+  Path path;
+  NodeMode mode;
+  size_t size;
+  const void *data;
 
-namespace std {
-template <> struct hash<path::Path> {
-  std::size_t operator()(const path::Path &path) const {
-    return hash_value(path);
+  struct stat stat() const;
+  template <typename Data> const Data *data_as() const {
+    return static_cast<const Data *>(data);
   }
 };
-} // namespace std
 
-namespace path {
+NodeData SimpleFileNode(const path::Path &path, const void *data,
+                        const size_t data_size,
+                        const std::initializer_list<NodeMode> &modes);
+template <typename Data>
+NodeData SimpleFileNode(const path::Path &path, const Data *data,
+                        const std::initializer_list<NodeMode> &modes) {
+  return SimpleFileNode(path, data, sizeof *data, modes);
+}
+
+NodeData DirNode(const path::Path &key, const void *data);
+
+// Position of a node in its NodeTable.
+using NodeIndex = uint32_t;
+constexpr NodeIndex NO_NODE = std::numeric_limits<NodeIndex>::max();
+constexpr uint32_t NO_PAYLOAD = std::numeric_limits<uint32_t>::max();
+// Attributes pack the mode in the low bits and the size above it.
+constexpr int ATTRIBUTE_SIZE_SHIFT = 16;
+
+// The arrays of a NodeTable: node i has its fields at index i of every
+// per-node array. Nodes are laid out breadth first with siblings sorted by
+// name, so the children of node i are the nodes in
+// [child_begins[i], child_begins[i + 1]) and the root is node 0.
+struct NodeColumns final {
+  NodeIndex size;
+  const uint32_t *names; // Segment holding the name of each node.
+  const NodeIndex *parents;
+  const NodeIndex *child_begins; // size + 1 entries.
+  const uint64_t *attributes;
+  const uint32_t *payloads; // Index in `data`, or NO_PAYLOAD.
+  uint32_t data_size;
+  const void *const *data;
+  // Interned names: segment i spans [segment_offsets[i],
+  // segment_offsets[i + 1]) of `segment_chars`.
+  uint32_t segments;
+  const char *segment_chars;
+  const uint32_t *segment_offsets; // segments + 1 entries.
+};
+
+class Node;
+class NodeRange;
+
+// A tree of nodes stored as parallel arrays. The arrays are owned when the
+// table is built at runtime and borrowed when they are static.
+class NodeTable final {
+public:
+  // Borrows the arrays of `columns`, which must outlive the table.
+  explicit NodeTable(const NodeColumns &columns) : columns_(columns) {}
+  NodeTable(NodeTable &&) = default;
+  NodeTable(const NodeTable &) = delete;
+  NodeTable &operator=(const NodeTable &) = delete;
+
+  NodeIndex size() const { return columns_.size; }
+  Node root() const;
+  Node node(const NodeIndex index) const;
+
+  // Returns NO_NODE unless `path` is absolute and all of it exists.
+  NodeIndex Find(const Path &path) const;
+  // Returns NO_NODE when `parent` has no child called `name`.
+  NodeIndex FindChild(const NodeIndex parent, std::string_view name) const;
+  Path PathOf(NodeIndex index) const;
+
+  // Bytes taken by the arrays.
+  size_t memory_usage() const;
+
+  // The arrays themselves, as spec_compiler writes them out.
+  const NodeColumns &columns() const { return columns_; }
+
+private:
+  friend class Node;
+  friend class NodeTableBuilder;
+
+  struct Storage final {
+    std::vector<uint32_t> names;
+    std::vector<NodeIndex> parents;
+    std::vector<NodeIndex> child_begins;
+    std::vector<uint64_t> attributes;
+    std::vector<uint32_t> payloads;
+    std::vector<const void *> data;
+    std::string segment_chars;
+    std::vector<uint32_t> segment_offsets;
+  };
+
+  explicit NodeTable(std::unique_ptr<const Storage> storage);
+
+  std::string_view name(const NodeIndex index) const {
+    const uint32_t segment = columns_.names[index];
+    const uint32_t begin = columns_.segment_offsets[segment];
+    return std::string_view(columns_.segment_chars + begin,
+                            columns_.segment_offsets[segment + 1] - begin);
+  }
 
-struct DataImpl {
-  const Path path_;
-  const struct stat stat_;
-  const void *data_;
- // const size_t data_size_;
+  NodeColumns columns_;
+  std::unique_ptr<const Storage> storage_; // Null when borrowed.
 };
 
+// A node of a NodeTable, only valid while the table is. Cheap to copy.
 class Node final {
 public:
-  Node(const Node &node) : data_(node.data_), children_(node.children_) {}
-  Node(const DataImpl &data) : data_(data) {}
+  Node(const NodeTable *table, const NodeIndex index)
+      : table_(table), index_(index) {}
 
-  const Path &path() const { return data_.path_; }
+  NodeIndex index() const { return index_; }
+  std::string_view name() const { return table_->name(index_); }
+  // Name of the node within its parent, "/" for the root.
+  Path path() const { return Path(name()); }
 
-  const struct stat &stat() const { return data_.stat_; }
+  NodeMode mode() const {
+    return static_cast<NodeMode>(table_->columns_.attributes[index_] &
+                                 ((1 << ATTRIBUTE_SIZE_SHIFT) - 1));
+  }
+  size_t size() const {
+    return table_->columns_.attributes[index_] >> ATTRIBUTE_SIZE_SHIFT;
+  }
+  bool is_directory() const { return S_ISDIR(mode()); }
+
+  // Built on each call; the inode number is the position in the table.
+  struct stat stat() const { return MakeStat(mode(), size(), index_ + 1); }
 
   template <typename Data> const Data *data() const {
-    return static_cast<const Data *>(data_.data_);
+    const uint32_t payload = table_->columns_.payloads[index_];
+    return (payload == NO_PAYLOAD)
+               ? nullptr
+               : static_cast<const Data *>(table_->columns_.data[payload]);
   }
 
-  //const size_t data_size() { return data_.data_size_; }
-  std::vector<const path::Node *> *mutable_children() { return &children_; }
+  NodeRange children() const;
 
-  const std::vector<const path::Node *> &children() const { return children_; }
+private:
+  const NodeTable *table_;
+  NodeIndex index_;
+};
+
+// Consecutive nodes of a table, such as the children of a node.
+class NodeRange final {
+public:
+  class const_iterator final {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Node;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = Node;
+
+    const_iterator(const NodeTable *table, const NodeIndex index)
+        : table_(table), index_(index) {}
+    Node operator*() const { return Node(table_, index_); }
+    const_iterator &operator++() {
+      ++index_;
+      return *this;
+    }
+    bool operator==(const const_iterator &other) const {
+      return index_ == other.index_;
+    }
+    bool operator!=(const const_iterator &other) const {
+      return index_ != other.index_;
+    }
+
+  private:
+    const NodeTable *table_;
+    NodeIndex index_;
+  };
+
+  NodeRange(const NodeTable *table, const NodeIndex begin, const NodeIndex end)
+      : table_(table), begin_(begin), end_(end) {}
+
+  const_iterator begin() const { return const_iterator(table_, begin_); }
+  const_iterator end() const { return const_iterator(table_, end_); }
+  size_t size() const { return end_ - begin_; }
+  bool empty() const { return begin_ == end_; }
+  Node operator[](const size_t idx) const { return Node(table_, begin_ + idx); }
 
 private:
-  const DataImpl data_;
-  std::vector<const path::Node *> children_;
+  const NodeTable *table_;
+  NodeIndex begin_;
+  NodeIndex end_;
 };
 
-typedef __mode_t NodeMode;
-path::Node SimpleFileNode(const path::Path &path, const void *data,
-                          const size_t data_size,
-                          const std::initializer_list<NodeMode> &modes);
-template <typename Data>
-path::Node SimpleFileNode(const path::Path &path, const Data *data,
-                          const std::initializer_list<NodeMode> &modes) {
-  return SimpleFileNode(path, data, sizeof *data, modes);
+inline Node NodeTable::root() const { return Node(this, 0); }
+
+inline Node NodeTable::node(const NodeIndex index) const {
+  return Node(this, index);
+}
+
+inline NodeRange Node::children() const {
+  return NodeRange(table_, table_->columns_.child_begins[index_],
+                   table_->columns_.child_begins[index_ + 1]);
 }
 
-path::Node DirNode(const path::Path &key, const void *data);
+// Collects nodes in any order and lays them out as a NodeTable.
+class NodeTableBuilder final {
+public:
+  // Starts with the root directory.
+  NodeTableBuilder();
+
+  // Adds `data` at the absolute `path`, whose parent must have been added
+  // already. Returns false, leaving the tree unchanged, when `path` exists.
+  bool Insert(const Path &path, const NodeData &data);
+
+  NodeTable Build() const;
+
+private:
+  struct Pending final {
+    std::string name;
+    size_t parent;
+    NodeMode mode;
+    size_t size;
+    const void *data;
+    std::map<std::string, size_t> children;
+  };
+
+  std::vector<Pending> nodes_;
+};
 
 namespace utils {
 const std::vector<path::Path> all_prefixes(const path::Path &path);
@@ -106,6 +291,13 @@ const Binder ReferenceBinder = [](const Reference &ref,
 const path::Path PathToRefValueMap(const path::Path &pat,
                                    RefValueMap *ref_value_map = nullptr);
 const RefSet RefSetFromPath(const path::Path &path);
+
+// Splits the inside of a segment binding several references, "a:1,b:2" of
+// {a:1,b:2}.get.json, into references and values. References without a value
+// get an empty one. A comma followed by no ':' belongs to the value before it,
+// as in {id:1,2}.
+using Bindings = std::vector<std::pair<std::string_view, std::string_view>>;
+Bindings SplitBindings(const std::string_view bindings);
 const path::Path BindRefs(const path::Path &path, Binder binder);
 
 } // namespace utils
@@ -1,6 +1,29 @@
 #include "path.h"
 
+static void TestNodeTable() {
+  path::NodeTableBuilder builder;
+  CHECK(builder.Insert("/b", path::DirNode("b", nullptr)));
+  CHECK(builder.Insert("/a", path::DirNode("a", nullptr)));
+  CHECK(builder.Insert(
+      "/b/get.json", path::SimpleFileNode("get.json", nullptr, 42, {S_IREAD})));
+  CHECK(!builder.Insert("/b", path::DirNode("b", nullptr)));
+  const path::NodeTable table = builder.Build();
+
+  CHECK(table.size() == 4);
+  const path::NodeRange children = table.root().children();
+  CHECK(children.size() == 2);
+  CHECK(children[0].name() == "a" && children[1].name() == "b");
+  const path::NodeIndex file = table.Find("/b/get.json");
+  CHECK(file != path::NO_NODE);
+  CHECK(table.PathOf(file) == "/b/get.json");
+  CHECK(table.node(file).size() == 42);
+  CHECK(table.node(file).stat().st_mode == (S_IFREG | S_IREAD));
+  CHECK(table.Find("/a/get.json") == path::NO_NODE);
+  CHECK(table.Find("/") == 0);
+}
+
 int main(int argc, char *argv[]) {
+  TestNodeTable();
   const path::Path path = "/root/ademirao/{}/{:32}/{ref}/{ref:}/{ref:32}/daniela/{ref2:33}/"
                     "{ref3}get.json";
   const path::Path canonical =
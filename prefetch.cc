@@ -0,0 +1,264 @@
+#include "prefetch.h"
+#include "logger.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <unordered_set>
+
+namespace prefetch {
+
+// Larger responses are not worth parsing for links.
+constexpr size_t MAX_BODY_BYTES = 4 << 20;
+// Prefetches after which the links followed per response are adjusted.
+constexpr size_t WINDOW = 32;
+// Prefetched URLs remembered until read, oldest dropped first.
+constexpr size_t MAX_PREFETCHED = 4096;
+constexpr size_t MAX_VALUE_LENGTH = 128;
+
+// Values that can stand for a path segment as they are: unreserved URL
+// characters only.
+static bool IsLinkValue(const std::string &value) {
+  if (value.empty() || value.size() > MAX_VALUE_LENGTH || value == "." ||
+      value == "..") {
+    return false;
+  }
+  return std::all_of(value.begin(), value.end(), [](const char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' ||
+           c == '~';
+  });
+}
+
+Prefetcher::Prefetcher(const Options &options, scheduler::Scheduler *scheduler,
+                       cache::ResponseCache *cache)
+    : options_(options), scheduler_(scheduler), cache_(cache),
+      stopped_(false), running_(0), links_(options.max_links),
+      window_prefetches_(0), window_hits_(0), prefetches_(0), hits_(0),
+      dropped_(0), failures_(0) {
+  if (!enabled()) {
+    return;
+  }
+  for (size_t idx = 0; idx < std::max<size_t>(options_.parallelism, 1);
+       ++idx) {
+    threads_.emplace_back(&Prefetcher::Run, this);
+  }
+}
+
+Prefetcher::~Prefetcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+  }
+  cv_.notify_all();
+  for (std::thread &thread : threads_) {
+    thread.join();
+  }
+}
+
+void Prefetcher::Follow(std::shared_ptr<const cache::Entry> entry,
+                        const http::Headers *headers, Resolve resolve) {
+  if (!enabled() || entry->body.size() > MAX_BODY_BYTES) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Links of older responses are less likely to be read next.
+    if (responses_.size() >= threads_.size()) {
+      responses_.pop_front();
+    }
+    responses_.push_back({std::move(entry), headers, std::move(resolve)});
+  }
+  cv_.notify_one();
+}
+
+void Prefetcher::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this]() {
+      return stopped_ || !responses_.empty() || !queue_.empty();
+    });
+    if (stopped_) {
+      return;
+    }
+    if (!responses_.empty()) {
+      const Response response = std::move(responses_.front());
+      responses_.pop_front();
+      lock.unlock();
+      Find(response);
+    } else {
+      const Pending pending = std::move(queue_.front());
+      queue_.pop_front();
+      ++running_;
+      lock.unlock();
+      Fetch(pending);
+    }
+    lock.lock();
+  }
+}
+
+void Prefetcher::Find(const Response &response) {
+  const trace::Span span("prefetch_links");
+  const std::string_view body = response.entry->body.view();
+  Json::Value value;
+  Json::CharReaderBuilder builder;
+  const std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+  if (!reader->parse(body.data(), body.data() + body.size(), &value,
+                     nullptr)) {
+    return;
+  }
+  size_t links;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    links = links_;
+  }
+  std::vector<Pending> found;
+  std::unordered_set<std::string> seen;
+  // Members in document order, which is usually the order they are read in.
+  std::vector<const Json::Value *> stack = {&value};
+  while (!stack.empty() && found.size() < links) {
+    const Json::Value *current = stack.back();
+    stack.pop_back();
+    if (current->isArray()) {
+      for (Json::ArrayIndex idx = current->size(); idx > 0; --idx) {
+        stack.push_back(&(*current)[idx - 1]);
+      }
+      continue;
+    }
+    if (!current->isObject()) {
+      continue;
+    }
+    const std::vector<std::string> keys = current->getMemberNames();
+    for (auto key = keys.rbegin(); key != keys.rend(); ++key) {
+      const Json::Value &member = (*current)[*key];
+      if (member.isArray() || member.isObject()) {
+        stack.push_back(&member);
+        continue;
+      }
+      if (!member.isString() && !member.isIntegral()) {
+        continue;
+      }
+      const std::string member_value = member.asString();
+      if (!IsLinkValue(member_value) ||
+          !seen.insert(*key + '\0' + member_value).second) {
+        continue;
+      }
+      for (Link &link : response.resolve(*key, member_value)) {
+        std::string link_key = http::NormalizeUrl(link.url);
+        if (found.size() < links && !cache_->Contains(link_key)) {
+          found.push_back(
+              {std::move(link), std::move(link_key), response.headers});
+        }
+      }
+    }
+  }
+
+  size_t queued = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (Pending &pending : found) {
+      if (prefetched_urls_.count(pending.key) > 0) {
+        continue;
+      }
+      if (queue_.size() + running_ >= options_.budget) {
+        ++dropped_;
+        continue;
+      }
+      Remember(pending.key);
+      queue_.push_back(std::move(pending));
+      ++queued;
+    }
+  }
+  if (queued > 0) {
+    cv_.notify_all();
+  }
+}
+
+void Prefetcher::Fetch(const Pending &pending) {
+  const trace::Span span("prefetch", pending.link.url);
+  http::Request request(rest::constants::GET, *pending.headers);
+  request.set_cancelled(&stopped_);
+  const http::Response response =
+      scheduler_->Fetch(scheduler::PREFETCH, pending.link.endpoint, request,
+                        pending.link.url);
+  const bool fetched =
+      response.curl_code == CURLE_OK && response.http_code == 200;
+  if (fetched) {
+    const auto etag_it = response.headers.find("etag");
+    cache_->Insert(pending.key, response.http_code, response.data.str(),
+                   (etag_it == response.headers.end()) ? "" : etag_it->second);
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  --running_;
+  if (!fetched) {
+    ++failures_;
+    const auto it = prefetched_urls_.find(pending.key);
+    if (it != prefetched_urls_.end()) {
+      prefetched_.erase(it->second);
+      prefetched_urls_.erase(it);
+    }
+    return;
+  }
+  ++prefetches_;
+  ++window_prefetches_;
+  Adjust();
+}
+
+void Prefetcher::Used(const std::string &key) {
+  if (!enabled()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = prefetched_urls_.find(key);
+  if (it == prefetched_urls_.end()) {
+    return;
+  }
+  prefetched_.erase(it->second);
+  prefetched_urls_.erase(it);
+  ++hits_;
+  ++window_hits_;
+}
+
+void Prefetcher::Remember(const std::string &url) {
+  while (prefetched_.size() >= MAX_PREFETCHED) {
+    prefetched_urls_.erase(prefetched_.front());
+    prefetched_.pop_front();
+  }
+  prefetched_.push_back(url);
+  prefetched_urls_.emplace(url, std::prev(prefetched_.end()));
+}
+
+void Prefetcher::Adjust() {
+  if (window_prefetches_ < WINDOW) {
+    return;
+  }
+  const double hit_rate = double(window_hits_) / window_prefetches_;
+  const size_t links = (hit_rate < options_.min_hit_rate)
+                           ? std::max<size_t>(links_ / 2, 1)
+                           : std::min(links_ + 1, options_.max_links);
+  if (links != links_) {
+    LOG(INFO) << "Following " << links << " links per response, hit rate "
+              << hit_rate;
+  }
+  links_ = links;
+  window_prefetches_ = 0;
+  window_hits_ = 0;
+}
+
+Json::Value Prefetcher::Metrics() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Json::Value metrics;
+  metrics["max_links"] = Json::UInt64(options_.max_links);
+  metrics["links"] = Json::UInt64(links_);
+  metrics["budget"] = Json::UInt64(options_.budget);
+  metrics["queued"] = Json::UInt64(queue_.size());
+  metrics["running"] = Json::UInt64(running_);
+  metrics["prefetches"] = Json::UInt64(prefetches_);
+  metrics["hits"] = Json::UInt64(hits_);
+  metrics["hit_rate"] =
+      (prefetches_ == 0) ? 0.0 : double(hits_) / double(prefetches_);
+  metrics["dropped"] = Json::UInt64(dropped_);
+  metrics["failures"] = Json::UInt64(failures_);
+  return metrics;
+}
+
+} // namespace prefetch
@@ -0,0 +1,133 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include "cache.h"
+#include "http.h"
+#include "scheduler.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <json/json.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Warms the cache with the resources a response links to, before they are
+// read.
+//
+// After reading a list, users usually read the details of the items in it.
+// Members of a response named after a path parameter of the spec, such as
+// "soid", hold the values that address those details: the prefetcher fetches
+// them in the background at PREFETCH priority and keeps them in the response
+// cache.
+//
+// Prefetching is bounded by a budget of requests queued or in flight, and
+// turned down when it does not pay off: the links followed per response are
+// halved whenever fewer prefetched responses than the minimum hit rate are
+// read from the cache, and grow back one at a time while they are.
+namespace prefetch {
+
+struct Options final {
+  // Links followed at most per response. 0 disables prefetching.
+  size_t max_links;
+  // Prefetches queued or in flight at most. Links past it are dropped.
+  size_t budget;
+  // Threads prefetching, and prefetches sent at once.
+  size_t parallelism;
+  // Fraction of the prefetched responses that must be read for the links
+  // followed per response to grow.
+  double min_hit_rate;
+};
+
+// A resource to prefetch.
+struct Link final {
+  std::string url;
+  // Endpoint of `url` for the scheduler.
+  std::string endpoint;
+};
+
+// Returns the links that a member `key` holding `value` makes, usually none.
+// Called from the threads of the prefetcher.
+using Resolve = std::function<std::vector<Link>(const std::string &key,
+                                                const std::string &value)>;
+
+class Prefetcher final {
+public:
+  Prefetcher(const Options &options, scheduler::Scheduler *scheduler,
+             cache::ResponseCache *cache);
+  Prefetcher(const Prefetcher &) = delete;
+  Prefetcher &operator=(const Prefetcher &) = delete;
+  // Drops what is left to do and cancels the prefetches in flight.
+  ~Prefetcher();
+
+  bool enabled() const { return options_.max_links > 0; }
+
+  // Looks for links in `entry`, a JSON response just read, in the background
+  // and prefetches the resources they lead to, which are not cached yet, with
+  // `headers`. `headers` must outlive the prefetcher.
+  void Follow(std::shared_ptr<const cache::Entry> entry,
+              const http::Headers *headers, Resolve resolve);
+
+  // Records that the response keyed `key` (see http::NormalizeUrl) was read
+  // from the cache, which counts as a hit when it was prefetched.
+  void Used(const std::string &key);
+
+  Json::Value Metrics() const;
+
+private:
+  // A response to look for links in.
+  struct Response final {
+    std::shared_ptr<const cache::Entry> entry;
+    const http::Headers *headers;
+    Resolve resolve;
+  };
+  struct Pending final {
+    Link link;
+    // http::NormalizeUrl of the URL of `link`, which the cache is keyed by.
+    std::string key;
+    const http::Headers *headers;
+  };
+  using Prefetched = std::list<std::string>;
+
+  void Run();
+  void Find(const Response &response);
+  void Fetch(const Pending &pending);
+  // Must hold `mutex_`.
+  void Remember(const std::string &url);
+  void Adjust();
+
+  const Options options_;
+  scheduler::Scheduler *const scheduler_;
+  cache::ResponseCache *const cache_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::atomic<bool> stopped_;
+  // Newest last. The oldest are dropped once there are more than threads.
+  std::deque<Response> responses_;
+  std::deque<Pending> queue_;
+  size_t running_;
+  // Links followed per response for now, within [1, max_links].
+  size_t links_;
+  // Keys of the URLs prefetched and not read yet, oldest first.
+  Prefetched prefetched_;
+  std::unordered_map<std::string, Prefetched::iterator> prefetched_urls_;
+  // Prefetches and hits since `links_` last changed.
+  size_t window_prefetches_;
+  size_t window_hits_;
+  size_t prefetches_;
+  size_t hits_;
+  size_t dropped_;
+  size_t failures_;
+  std::vector<std::thread> threads_;
+};
+
+} // namespace prefetch
+
+#endif
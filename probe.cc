@@ -0,0 +1,161 @@
+#include "probe.h"
+#include "logger.h"
+
+namespace probe {
+
+// Probes queued at most. Those past it are dropped, and queued again when
+// their files are looked up.
+constexpr size_t MAX_QUEUED = 4096;
+
+SizeProber::SizeProber(const size_t max_entries, const size_t parallelism,
+                       scheduler::Scheduler *scheduler)
+    : max_entries_(max_entries), scheduler_(scheduler), stopped_(false),
+      learned_(0), probes_(0), unknown_(0), dropped_(0) {
+  if (max_entries_ == 0) {
+    return;
+  }
+  for (size_t idx = 0; idx < std::max<size_t>(parallelism, 1); ++idx) {
+    threads_.emplace_back(&SizeProber::Run, this);
+  }
+}
+
+SizeProber::~SizeProber() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+  }
+  cv_.notify_all();
+  for (std::thread &thread : threads_) {
+    thread.join();
+  }
+}
+
+SizeProber::Entry &SizeProber::Touch(const std::string &url,
+                                     const State state) {
+  const auto it = entries_.find(url);
+  if (it != entries_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->second;
+  }
+  while (!lru_.empty() && lru_.size() >= std::max<size_t>(max_entries_, 1)) {
+    entries_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+  lru_.emplace_front(url, Entry{state, 0});
+  entries_.emplace(url, lru_.begin());
+  return lru_.front().second;
+}
+
+std::optional<size_t> SizeProber::Find(const std::string &url) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = entries_.find(url);
+  if (it == entries_.end() || it->second->second.state != KNOWN) {
+    return std::nullopt;
+  }
+  lru_.splice(lru_.begin(), lru_, it->second);
+  return it->second->second.size;
+}
+
+bool SizeProber::Learn(const std::string &url, const size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Entry &entry = Touch(url, KNOWN);
+  const bool changed = entry.state != KNOWN || entry.size != size;
+  entry = {KNOWN, size};
+  learned_ += changed;
+  return changed;
+}
+
+void SizeProber::Forget(const std::string &url) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = entries_.find(url);
+  if (it != entries_.end()) {
+    lru_.erase(it->second);
+    entries_.erase(it);
+  }
+}
+
+void SizeProber::Probe(const std::string &url, const std::string &key,
+                       const std::string &endpoint,
+                       const http::Headers *headers, Learned learned) {
+  if (max_entries_ == 0) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (entries_.count(key) > 0) {
+      return;
+    }
+    if (queue_.size() >= MAX_QUEUED) {
+      ++dropped_;
+      return;
+    }
+    Touch(key, PROBING);
+    ++probes_;
+    queue_.push_back({url, key, endpoint, headers, std::move(learned)});
+  }
+  cv_.notify_one();
+}
+
+void SizeProber::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this]() { return stopped_ || !queue_.empty(); });
+    if (stopped_) {
+      return;
+    }
+    const Pending pending = std::move(queue_.front());
+    queue_.pop_front();
+    lock.unlock();
+    Send(pending);
+    lock.lock();
+  }
+}
+
+void SizeProber::Send(const Pending &pending) {
+  http::Request request(rest::constants::HEAD, *pending.headers);
+  request.set_cancelled(&stopped_);
+  const http::Response response = scheduler_->Fetch(
+      scheduler::PREFETCH, pending.endpoint, request, pending.url);
+  const auto length_it = response.headers.find("content-length");
+  std::optional<size_t> size;
+  if (response.http_code == 200 && length_it != response.headers.end()) {
+    char *end = nullptr;
+    const unsigned long long length =
+        std::strtoull(length_it->second.c_str(), &end, 10);
+    if (end != length_it->second.c_str() && *end == '\0') {
+      size = length;
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry &entry = Touch(pending.key, UNKNOWN);
+    if (entry.state == KNOWN) { // Read meanwhile.
+      return;
+    }
+    if (!size.has_value()) {
+      entry.state = UNKNOWN;
+      ++unknown_;
+      return;
+    }
+    entry = {KNOWN, *size};
+    ++learned_;
+  }
+  if (pending.learned) {
+    pending.learned();
+  }
+}
+
+Json::Value SizeProber::Metrics() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Json::Value metrics;
+  metrics["max_entries"] = Json::UInt64(max_entries_);
+  metrics["entries"] = Json::UInt64(entries_.size());
+  metrics["probes"] = Json::UInt64(probes_);
+  metrics["queued"] = Json::UInt64(queue_.size());
+  metrics["learned"] = Json::UInt64(learned_);
+  metrics["unknown"] = Json::UInt64(unknown_);
+  metrics["dropped"] = Json::UInt64(dropped_);
+  return metrics;
+}
+
+} // namespace probe
@@ -0,0 +1,102 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include "http.h"
+#include "scheduler.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <json/json.h>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace probe {
+
+// Sizes of GET responses by URL, keyed as normalized by http::NormalizeUrl,
+// so operation files report the size they will
+// read. Sizes are learned from the responses read through the file system and
+// from HEAD requests sent in the background for files nobody read yet.
+//
+// Probes are sent by threads of their own, up to `parallelism` at once and at
+// PREFETCH priority, so that listing a directory of a thousand resources
+// probes them all in a few round trips without taking the workers.
+class SizeProber final {
+public:
+  // Runs on a thread of the prober once the size of a probed URL is known.
+  using Learned = std::function<void()>;
+
+  // Remembers up to `max_entries` URLs, least recently used first out. Zero
+  // disables probing; sizes are then only learned from reads.
+  SizeProber(const size_t max_entries, const size_t parallelism,
+             scheduler::Scheduler *scheduler);
+  SizeProber(const SizeProber &) = delete;
+  SizeProber &operator=(const SizeProber &) = delete;
+  // Drops the probes not sent yet and cancels those in flight.
+  ~SizeProber();
+
+  // Returns std::nullopt when the size of `url` is not known yet.
+  std::optional<size_t> Find(const std::string &url);
+
+  // Records the size of a response read from `url`. Returns whether it
+  // differs from the size known before.
+  bool Learn(const std::string &url, const size_t size);
+  // Forgets the size of `url`, such as after a write changed it.
+  void Forget(const std::string &url);
+
+  // Queues a HEAD request for `url`, whose key is `key`, with `headers`,
+  // which must outlive the prober, unless it was probed before or too many
+  // probes are queued already. Responses without a Content-Length leave the
+  // size unknown until the file is read. `learned` may be empty.
+  void Probe(const std::string &url, const std::string &key,
+             const std::string &endpoint, const http::Headers *headers,
+             Learned learned);
+
+  Json::Value Metrics() const;
+
+private:
+  enum State { PROBING, KNOWN, UNKNOWN };
+  struct Entry final {
+    State state;
+    size_t size;
+  };
+  using Lru = std::list<std::pair<std::string, Entry>>;
+  struct Pending final {
+    std::string url;
+    std::string key;
+    std::string endpoint;
+    const http::Headers *headers;
+    Learned learned;
+  };
+
+  void Run();
+  void Send(const Pending &pending);
+
+  // Returns the entry of `url`, creating it in `state` when missing.
+  Entry &Touch(const std::string &url, const State state);
+
+  const size_t max_entries_;
+  scheduler::Scheduler *const scheduler_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::atomic<bool> stopped_;
+  std::deque<Pending> queue_;
+  Lru lru_; // Most recently used first.
+  std::unordered_map<std::string, Lru::iterator> entries_;
+  size_t learned_;
+  size_t probes_;
+  size_t unknown_;
+  size_t dropped_;
+  std::vector<std::thread> threads_;
+};
+
+} // namespace probe
+
+#endif
@@ -0,0 +1,406 @@
+#include "projection.h"
+
+#include <cstdlib>
+
+namespace projection {
+
+std::string EscapeToken(const std::string_view key) {
+  std::string token;
+  token.reserve(key.size());
+  for (const char c : key) {
+    if (c == '~') {
+      token += "~0";
+    } else if (c == '/') {
+      token += "~1";
+    } else {
+      token.push_back(c);
+    }
+  }
+  return token;
+}
+
+std::string UnescapeToken(const std::string_view token) {
+  std::string key;
+  key.reserve(token.size());
+  for (size_t idx = 0; idx < token.size(); ++idx) {
+    if (token[idx] == '~' && idx + 1 < token.size() &&
+        (token[idx + 1] == '0' || token[idx + 1] == '1')) {
+      key.push_back(token[++idx] == '0' ? '~' : '/');
+    } else {
+      key.push_back(token[idx]);
+    }
+  }
+  return key;
+}
+
+static bool IsSpace(const char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Characters of numbers, true, false and null.
+static bool IsLiteral(const char c) {
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c == '-' ||
+         c == '+' || c == '.' || c == 'E';
+}
+
+static void AppendUtf8(const uint32_t code, std::string *out) {
+  if (code < 0x80) {
+    out->push_back(char(code));
+  } else if (code < 0x800) {
+    out->push_back(char(0xC0 | (code >> 6)));
+    out->push_back(char(0x80 | (code & 0x3F)));
+  } else if (code < 0x10000) {
+    out->push_back(char(0xE0 | (code >> 12)));
+    out->push_back(char(0x80 | ((code >> 6) & 0x3F)));
+    out->push_back(char(0x80 | (code & 0x3F)));
+  } else {
+    out->push_back(char(0xF0 | (code >> 18)));
+    out->push_back(char(0x80 | ((code >> 12) & 0x3F)));
+    out->push_back(char(0x80 | ((code >> 6) & 0x3F)));
+    out->push_back(char(0x80 | (code & 0x3F)));
+  }
+}
+
+// The four hex digits at `pos` of `raw`, or -1.
+static int64_t HexAt(const std::string_view raw, const size_t pos) {
+  if (pos + 4 > raw.size()) {
+    return -1;
+  }
+  const std::string digits(raw.substr(pos, 4));
+  char *end = nullptr;
+  const int64_t code = std::strtol(digits.c_str(), &end, 16);
+  return (end == digits.c_str() + 4) ? code : -1;
+}
+
+// Decodes the contents of a JSON string, between its quotes.
+static std::string Unquote(const std::string_view raw) {
+  std::string out;
+  for (size_t idx = 0; idx < raw.size(); ++idx) {
+    if (raw[idx] != '\\' || idx + 1 == raw.size()) {
+      out.push_back(raw[idx]);
+      continue;
+    }
+    const char c = raw[++idx];
+    switch (c) {
+    case 'b':
+      out.push_back('\b');
+      break;
+    case 'f':
+      out.push_back('\f');
+      break;
+    case 'n':
+      out.push_back('\n');
+      break;
+    case 'r':
+      out.push_back('\r');
+      break;
+    case 't':
+      out.push_back('\t');
+      break;
+    case 'u': {
+      int64_t code = HexAt(raw, idx + 1);
+      if (code < 0) {
+        out.push_back(c);
+        break;
+      }
+      idx += 4;
+      // Characters past the BMP come as surrogate pairs.
+      if (code >= 0xD800 && code < 0xDC00 &&
+          raw.substr(idx + 1, 2) == "\\u") {
+        const int64_t low = HexAt(raw, idx + 3);
+        if (low >= 0xDC00 && low < 0xE000) {
+          code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+          idx += 6;
+        }
+      }
+      AppendUtf8(uint32_t(code), &out);
+      break;
+    }
+    default: // Quotes, backslashes and slashes.
+      out.push_back(c);
+    }
+  }
+  return out;
+}
+
+// The array index `token` stands for, if any: digits without leading zeros.
+static std::optional<size_t> IndexOf(const std::string &token) {
+  if (token.empty() || token.size() > 18 ||
+      token.find_first_not_of("0123456789") != token.npos ||
+      (token[0] == '0' && token.size() > 1)) {
+    return std::nullopt;
+  }
+  return std::stoull(token);
+}
+
+Extractor::Extractor(std::vector<std::string> pointer)
+    : pointer_(std::move(pointer)), status_(MORE), state_(VALUE),
+      in_key_(false), escaped_(false), collect_key_(false),
+      scalar_on_path_(false), capturing_(false), capture_depth_(0) {
+  for (const std::string &token : pointer_) {
+    indexes_.push_back(IndexOf(token));
+  }
+}
+
+bool Extractor::ChildOnPath() const {
+  const Frame &frame = stack_.back();
+  if (!frame.on_path) {
+    return false;
+  }
+  if (frame.object) {
+    return frame.key_matches;
+  }
+  const std::optional<size_t> &index = indexes_[stack_.size() - 1];
+  return index.has_value() && *index == frame.index;
+}
+
+bool Extractor::StartValue(const char c) {
+  const size_t depth = stack_.size();
+  const bool on_path = stack_.empty() || ChildOnPath();
+  if (on_path && depth == pointer_.size()) {
+    capturing_ = true;
+    capture_depth_ = depth;
+  }
+  if (c == '{' || c == '[') {
+    stack_.push_back({c == '{', on_path && depth < pointer_.size(), true, 0,
+                      false});
+    state_ = (c == '{') ? KEY : VALUE;
+    return true;
+  }
+  scalar_on_path_ = on_path && depth < pointer_.size();
+  if (c == '"') {
+    state_ = STRING;
+    in_key_ = false;
+    escaped_ = false;
+    return true;
+  }
+  state_ = LITERAL;
+  return IsLiteral(c);
+}
+
+void Extractor::EndValue(const bool on_path) {
+  if (capturing_ && stack_.size() == capture_depth_) {
+    status_ = FOUND;
+    return;
+  }
+  // The pointer went through the value, and did not find its end there.
+  if (on_path) {
+    status_ = MISSING;
+    return;
+  }
+  state_ = stack_.empty() ? DONE : AFTER_VALUE;
+}
+
+Status Extractor::Feed(const std::string_view chunk) {
+  // Start of the part of `chunk` that belongs to the value.
+  size_t from = 0;
+  for (size_t idx = 0; idx < chunk.size() && status_ == MORE; ++idx) {
+    const char c = chunk[idx];
+    const bool was_capturing = capturing_;
+    // End of the part of `chunk` that belongs to the value, once FOUND.
+    size_t end = idx + 1;
+    switch (state_) {
+    case VALUE:
+      if (IsSpace(c)) {
+        break;
+      }
+      if (c == ']' && !stack_.empty() && !stack_.back().object &&
+          stack_.back().empty) {
+        const bool on_path = stack_.back().on_path;
+        stack_.pop_back();
+        EndValue(on_path);
+        break;
+      }
+      if (!stack_.empty()) {
+        stack_.back().empty = false;
+      }
+      if (!StartValue(c)) {
+        status_ = INVALID;
+      }
+      break;
+    case AFTER_VALUE: {
+      if (IsSpace(c)) {
+        break;
+      }
+      Frame &frame = stack_.back();
+      if (c == ',') {
+        if (frame.object) {
+          state_ = KEY;
+          break;
+        }
+        ++frame.index;
+        state_ = VALUE;
+        // Indexes only grow: the pointer may be past the array already.
+        if (frame.on_path) {
+          const std::optional<size_t> &index = indexes_[stack_.size() - 1];
+          if (!index.has_value() || *index < frame.index) {
+            status_ = MISSING;
+          }
+        }
+      } else if (c == (frame.object ? '}' : ']')) {
+        const bool on_path = frame.on_path;
+        stack_.pop_back();
+        EndValue(on_path);
+      } else {
+        status_ = INVALID;
+      }
+      break;
+    }
+    case KEY:
+      if (IsSpace(c)) {
+        break;
+      }
+      if (c == '"') {
+        stack_.back().empty = false;
+        state_ = STRING;
+        in_key_ = true;
+        escaped_ = false;
+        key_.clear();
+        collect_key_ = stack_.back().on_path;
+      } else if (c == '}' && stack_.back().empty) {
+        const bool on_path = stack_.back().on_path;
+        stack_.pop_back();
+        EndValue(on_path);
+      } else {
+        status_ = INVALID;
+      }
+      break;
+    case COLON:
+      if (c == ':') {
+        state_ = VALUE;
+      } else if (!IsSpace(c)) {
+        status_ = INVALID;
+      }
+      break;
+    case STRING:
+      if (escaped_) {
+        escaped_ = false;
+      } else if (c == '\\') {
+        escaped_ = true;
+      } else if (c == '"') {
+        if (!in_key_) {
+          EndValue(scalar_on_path_);
+          break;
+        }
+        Frame &frame = stack_.back();
+        frame.key_matches = false;
+        if (collect_key_) {
+          const std::string &token = pointer_[stack_.size() - 1];
+          frame.key_matches = (key_.find('\\') == key_.npos)
+                                  ? key_ == token
+                                  : Unquote(key_) == token;
+        }
+        state_ = COLON;
+        break;
+      }
+      if (in_key_ && collect_key_) {
+        key_.push_back(c);
+      }
+      break;
+    case LITERAL:
+      if (IsLiteral(c)) {
+        break;
+      }
+      end = idx;
+      EndValue(scalar_on_path_);
+      if (status_ == MORE) {
+        --idx; // Read `c` again after the value.
+      }
+      break;
+    case DONE:
+      if (!IsSpace(c)) {
+        status_ = INVALID;
+      }
+      break;
+    }
+    if (capturing_ && !was_capturing) {
+      from = idx;
+    }
+    if (status_ == FOUND) {
+      value_.append(chunk.substr(from, end - from));
+      return status_;
+    }
+  }
+  if (capturing_ && status_ == MORE) {
+    value_.append(chunk.substr(from));
+  }
+  return status_;
+}
+
+Status Extractor::Finish() {
+  // A number at the root ends with the document.
+  if (status_ == MORE && state_ == LITERAL && stack_.empty()) {
+    EndValue(scalar_on_path_);
+  }
+  if (status_ == MORE) {
+    status_ = INVALID;
+  }
+  return status_;
+}
+
+std::shared_ptr<const std::string> PrefixCache::Find(const std::string &url) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = entries_.find(url);
+  if (it == entries_.end()) {
+    ++misses_;
+    return nullptr;
+  }
+  if (it->second->second.expires <= Clock::now()) {
+    Erase(it->second);
+    ++misses_;
+    return nullptr;
+  }
+  lru_.splice(lru_.begin(), lru_, it->second);
+  ++hits_;
+  return it->second->second.prefix;
+}
+
+void PrefixCache::Insert(const std::string &url, std::string prefix) {
+  const size_t cost = url.size() + prefix.size();
+  if (ttl_.count() == 0 || cost > max_bytes_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = entries_.find(url);
+  if (it != entries_.end()) {
+    if (it->second->second.prefix->size() >= prefix.size()) {
+      return;
+    }
+    Erase(it->second);
+  }
+  while (bytes_ + cost > max_bytes_) {
+    Erase(std::prev(lru_.end()));
+  }
+  lru_.emplace_front(
+      url, Entry{std::make_shared<const std::string>(std::move(prefix)),
+                 Clock::now() + ttl_});
+  entries_.emplace(url, lru_.begin());
+  bytes_ += cost;
+}
+
+void PrefixCache::Remove(const std::string &url) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = entries_.find(url);
+  if (it != entries_.end()) {
+    Erase(it->second);
+  }
+}
+
+void PrefixCache::Erase(const Lru::iterator it) {
+  bytes_ -= it->first.size() + it->second.prefix->size();
+  entries_.erase(it->first);
+  lru_.erase(it);
+}
+
+Json::Value PrefixCache::Metrics() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Json::Value metrics;
+  metrics["max_bytes"] = Json::UInt64(max_bytes_);
+  metrics["bytes"] = Json::UInt64(bytes_);
+  metrics["entries"] = Json::UInt64(entries_.size());
+  metrics["hits"] = Json::UInt64(hits_);
+  metrics["misses"] = Json::UInt64(misses_);
+  return metrics;
+}
+
+} // namespace projection
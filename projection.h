@@ -0,0 +1,139 @@
+#ifndef PROJECTION_H
+#define PROJECTION_H
+
+#include <chrono>
+#include <json/json.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Projections read one value out of a JSON response, addressed by a JSON
+// pointer (RFC 6901) whose tokens are path segments: get.json.d/items/0/name
+// is the value at /items/0/name of get.json. The response is scanned as it
+// arrives, and the scan stops as soon as the value is complete, without
+// building the document.
+namespace projection {
+
+enum Status {
+  MORE,    // The value may still come.
+  FOUND,   // The value is complete.
+  MISSING, // The document has no value at the pointer.
+  INVALID, // The document is not JSON, or ended early.
+};
+
+// Keys may contain '/' and so can't be file names as they are: they are
+// escaped as pointer tokens, ~ as ~0 and / as ~1.
+std::string EscapeToken(const std::string_view key);
+std::string UnescapeToken(const std::string_view token);
+
+// Scans a document fed in chunks for the value at a pointer.
+class Extractor final {
+public:
+  // `pointer` holds the unescaped tokens. An empty pointer is the whole
+  // document.
+  explicit Extractor(std::vector<std::string> pointer);
+
+  // Scans `chunk`, which follows the previous ones. Chunks after the status
+  // is no longer MORE are ignored.
+  Status Feed(const std::string_view chunk);
+  // Tells that the document ended. Returns the final status.
+  Status Finish();
+
+  Status status() const { return status_; }
+  // The JSON text of the value, once FOUND.
+  const std::string &value() const { return value_; }
+
+private:
+  enum State {
+    VALUE,       // Before a value.
+    AFTER_VALUE, // Before ',' or the end of the container.
+    KEY,         // Before a key.
+    COLON,       // Between a key and its value.
+    STRING,      // Within a string, key or value.
+    LITERAL,     // Within a number, true, false or null.
+    DONE,        // After the document.
+  };
+  struct Frame final {
+    bool object;
+    // Whether the pointer goes through the container.
+    bool on_path;
+    bool empty;
+    size_t index;
+    // Whether the current key is the next token of the pointer.
+    bool key_matches;
+  };
+
+  // Handles the start of a value at `c`. Returns false when it is not JSON.
+  bool StartValue(const char c);
+  // Handles the end of the current value, the container just closed or the
+  // scalar just read.
+  void EndValue(const bool on_path);
+  bool ChildOnPath() const;
+
+  const std::vector<std::string> pointer_;
+  // Tokens of `pointer_` that are array indexes, as numbers.
+  std::vector<std::optional<size_t>> indexes_;
+
+  Status status_;
+  State state_;
+  std::vector<Frame> stack_;
+  bool in_key_;
+  bool escaped_;
+  // The raw key being read, when its object is on the path.
+  std::string key_;
+  bool collect_key_;
+  // Whether the scalar being read is on the path.
+  bool scalar_on_path_;
+  bool capturing_;
+  // Depth of the value being captured.
+  size_t capture_depth_;
+  std::string value_;
+};
+
+// Beginnings of responses whose transfer was stopped once a value was
+// complete. Looking up the values below it, as the kernel does one path
+// segment at a time, then needs no other request.
+class PrefixCache final {
+public:
+  // A zero `ttl` disables the cache.
+  PrefixCache(const size_t max_bytes, const std::chrono::seconds ttl)
+      : max_bytes_(max_bytes), ttl_(ttl), bytes_(0), hits_(0), misses_(0) {}
+  PrefixCache(const PrefixCache &) = delete;
+  PrefixCache &operator=(const PrefixCache &) = delete;
+
+  // Returns nullptr when no prefix of `url` is kept or it expired.
+  std::shared_ptr<const std::string> Find(const std::string &url);
+  // Keeps `prefix` unless a longer prefix of `url` is kept.
+  void Insert(const std::string &url, std::string prefix);
+  // Drops the prefix of `url`, such as after a write changed it.
+  void Remove(const std::string &url);
+
+  Json::Value Metrics() const;
+
+private:
+  using Clock = std::chrono::steady_clock;
+  struct Entry final {
+    std::shared_ptr<const std::string> prefix;
+    Clock::time_point expires;
+  };
+  using Lru = std::list<std::pair<std::string, Entry>>;
+  void Erase(const Lru::iterator it);
+
+  const size_t max_bytes_;
+  const std::chrono::seconds ttl_;
+  mutable std::mutex mutex_;
+  Lru lru_; // Most recently used first.
+  std::unordered_map<std::string, Lru::iterator> entries_;
+  size_t bytes_;
+  size_t hits_;
+  size_t misses_;
+};
+
+} // namespace projection
+
+#endif
@@ -0,0 +1,89 @@
+#include "logger.h"
+#include "projection.h"
+
+static const std::string DOCUMENT = R"({
+  "id": 42,
+  "name": "order \"42\"",
+  "a/b": {"~x": true},
+  "items": [
+    {"name": "first", "tags": [[1, 2], ["x"]]},
+    {"name": "second", "qty": -1.5e3},
+    null
+  ],
+  "été": "summer",
+  "caf\u00e9": 1,
+  "none": [],
+  "last": {}
+})";
+
+// Extracts `pointer` from DOCUMENT fed whole, then one byte at a time.
+static projection::Extractor Extract(const std::vector<std::string> &pointer) {
+  projection::Extractor whole(pointer);
+  whole.Feed(DOCUMENT);
+  whole.Finish();
+  projection::Extractor bytes(pointer);
+  for (const char c : DOCUMENT) {
+    bytes.Feed(std::string_view(&c, 1));
+  }
+  bytes.Finish();
+  CHECK(whole.status() == bytes.status());
+  CHECK(whole.value() == bytes.value());
+  return whole;
+}
+
+int main(int argc, char *argv[]) {
+  CHECK(Extract({"id"}).value() == "42");
+  CHECK(Extract({"name"}).value() == R"("order \"42\"")");
+  CHECK(Extract({"items", "0", "name"}).value() == R"("first")");
+  CHECK(Extract({"items", "0", "tags"}).value() == R"([[1, 2], ["x"]])");
+  CHECK(Extract({"items", "0", "tags", "1", "0"}).value() == R"("x")");
+  CHECK(Extract({"items", "1"}).value() ==
+        R"({"name": "second", "qty": -1.5e3})");
+  CHECK(Extract({"items", "1", "qty"}).value() == "-1.5e3");
+  CHECK(Extract({"items", "2"}).value() == "null");
+  CHECK(Extract({"a/b", "~x"}).value() == "true");
+  CHECK(Extract({"\xc3\xa9t\xc3\xa9"}).value() == R"("summer")");
+  CHECK(Extract({"caf\xc3\xa9"}).value() == "1");
+  CHECK(Extract({"none"}).value() == "[]");
+  CHECK(Extract({"last"}).value() == "{}");
+  CHECK(Extract({}).value() == DOCUMENT);
+
+  CHECK(Extract({"nope"}).status() == projection::MISSING);
+  CHECK(Extract({"items", "3"}).status() == projection::MISSING);
+  CHECK(Extract({"items", "01"}).status() == projection::MISSING);
+  CHECK(Extract({"id", "x"}).status() == projection::MISSING);
+  CHECK(Extract({"none", "0"}).status() == projection::MISSING);
+  CHECK(Extract({"last", "x"}).status() == projection::MISSING);
+
+  // The scan stops once the value is complete.
+  projection::Extractor early({"id"});
+  CHECK(early.Feed(R"({"id": 7, "rest": )") == projection::FOUND);
+  CHECK(early.value() == "7");
+  projection::Extractor missing({"items", "1"});
+  CHECK(missing.Feed(R"({"items": [0], "rest": )") == projection::MISSING);
+
+  projection::Extractor number({});
+  CHECK(number.Feed("12") == projection::MORE);
+  CHECK(number.Finish() == projection::FOUND);
+  CHECK(number.value() == "12");
+
+  projection::Extractor truncated({"items"});
+  truncated.Feed(R"({"items": [1, 2)");
+  CHECK(truncated.Finish() == projection::INVALID);
+  projection::Extractor invalid({"id"});
+  CHECK(invalid.Feed("{id: 1}") == projection::INVALID);
+
+  CHECK(projection::EscapeToken("a/b~c") == "a~1b~0c");
+  CHECK(projection::UnescapeToken("a~1b~0c") == "a/b~c");
+  CHECK(projection::UnescapeToken("~01") == "~1");
+
+  projection::PrefixCache prefixes(1 << 10, std::chrono::seconds(60));
+  CHECK(prefixes.Find("u") == nullptr);
+  prefixes.Insert("u", "{\"a\":");
+  prefixes.Insert("u", "{");
+  CHECK(*prefixes.Find("u") == "{\"a\":");
+  projection::PrefixCache disabled(1 << 10, std::chrono::seconds(0));
+  disabled.Insert("u", "{");
+  CHECK(disabled.Find("u") == nullptr);
+  return 0;
+}
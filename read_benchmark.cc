@@ -0,0 +1,98 @@
+#include "cache.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// Compares the two ways a cached body reaches the kernel, as fuse does it
+// through a pipe on /dev/fuse:
+//
+// - copy: read copies the body into a buffer, which is written to the pipe.
+// - splice: read_buf hands out the sealed memfd, spliced into the pipe.
+//
+// The pipe is drained into /dev/null by splice in both cases, so the
+// difference is the copy in user space.
+//
+// Usage: read_benchmark [body MiB] [rounds]
+
+using Clock = std::chrono::steady_clock;
+
+// Bytes per read, as fuse requests them by default.
+constexpr size_t READ_SIZE = 128 << 10;
+
+static void Drain(const int pipe_out, const int null_fd, size_t bytes) {
+  while (bytes > 0) {
+    const ssize_t n =
+        splice(pipe_out, nullptr, null_fd, nullptr, bytes, SPLICE_F_MOVE);
+    CHECK_M(n > 0, "splice to /dev/null failed");
+    bytes -= n;
+  }
+}
+
+static void Copy(const cache::Body &body, const int pipe_in, const int pipe_out,
+                 const int null_fd) {
+  std::vector<char> buffer(READ_SIZE);
+  const std::string_view view = body.view();
+  for (size_t offset = 0; offset < view.size(); offset += READ_SIZE) {
+    const size_t length = std::min(READ_SIZE, view.size() - offset);
+    memcpy(buffer.data(), view.data() + offset, length);
+    size_t written = 0;
+    while (written < length) {
+      const ssize_t n =
+          write(pipe_in, buffer.data() + written, length - written);
+      CHECK_M(n > 0, "write to pipe failed");
+      written += n;
+    }
+    Drain(pipe_out, null_fd, length);
+  }
+}
+
+static void Splice(const cache::Body &body, const int pipe_in,
+                   const int pipe_out, const int null_fd) {
+  for (size_t offset = 0; offset < body.size(); offset += READ_SIZE) {
+    const size_t length = std::min(READ_SIZE, body.size() - offset);
+    loff_t pos = offset;
+    size_t spliced = 0;
+    while (spliced < length) {
+      const ssize_t n = splice(body.fd(), &pos, pipe_in, nullptr,
+                               length - spliced, SPLICE_F_MOVE);
+      CHECK_M(n > 0, "splice from memfd failed");
+      spliced += n;
+    }
+    Drain(pipe_out, null_fd, length);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  const size_t mib = (argc > 1) ? std::stoul(argv[1]) : 64;
+  const size_t rounds = (argc > 2) ? std::stoul(argv[2]) : 20;
+  const cache::Body body = cache::Body::Sealed(std::string(mib << 20, 'x'));
+  CHECK_M(body.fd() >= 0, "memfd is not available");
+
+  int pipe_fds[2];
+  CHECK_M(pipe(pipe_fds) == 0, "pipe failed");
+  // Fits a whole read, as /dev/fuse pipes are sized.
+  fcntl(pipe_fds[1], F_SETPIPE_SZ, READ_SIZE);
+  const int null_fd = open("/dev/null", O_WRONLY);
+  CHECK_M(null_fd >= 0, "Cannot open /dev/null");
+
+  auto measure = [&](void (*serve)(const cache::Body &, int, int, int)) {
+    const Clock::time_point start = Clock::now();
+    for (size_t round = 0; round < rounds; ++round) {
+      serve(body, pipe_fds[1], pipe_fds[0], null_fd);
+    }
+    const std::chrono::duration<double> time = Clock::now() - start;
+    return double(mib * rounds) / 1024 / time.count();
+  };
+  std::cout << "body MiB: " << mib << std::endl;
+  std::cout << "rounds: " << rounds << std::endl;
+  std::cout << "copy GiB/s: " << measure(Copy) << std::endl;
+  std::cout << "splice GiB/s: " << measure(Splice) << std::endl;
+  return 0;
+}
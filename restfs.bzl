@@ -0,0 +1,50 @@
+def compiled_spec(name, spec, spec_name = None):
+    """A library holding `spec` compiled by spec_compiler.
+
+    Linked into restfs, the spec is mounted with
+    --api_spec_addr=compiled:<spec_name>, without reading or parsing it.
+
+    Args:
+      name: Name of the cc_library.
+      spec: Label of the openapi.json to compile.
+      spec_name: Name the spec is mounted by. Defaults to `name`.
+    """
+    spec_name = spec_name or name
+    native.genrule(
+        name = name + "_cc",
+        srcs = [spec],
+        outs = [name + "_compiled_spec.cc"],
+        cmd = "$(location //:spec_compiler) $(location %s) %s $@" % (spec, spec_name),
+        tools = ["//:spec_compiler"],
+    )
+    native.cc_library(
+        name = name,
+        srcs = [name + "_compiled_spec.cc"],
+        deps = ["//:openapi"],
+        # Nothing refers to the spec: it registers itself when loaded.
+        alwayslink = True,
+    )
+
+def restfs_binary(name, specs, **kwargs):
+    """A restfs binary with `specs` compiled in.
+
+    Args:
+      name: Name of the cc_binary.
+      specs: Dictionary from the names the specs are mounted by, as in
+        --api_spec_addr=compiled:<name>, to the labels of their openapi.json.
+      **kwargs: Forwarded to the cc_binary.
+    """
+    libraries = []
+    for spec_name, spec in specs.items():
+        library = "%s_spec_%d" % (name, len(libraries))
+        compiled_spec(name = library, spec = spec, spec_name = spec_name)
+        libraries.append(":" + library)
+    native.cc_binary(
+        name = name,
+        linkopts = [
+            "-lpthread",
+            "-lfuse3",
+        ],
+        deps = ["//:restfs_lib"] + libraries,
+        **kwargs
+    )
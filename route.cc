@@ -0,0 +1,205 @@
+#include "route.h"
+
+#include <algorithm>
+#include <cctype>
+#include <iterator>
+
+namespace route {
+
+// Splits a "{bindings}suffix" segment, such as "{ref:value}suffix",
+// "{ref}suffix" or "{a:1,b:2}suffix". Returns false for literal segments.
+static bool ParseReference(const std::string_view segment,
+                           std::string_view *bindings,
+                           std::string_view *suffix) {
+  if (segment.empty() || segment[0] != '{') {
+    return false;
+  }
+  const size_t ref_end = segment.find('}');
+  if (ref_end == segment.npos) {
+    return false;
+  }
+  *bindings = segment.substr(1, ref_end - 1);
+  *suffix = segment.substr(ref_end + 1);
+  return true;
+}
+
+// Whether `given`, the references a segment binds, suit a child taking
+// `refs`: each of them once, and no others unless the child is a `file`,
+// whose other references are optional query parameters.
+static bool Suits(const std::vector<std::string> &refs, const bool file,
+                  const path::utils::Bindings &given) {
+  for (size_t idx = 0; idx < given.size(); ++idx) {
+    const std::string_view ref = given[idx].first;
+    if (ref.empty()) {
+      return false;
+    }
+    for (size_t other = 0; other < idx; ++other) {
+      if (given[other].first == ref) {
+        return false;
+      }
+    }
+  }
+  if (given.size() < refs.size() || (!file && given.size() > refs.size())) {
+    return false;
+  }
+  return std::all_of(refs.begin(), refs.end(), [&given](const auto &ref) {
+    return std::any_of(given.begin(), given.end(), [&ref](const auto &bound) {
+      return bound.first == ref;
+    });
+  });
+}
+
+// Names that shells, file managers and IDEs look up in every directory they
+// visit, compared ignoring case.
+static constexpr std::string_view PROBE_NAMES[] = {
+    "autorun.inf", "desktop.ini", "folder.jpg", "thumbs.db"};
+
+// Whether `value` is such a probe, or hidden, rather than the bare value of a
+// parameter. Those are only taken when spelled {ref:value}.
+static bool IsProbeName(const std::string_view value) {
+  if (value.empty() || value[0] == '.') {
+    return true;
+  }
+  return std::any_of(std::begin(PROBE_NAMES), std::end(PROBE_NAMES),
+                     [value](const std::string_view name) {
+                       return value.size() == name.size() &&
+                              std::equal(value.begin(), value.end(),
+                                         name.begin(), [](char a, char b) {
+                                           return std::tolower(
+                                                      (unsigned char)a) == b;
+                                         });
+                     });
+}
+
+Matcher::Matcher(const path::NodeTable &table) : table_(table) {
+  parameter_begins_.reserve(table.size() + 1);
+  for (path::NodeIndex idx = 0; idx < table.size(); ++idx) {
+    parameter_begins_.push_back(parameters_.size());
+    for (const path::Node child : table.node(idx).children()) {
+      std::string_view refs, suffix;
+      if (!ParseReference(child.name(), &refs, &suffix)) {
+        continue;
+      }
+      Parameter parameter{child.index(), {}, std::string(suffix),
+                          !child.is_directory()};
+      for (const auto &[ref, value] : path::utils::SplitBindings(refs)) {
+        parameter.refs.emplace_back(ref);
+      }
+      parameters_.push_back(std::move(parameter));
+    }
+  }
+  parameter_begins_.push_back(parameters_.size());
+}
+
+path::NodeIndex Matcher::MatchFrom(const path::NodeIndex node,
+                                   std::string_view rest, Bindings *bindings,
+                                   const std::vector<bool> *open) const {
+  if (open != nullptr && (*open)[node]) {
+    return node;
+  }
+  while (!rest.empty() && rest[0] == '/') {
+    rest.remove_prefix(1);
+  }
+  if (rest.empty()) {
+    return node;
+  }
+  const size_t part_end = std::min(rest.find('/'), rest.size());
+  const std::string_view part = rest.substr(0, part_end);
+  rest.remove_prefix(part_end);
+  const Parameter *const first = parameters_.data() + parameter_begins_[node];
+  const Parameter *const last =
+      parameters_.data() + parameter_begins_[node + 1];
+  const size_t bound = (bindings != nullptr) ? bindings->size() : 0;
+
+  std::string_view refs, suffix;
+  if (ParseReference(part, &refs, &suffix)) {
+    const path::utils::Bindings given = path::utils::SplitBindings(refs);
+    const auto match_from = [&](const path::NodeIndex child) {
+      if (bindings != nullptr) {
+        bindings->insert(bindings->end(), given.begin(), given.end());
+      }
+      const path::NodeIndex found = MatchFrom(child, rest, bindings, open);
+      if (found == path::NO_NODE && bindings != nullptr) {
+        bindings->resize(bound);
+      }
+      return found;
+    };
+    for (const Parameter *parameter = first; parameter != last; ++parameter) {
+      if (parameter->suffix != suffix ||
+          !Suits(parameter->refs, parameter->file, given)) {
+        continue;
+      }
+      if (const path::NodeIndex found = match_from(parameter->node);
+          found != path::NO_NODE) {
+        return found;
+      }
+    }
+    // Optional query parameters of an operation file that has no required
+    // ones: {limit:10}.get.json for get.json.
+    const path::NodeIndex file =
+        (suffix.size() > 1 && suffix[0] == '.')
+            ? table_.FindChild(node, suffix.substr(1))
+            : path::NO_NODE;
+    if (file != path::NO_NODE && !table_.node(file).is_directory() &&
+        Suits({}, true, given)) {
+      return match_from(file);
+    }
+    return path::NO_NODE;
+  }
+
+  const path::NodeIndex literal = table_.FindChild(node, part);
+  if (literal != path::NO_NODE) {
+    const path::NodeIndex found = MatchFrom(literal, rest, bindings, open);
+    if (found != path::NO_NODE) {
+      return found;
+    }
+  }
+  for (const Parameter *parameter = first; parameter != last; ++parameter) {
+    // Values of several references can't be told apart.
+    if (parameter->refs.size() != 1) {
+      continue;
+    }
+    const size_t value_length = part.length() - parameter->suffix.length();
+    if (part.length() <= parameter->suffix.length() ||
+        part.substr(value_length) != parameter->suffix ||
+        IsProbeName(part.substr(0, value_length))) {
+      continue;
+    }
+    if (bindings != nullptr) {
+      bindings->emplace_back(parameter->refs[0], part.substr(0, value_length));
+    }
+    const path::NodeIndex found =
+        MatchFrom(parameter->node, rest, bindings, open);
+    if (found != path::NO_NODE) {
+      return found;
+    }
+    if (bindings != nullptr) {
+      bindings->pop_back();
+    }
+  }
+  return path::NO_NODE;
+}
+
+path::NodeIndex Matcher::Match(const path::Path &path,
+                               path::RefValueMap *bindings) const {
+  const std::string &native = path.native();
+  if (table_.size() == 0 || native.empty() || native[0] != '/') {
+    return path::NO_NODE;
+  }
+  Bindings matched;
+  const path::NodeIndex found = MatchFrom(0, native, &matched, nullptr);
+  if (found != path::NO_NODE && bindings != nullptr) {
+    for (const auto &[ref, value] : matched) {
+      bindings->emplace(ref, value);
+    }
+  }
+  return found;
+}
+
+bool Matcher::MayMatch(const std::string_view path,
+                       const std::vector<bool> &open) const {
+  return table_.size() > 0 &&
+         MatchFrom(0, path, nullptr, &open) != path::NO_NODE;
+}
+
+} // namespace route
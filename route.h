@@ -0,0 +1,72 @@
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include "path.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace route {
+
+// Resolves paths against the templates of a NodeTable in one pass.
+//
+// Parameters may be spelled as concrete values (/orders/42/get.json) or as
+// bound references (/orders/{soid:42}/get.json). Literal children are tried
+// before parameters, backtracking when a literal leads nowhere, so that
+// /users/me/posts matches /users/{id}/posts when /users/me has no posts.
+// Hidden names such as .git, and names that desktops probe for such as
+// desktop.ini, are not taken as concrete values: they must be spelled
+// {id:.git}.
+//
+// Operation files taking query parameters are named after the required ones,
+// {q}.get.json or {a,b}.get.json, and bind them all in one segment:
+// {a:1,b:2}.get.json. Optional query parameters may be bound along with
+// them, or alone for files without required ones: {limit:10}.get.json
+// matches get.json.
+class Matcher final {
+public:
+  // Compiles the parameter segments of `table`, which must outlive it.
+  explicit Matcher(const path::NodeTable &table);
+  Matcher(const Matcher &) = delete;
+  Matcher &operator=(const Matcher &) = delete;
+
+  // Returns the template node matching `path`, or NO_NODE. The values of its
+  // parameters are set in `*bindings` when not null.
+  path::NodeIndex Match(const path::Path &path,
+                        path::RefValueMap *bindings = nullptr) const;
+  // Whether `path`, relative to the root of the table, may match one of its
+  // nodes, as Match tells without splitting `path` into strings or collecting
+  // the values of parameters. Any path below the nodes for which `open`,
+  // indexed by node, is true may exist.
+  bool MayMatch(std::string_view path, const std::vector<bool> &open) const;
+
+  const path::NodeTable &table() const { return table_; }
+
+private:
+  // A child named "{ref}suffix", or "{a,b}suffix" for several references.
+  struct Parameter final {
+    path::NodeIndex node;
+    std::vector<std::string> refs;
+    std::string suffix;
+    // Files take references other than `refs` too, as query parameters.
+    bool file;
+  };
+  using Bindings = path::utils::Bindings;
+
+  // Matches `rest`, what is left of the path below `node`. Bindings are not
+  // collected when `bindings` is null, and `open` may be null.
+  path::NodeIndex MatchFrom(const path::NodeIndex node, std::string_view rest,
+                            Bindings *bindings,
+                            const std::vector<bool> *open) const;
+
+  const path::NodeTable &table_;
+  // The parameters of node i are [parameter_begins_[i],
+  // parameter_begins_[i + 1]) of `parameters_`.
+  std::vector<uint32_t> parameter_begins_;
+  std::vector<Parameter> parameters_;
+};
+
+} // namespace route
+
+#endif
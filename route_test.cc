@@ -0,0 +1,69 @@
+#include "route.h"
+
+static path::NodeTable NewTable(const std::vector<std::string> &dirs) {
+  path::NodeTableBuilder builder;
+  for (const std::string &dir : dirs) {
+    CHECK(builder.Insert(dir, path::DirNode(path::Path(dir).filename(),
+                                            nullptr)));
+  }
+  return builder.Build();
+}
+
+int main(int argc, char *argv[]) {
+  const path::NodeTable table =
+      NewTable({"/users", "/users/me", "/users/me/settings", "/users/{id}",
+                "/users/{id}/posts", "/search", "/search/{q}.get.json"});
+  const route::Matcher matcher(table);
+
+  path::RefValueMap bindings;
+  CHECK(matcher.Match("/users/me/settings", &bindings) ==
+        table.Find("/users/me/settings"));
+  CHECK(bindings.empty());
+
+  // Literal first, then back to the parameter.
+  CHECK(matcher.Match("/users/me/posts", &bindings) ==
+        table.Find("/users/{id}/posts"));
+  CHECK(bindings["id"] == "me");
+
+  bindings.clear();
+  CHECK(matcher.Match("/users/{id:42}/posts", &bindings) ==
+        table.Find("/users/{id}/posts"));
+  CHECK(bindings["id"] == "42");
+
+  bindings.clear();
+  CHECK(matcher.Match("/search/shoes.get.json", &bindings) ==
+        table.Find("/search/{q}.get.json"));
+  CHECK(bindings["q"] == "shoes");
+
+  CHECK(matcher.Match("/users/{other:42}/posts") == path::NO_NODE);
+  CHECK(matcher.Match("/users/42/comments") == path::NO_NODE);
+  CHECK(matcher.Match("/search/.get.json") == path::NO_NODE);
+
+  // Query parameters, required ones named by the file.
+  path::NodeTableBuilder builder;
+  CHECK(builder.Insert("/items", path::DirNode("items", nullptr)));
+  for (const char *name : {"get.json", "{a,b}.post.json"}) {
+    CHECK(builder.Insert(std::string("/items/") + name,
+                         path::SimpleFileNode(name, nullptr, 0, {S_IREAD})));
+  }
+  const path::NodeTable files = builder.Build();
+  const route::Matcher query_matcher(files);
+  bindings.clear();
+  CHECK(query_matcher.Match("/items/{b:2,limit:10,a:1,2}.post.json",
+                            &bindings) == files.Find("/items/{a,b}.post.json"));
+  CHECK(bindings.size() == 3 && bindings["a"] == "1,2" &&
+        bindings["b"] == "2" && bindings["limit"] == "10");
+  bindings.clear();
+  CHECK(query_matcher.Match("/items/{limit:10}.get.json", &bindings) ==
+        files.Find("/items/get.json"));
+  CHECK(bindings["limit"] == "10");
+  for (const char *path :
+       {"/items/{a:1}.post.json", "/items/{a:1,a:2,b:3}.post.json",
+        "/items/1,2.post.json", "/items/{limit:10}.put.json"}) {
+    CHECK(query_matcher.Match(path) == path::NO_NODE);
+  }
+  // Directories take no more references than they name.
+  CHECK(matcher.Match("/users/{id:42,limit:10}/posts") == path::NO_NODE);
+  LOG(INFO) << "Success";
+  return 0;
+}
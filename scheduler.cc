@@ -0,0 +1,484 @@
+#include "scheduler.h"
+#include "logger.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
+#include <curl/curl.h>
+#include <vector>
+
+namespace scheduler {
+
+using FloatSeconds = std::chrono::duration<double>;
+
+static double ToMillis(const Clock::duration duration) {
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+std::string HostFromUrl(const std::string &url) {
+  const size_t scheme_end = url.find("://");
+  const size_t begin = (scheme_end == url.npos) ? 0 : scheme_end + 3;
+  const size_t end = url.find_first_of("/?#", begin);
+  return url.substr(begin, (end == url.npos) ? url.npos : end - begin);
+}
+
+std::optional<Clock::duration>
+LatencyHistory::Percentile(const double percentile) const {
+  const size_t count = std::min(count_, samples_.size());
+  if (count < MIN_SAMPLES) {
+    return std::nullopt;
+  }
+  std::vector<Clock::duration> samples(samples_.begin(),
+                                       samples_.begin() + count);
+  const auto nth =
+      samples.begin() + std::min(count - 1, size_t(percentile * count));
+  std::nth_element(samples.begin(), nth, samples.end());
+  return *nth;
+}
+
+Clock::time_point
+Scheduler::TokenBucket::Available(const Clock::time_point now) {
+  if (qps_ <= 0) {
+    return std::max(now, blocked_until_);
+  }
+  if (now > last_refill_) {
+    tokens_ = std::min(burst_, tokens_ + qps_ * FloatSeconds(now - last_refill_)
+                                                 .count());
+    last_refill_ = now;
+  }
+  const Clock::time_point ready =
+      (tokens_ >= 1) ? now
+                     : now + std::chrono::duration_cast<Clock::duration>(
+                                 FloatSeconds((1 - tokens_) / qps_));
+  return std::max(ready, blocked_until_);
+}
+
+void Scheduler::TokenBucket::BlockUntil(const Clock::time_point until) {
+  blocked_until_ = std::max(blocked_until_, until);
+  tokens_ = std::min(tokens_, 0.0);
+}
+
+Scheduler::~Scheduler() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this]() { return racers_ == 0; });
+}
+
+void Scheduler::Acquire(const Priority priority, const std::string &host,
+                        const std::string &endpoint) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  Host &host_state = hosts_.try_emplace(host, options_).first->second;
+  TokenBucket *endpoint_bucket =
+      (options_.endpoint_qps > 0)
+          ? &endpoint_buckets_
+                 .try_emplace(host + endpoint, options_.endpoint_qps,
+                              options_.endpoint_burst)
+                 .first->second
+          : nullptr;
+
+  ++host_state.waiting[priority];
+  ++metrics_[priority].queue_depth;
+  const Clock::time_point start = Clock::now();
+  while (true) {
+    const Clock::time_point now = Clock::now();
+    const bool behind_others =
+        std::any_of(host_state.waiting.begin(),
+                    host_state.waiting.begin() + priority,
+                    [](const size_t waiting) { return waiting > 0; });
+    if (behind_others) {
+      // Whoever is ahead wakes us up once it got its token.
+      cv_.wait(lock);
+      continue;
+    }
+    Clock::time_point available = host_state.bucket.Available(now);
+    if (endpoint_bucket != nullptr) {
+      available = std::max(available, endpoint_bucket->Available(now));
+    }
+    if (available <= now) {
+      break;
+    }
+    cv_.wait_until(lock, available);
+  }
+
+  host_state.bucket.Take();
+  if (endpoint_bucket != nullptr) {
+    endpoint_bucket->Take();
+  }
+  --host_state.waiting[priority];
+  ClassMetrics &metrics = metrics_[priority];
+  const Clock::duration wait = Clock::now() - start;
+  --metrics.queue_depth;
+  ++metrics.requests;
+  metrics.total_wait += wait;
+  metrics.max_wait = std::max(metrics.max_wait, wait);
+  lock.unlock();
+  cv_.notify_all();
+}
+
+void Scheduler::Throttle(const std::string &host,
+                         const http::Response &response, const int attempt) {
+  // Retry-After is either delay-seconds or an HTTP-date. Either is clamped in
+  // seconds: any number of digits may come in, and converting a large one to
+  // Clock::duration would overflow.
+  long long seconds = 1LL << std::min(attempt, 10);
+  const auto retry_after_it = response.headers.find("retry-after");
+  if (retry_after_it != response.headers.end()) {
+    const std::string &retry_after = retry_after_it->second;
+    if (!retry_after.empty() &&
+        std::all_of(retry_after.begin(), retry_after.end(), ::isdigit)) {
+      // Saturates at LLONG_MAX rather than throwing.
+      seconds = std::strtoll(retry_after.c_str(), nullptr, 10);
+    } else {
+      const time_t date = curl_getdate(retry_after.c_str(), nullptr);
+      if (date != -1) {
+        seconds = std::max<time_t>(0, date - time(nullptr));
+      }
+    }
+  }
+  const Clock::duration delay = std::chrono::seconds(
+      std::min<long long>(seconds, options_.max_retry_after.count()));
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  Host &host_state = hosts_.try_emplace(host, options_).first->second;
+  host_state.bucket.BlockUntil(Clock::now() + delay);
+  ++host_state.throttled;
+  LOG(WARNING) << "Throttled by " << host << " (Code " << response.http_code
+               << "), holding requests for " << ToMillis(delay) << "ms";
+}
+
+std::chrono::milliseconds Scheduler::Timeout(const Endpoint &endpoint) const {
+  const std::optional<Clock::duration> p99 = endpoint.latencies.Percentile(0.99);
+  if (!p99) {
+    return options_.max_timeout;
+  }
+  return std::clamp(std::chrono::duration_cast<std::chrono::milliseconds>(
+                        *p99 * options_.timeout_multiplier),
+                    options_.min_timeout, options_.max_timeout);
+}
+
+std::unique_ptr<http::Request>
+Scheduler::Attempt(const http::Request &request, const http::Headers &headers,
+                   const std::chrono::milliseconds timeout) const {
+  auto attempt = std::make_unique<http::Request>(request, headers);
+  attempt->set_timeout(timeout);
+  attempt->set_connection_pool(&connections_);
+  return attempt;
+}
+
+void Scheduler::RunCopy(std::shared_ptr<Race> race, const size_t copy,
+                        const std::string url, const bool traced) {
+  const trace::Adopt adopt(traced);
+  http::Response response = race->requests[copy]->fetch(url);
+  {
+    std::lock_guard<std::mutex> lock(race->mutex);
+    --race->pending;
+    // Transport failures only win when there is nothing else left to wait on,
+    // unless the caller cancelled.
+    const bool cancelled = response.curl_code == CURLE_ABORTED_BY_CALLBACK &&
+                           !race->abandoned[copy];
+    if (!race->winner &&
+        (response.curl_code == CURLE_OK || cancelled || race->pending == 0)) {
+      race->winner = std::move(response);
+      race->winner_copy = copy;
+      race->abandoned[1 - copy] = true;
+    }
+  }
+  race->cv.notify_all();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    --racers_;
+  }
+  cv_.notify_all();
+}
+
+http::Response Scheduler::Send(const std::string &host,
+                               const std::string &endpoint,
+                               const http::Request &request,
+                               const std::string &url) {
+  const std::string key = host + endpoint;
+  const rest::constants::OPERATIONS op = request.operation();
+  // Both copies of a hedged request would feed a body sink.
+  const bool hedgeable = options_.hedge_budget > 0 &&
+                         request.body_sink() == nullptr &&
+                         (op == rest::constants::GET ||
+                          op == rest::constants::HEAD);
+  std::chrono::milliseconds timeout;
+  std::optional<Clock::duration> hedge_delay;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Endpoint &stats = endpoints_[key];
+    timeout = Timeout(stats);
+    if (hedgeable) {
+      ++hedgeable_requests_;
+      hedge_delay = stats.latencies.Percentile(0.95);
+    }
+  }
+
+  const Clock::time_point start = Clock::now();
+  http::Response response;
+  bool hedged = false;
+  size_t winner_copy = 0;
+  if (!hedge_delay) {
+    response = Attempt(request, request.headers(), timeout)->fetch(url);
+  } else {
+    // The loser keeps running after Send returns, with the headers of the
+    // race, until it sees that it was abandoned. Only the first copy, sent
+    // from this thread, watches for the caller cancelling: the flag may be
+    // gone by the time the second one looks.
+    auto race = std::make_shared<Race>();
+    for (const std::string &line : request.headers().lines()) {
+      race->headers.AppendHeaderLine(line);
+    }
+    for (size_t copy = 0; copy < race->requests.size(); ++copy) {
+      race->requests[copy] = Attempt(request, race->headers, timeout);
+      race->requests[copy]->set_abandoned(&race->abandoned[copy]);
+    }
+    race->requests[1]->set_cancelled(nullptr);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      racers_ += 2;
+    }
+    race->pending = 1;
+    // The second copy goes out from the pool unless the first one answered
+    // by then. Most requests never need it, nor cost a thread.
+    hedgers_.RunAt(
+        start + *hedge_delay,
+        [this, race, host, endpoint, url, traced = trace::Active()]() {
+          bool send = false;
+          {
+            std::lock_guard<std::mutex> lock(race->mutex);
+            if (!race->winner && TryHedge(host, endpoint)) {
+              send = race->hedged = true;
+              ++race->pending;
+            }
+          }
+          if (send) {
+            LOG(INFO) << "Hedging " << url;
+            RunCopy(race, 1, url, traced);
+            return;
+          }
+          {
+            std::lock_guard<std::mutex> lock(mutex_);
+            --racers_;
+          }
+          cv_.notify_all();
+        });
+    RunCopy(race, 0, url, trace::Active());
+    std::unique_lock<std::mutex> race_lock(race->mutex);
+    race->cv.wait(race_lock, [&race]() { return race->winner.has_value(); });
+    hedged = race->hedged;
+    response = std::move(*race->winner);
+    winner_copy = race->winner_copy;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  Endpoint &stats = endpoints_[key];
+  if (response.curl_code == CURLE_OK) {
+    stats.latencies.Add(Clock::now() - start);
+  } else if (response.curl_code == CURLE_OPERATION_TIMEDOUT) {
+    // Let the history learn that the timeout was too tight.
+    ++stats.timeouts;
+    stats.latencies.Add(timeout);
+  }
+  if (hedged) {
+    ++stats.hedges;
+    stats.hedge_wins += winner_copy;
+  }
+  return response;
+}
+
+bool Scheduler::TryHedge(const std::string &host,
+                         const std::string &endpoint) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (hedges_ + 1 > options_.hedge_budget * hedgeable_requests_) {
+    return false;
+  }
+  // Hedges only use spare quota: they never wait for a token nor get ahead of
+  // queued requests.
+  Host &host_state = hosts_.try_emplace(host, options_).first->second;
+  if (std::any_of(host_state.waiting.begin(), host_state.waiting.end(),
+                  [](const size_t waiting) { return waiting > 0; })) {
+    return false;
+  }
+  const Clock::time_point now = Clock::now();
+  if (host_state.bucket.Available(now) > now) {
+    return false;
+  }
+  TokenBucket *endpoint_bucket = nullptr;
+  if (options_.endpoint_qps > 0) {
+    endpoint_bucket = &endpoint_buckets_
+                           .try_emplace(host + endpoint, options_.endpoint_qps,
+                                        options_.endpoint_burst)
+                           .first->second;
+    if (endpoint_bucket->Available(now) > now) {
+      return false;
+    }
+    endpoint_bucket->Take();
+  }
+  host_state.bucket.Take();
+  ++hedges_;
+  return true;
+}
+
+// Responses are copied for every GET that shares them.
+static http::Response CopyOf(const http::Response &response) {
+  http::Response copy;
+  copy.curl_code = response.curl_code;
+  copy.http_code = response.http_code;
+  copy.data << response.data.str();
+  copy.headers = response.headers;
+  copy.stopped = response.stopped;
+  return copy;
+}
+
+http::Response Scheduler::Fetch(const Priority priority,
+                                const std::string &endpoint,
+                                const http::Request &request,
+                                const std::string &url) {
+  // Bodies read through a sink are not kept, so they can't be shared.
+  if (request.operation() != rest::constants::GET ||
+      request.body_sink() != nullptr) {
+    return FetchAlone(priority, endpoint, request, url);
+  }
+  std::string key = http::NormalizeUrl(url);
+  for (const std::string &line : request.headers().lines()) {
+    key += '\n' + line;
+  }
+  // Null when another of a less urgent class is in flight.
+  std::shared_ptr<Flight> flight;
+  {
+    std::unique_lock<std::mutex> lock(flights_mutex_);
+    const auto it = flights_.find(key);
+    if (it == flights_.end()) {
+      flight = std::make_shared<Flight>();
+      flight->priority = priority;
+      flights_.emplace(key, flight);
+    } else if (it->second->priority <= priority) {
+      flight = it->second;
+      ++flight->waiting;
+      ++coalesced_;
+      const trace::Span span("coalesced", url);
+      flight->cv.wait(lock,
+                      [&flight]() { return flight->response.has_value(); });
+      return CopyOf(*flight->response);
+    }
+  }
+  http::Response response = FetchAlone(priority, endpoint, request, url);
+  if (flight != nullptr) {
+    std::lock_guard<std::mutex> lock(flights_mutex_);
+    flights_.erase(key);
+    if (flight->waiting > 0) {
+      flight->response = CopyOf(response);
+      flight->cv.notify_all();
+    }
+  }
+  return response;
+}
+
+http::Response Scheduler::FetchAlone(const Priority priority,
+                                     const std::string &endpoint,
+                                     const http::Request &request,
+                                     const std::string &url) {
+  const std::string host = HostFromUrl(url);
+  const rest::constants::OPERATIONS op = request.operation();
+  // HEAD may fail where GET succeeds, such as with 405.
+  const bool read = op == rest::constants::GET;
+  if (auto failure = breakers_.Check(host + endpoint, url, read)) {
+    LOG(INFO) << "Failing fast: " << url;
+    http::Response response;
+    response.curl_code = failure->curl_code;
+    response.http_code = failure->http_code;
+    response.data << failure->body;
+    return response;
+  }
+  http::Response response =
+      SendWithRetries(priority, host, endpoint, request, url);
+  breakers_.Record(host + endpoint, url, read, response);
+  return response;
+}
+
+http::Response Scheduler::SendWithRetries(const Priority priority,
+                                          const std::string &host,
+                                          const std::string &endpoint,
+                                          const http::Request &request,
+                                          const std::string &url) {
+  const rest::constants::OPERATIONS op = request.operation();
+  const bool idempotent = op == rest::constants::GET ||
+                          op == rest::constants::HEAD ||
+                          op == rest::constants::PUT ||
+                          op == rest::constants::DELETE;
+  for (int attempt = 0;; ++attempt) {
+    {
+      const trace::Span span("acquire", endpoint);
+      Acquire(priority, host, endpoint);
+    }
+    http::Response response;
+    {
+      const trace::Span span("send", url);
+      response = Send(host, endpoint, request, url);
+    }
+    // A 429 means the request was not processed, a 503 might have been.
+    const bool throttled = response.http_code == 429 ||
+                           (response.http_code == 503 && idempotent);
+    if (!throttled) {
+      return response;
+    }
+    Throttle(host, response, attempt);
+    if (attempt >= options_.max_retries) {
+      return response;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++metrics_[priority].retries;
+  }
+}
+
+Json::Value Scheduler::Metrics() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Json::Value metrics;
+  for (size_t priority = 0; priority < PRIORITY_COUNT; ++priority) {
+    const ClassMetrics &class_metrics = metrics_[priority];
+    Json::Value &value = metrics["classes"][PRIORITY_NAMES[priority]];
+    value["queue_depth"] = Json::UInt64(class_metrics.queue_depth);
+    value["requests"] = Json::UInt64(class_metrics.requests);
+    value["retries"] = Json::UInt64(class_metrics.retries);
+    value["total_wait_ms"] = ToMillis(class_metrics.total_wait);
+    value["mean_wait_ms"] =
+        (class_metrics.requests == 0)
+            ? 0
+            : ToMillis(class_metrics.total_wait) / class_metrics.requests;
+    value["max_wait_ms"] = ToMillis(class_metrics.max_wait);
+  }
+  for (const auto &[host, host_state] : hosts_) {
+    Json::Value &value = metrics["hosts"][host];
+    size_t waiting = 0;
+    for (const size_t class_waiting : host_state.waiting) {
+      waiting += class_waiting;
+    }
+    value["queue_depth"] = Json::UInt64(waiting);
+    value["throttled"] = Json::UInt64(host_state.throttled);
+  }
+  for (const auto &[key, endpoint] : endpoints_) {
+    Json::Value &value = metrics["endpoints"][key];
+    for (const auto &[name, percentile] :
+         {std::make_pair("p50_ms", 0.5), std::make_pair("p95_ms", 0.95),
+          std::make_pair("p99_ms", 0.99)}) {
+      const auto latency = endpoint.latencies.Percentile(percentile);
+      value[name] = latency ? Json::Value(ToMillis(*latency)) : Json::Value();
+    }
+    value["timeout_ms"] = Json::Int64(Timeout(endpoint).count());
+    value["timeouts"] = Json::UInt64(endpoint.timeouts);
+    value["hedges"] = Json::UInt64(endpoint.hedges);
+    value["hedge_wins"] = Json::UInt64(endpoint.hedge_wins);
+  }
+  metrics["hedging"]["budget"] = options_.hedge_budget;
+  metrics["hedging"]["hedgeable_requests"] = Json::UInt64(hedgeable_requests_);
+  metrics["hedging"]["hedges"] = Json::UInt64(hedges_);
+  metrics["breakers"] = breakers_.Metrics();
+  std::lock_guard<std::mutex> flights_lock(flights_mutex_);
+  metrics["coalescing"]["in_flight"] = Json::UInt64(flights_.size());
+  metrics["coalescing"]["coalesced"] = Json::UInt64(coalesced_);
+  return metrics;
+}
+
+} // namespace scheduler
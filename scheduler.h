@@ -0,0 +1,238 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "breaker.h"
+#include "http.h"
+#include "worker.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+namespace scheduler {
+
+using Clock = std::chrono::steady_clock;
+
+// Lower values are served first.
+enum Priority {
+  INTERACTIVE = 0, // Reads a user is waiting on.
+  REFRESH = 1,     // Keeping already loaded data fresh.
+  PREFETCH = 2,    // Speculative and warm-up traffic.
+};
+constexpr size_t PRIORITY_COUNT = PREFETCH + 1;
+const char *const PRIORITY_NAMES[] = {"interactive", "refresh", "prefetch"};
+
+struct Options final {
+  // Requests per second allowed for each host. 0 means unlimited.
+  double host_qps;
+  // Requests that may be issued at once after an idle period. 0 means qps.
+  double host_burst;
+  // Same as above, for each endpoint (path template) of a host.
+  double endpoint_qps;
+  double endpoint_burst;
+  // Retries of throttled (429) or unavailable (503) responses.
+  int max_retries;
+  // Upper bound for the delays asked through Retry-After.
+  std::chrono::seconds max_retry_after;
+  // Fraction of the requests that may be sent twice to cut tail latency. Only
+  // GET and HEAD are hedged. 0 disables hedging.
+  double hedge_budget;
+  // Threads sending the second copies of hedged requests. The first copy is
+  // sent from the thread of the request.
+  size_t hedge_parallelism;
+  // Requests time out after timeout_multiplier times the p99 latency of their
+  // endpoint, kept within [min_timeout, max_timeout]. Endpoints without
+  // enough history use max_timeout.
+  double timeout_multiplier;
+  std::chrono::milliseconds min_timeout;
+  std::chrono::milliseconds max_timeout;
+  // Circuit breakers of the endpoints and failed reads. See breaker.h.
+  breaker::Options breakers;
+};
+
+// Latencies of the last requests to an endpoint.
+class LatencyHistory final {
+public:
+  LatencyHistory() : samples_(), count_(0) {}
+  void Add(const Clock::duration latency) {
+    samples_[count_++ % samples_.size()] = latency;
+  }
+  // Returns std::nullopt until there are enough samples to tell.
+  std::optional<Clock::duration> Percentile(const double percentile) const;
+
+  static constexpr size_t MIN_SAMPLES = 20;
+
+private:
+  std::array<Clock::duration, 256> samples_;
+  size_t count_;
+};
+
+// Sits in front of the HTTP layer, shared by every mounted API along with its
+// connection pool: every request first takes a token from the bucket of its
+// host (and endpoint), waiting in line behind requests of more urgent
+// priority classes. Throttled responses block the whole host for as
+// long as the upstream asks for through Retry-After.
+//
+// Timeouts follow the latency history of each endpoint. Reads still running
+// past the p95 of their endpoint get a second copy sent from a small pool of
+// threads, within the hedge budget, and whichever answers first wins.
+//
+// GETs of a URL asked for while one with the same headers is in flight, the
+// URL spelled any way http::NormalizeUrl tells is the same, wait for its
+// response rather than sending another, as long as it is of the same
+// or a more urgent priority class: a read is never held up behind a
+// prefetch still waiting in line.
+class Scheduler final {
+public:
+  explicit Scheduler(const Options &options)
+      : options_(options), breakers_(options.breakers),
+        hedgeable_requests_(0), hedges_(0), racers_(0), coalesced_(0),
+        hedgers_(std::max<size_t>(options.hedge_parallelism, 1)) {}
+  Scheduler(const Scheduler &) = delete;
+  Scheduler &operator=(const Scheduler &) = delete;
+  // Waits for the losers of hedged requests to wind down.
+  ~Scheduler();
+
+  // `endpoint` identifies the path template `url` was built from, so that all
+  // values of a reference share one bucket. Requests to an endpoint whose
+  // circuit is open, and reads that failed moments ago, fail right away with
+  // the failure seen then.
+  http::Response Fetch(const Priority priority, const std::string &endpoint,
+                       const http::Request &request, const std::string &url);
+
+  Json::Value Metrics() const;
+
+private:
+  class TokenBucket final {
+  public:
+    TokenBucket(const double qps, const double burst)
+        : qps_(qps), burst_(burst > 0 ? burst : std::max(qps, 1.0)),
+          tokens_(burst_), last_refill_(Clock::now()),
+          blocked_until_(Clock::time_point::min()) {}
+
+    // When the next token will be available, `now` if there is one already.
+    Clock::time_point Available(const Clock::time_point now);
+    void Take() {
+      if (qps_ > 0) {
+        tokens_ -= 1;
+      }
+    }
+    void BlockUntil(const Clock::time_point until);
+
+  private:
+    const double qps_;
+    const double burst_;
+    double tokens_;
+    Clock::time_point last_refill_;
+    Clock::time_point blocked_until_;
+  };
+
+  struct Host {
+    Host(const Options &options)
+        : bucket(options.host_qps, options.host_burst), waiting({}),
+          throttled(0) {}
+    TokenBucket bucket;
+    std::array<size_t, PRIORITY_COUNT> waiting;
+    size_t throttled;
+  };
+
+  struct Endpoint {
+    LatencyHistory latencies;
+    size_t hedges;
+    size_t hedge_wins;
+    size_t timeouts;
+  };
+
+  // Copies of a hedged request in flight. The first to get a response wins
+  // and cancels the other.
+  struct Race {
+    // Copies of the headers of the request, which the copies may outlive.
+    http::Headers headers;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::array<std::unique_ptr<http::Request>, 2> requests;
+    // Set for the loser before the winner is handed back.
+    std::array<std::atomic<bool>, 2> abandoned{};
+    size_t pending = 0;
+    // Whether the second copy was sent.
+    bool hedged = false;
+    std::optional<http::Response> winner;
+    size_t winner_copy = 0;
+  };
+
+  // A GET in flight, whose response the same GETs asked for meanwhile share.
+  struct Flight final {
+    Priority priority;
+    size_t waiting = 0;
+    std::condition_variable cv;
+    std::optional<http::Response> response;
+  };
+
+  struct ClassMetrics {
+    size_t queue_depth;
+    size_t requests;
+    size_t retries;
+    Clock::duration total_wait;
+    Clock::duration max_wait;
+  };
+
+  // Fetch, sending `request` whatever else is in flight.
+  http::Response FetchAlone(const Priority priority,
+                            const std::string &endpoint,
+                            const http::Request &request,
+                            const std::string &url);
+  void Acquire(const Priority priority, const std::string &host,
+               const std::string &endpoint);
+  void Throttle(const std::string &host, const http::Response &response,
+                const int attempt);
+  std::chrono::milliseconds Timeout(const Endpoint &endpoint) const;
+  // Copy of `request` sent through the connection pool.
+  std::unique_ptr<http::Request>
+  Attempt(const http::Request &request, const http::Headers &headers,
+          const std::chrono::milliseconds timeout) const;
+  bool TryHedge(const std::string &host, const std::string &endpoint);
+  http::Response Send(const std::string &host, const std::string &endpoint,
+                      const http::Request &request, const std::string &url);
+  // Sends `request` until it is not throttled, or out of retries.
+  http::Response SendWithRetries(const Priority priority,
+                                 const std::string &host,
+                                 const std::string &endpoint,
+                                 const http::Request &request,
+                                 const std::string &url);
+  // `traced` tells whether the operation that sent the request is traced.
+  void RunCopy(std::shared_ptr<Race> race, const size_t copy,
+               const std::string url, const bool traced);
+
+  const Options options_;
+  const http::ConnectionPool connections_;
+  breaker::Breakers breakers_;
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::unordered_map<std::string, Host> hosts_;
+  std::unordered_map<std::string, TokenBucket> endpoint_buckets_;
+  std::unordered_map<std::string, Endpoint> endpoints_;
+  std::array<ClassMetrics, PRIORITY_COUNT> metrics_{};
+  size_t hedgeable_requests_;
+  size_t hedges_;
+  size_t racers_; // Copies of hedged requests running or yet to be sent.
+  mutable std::mutex flights_mutex_;
+  // By URL and header lines.
+  std::unordered_map<std::string, std::shared_ptr<Flight>> flights_;
+  size_t coalesced_; // GETs answered by another in flight.
+  // Last, so that its running tasks finish before anything else goes away.
+  worker::Pool hedgers_;
+};
+
+// Host part (with port) of `url`.
+std::string HostFromUrl(const std::string &url);
+
+} // namespace scheduler
+
+#endif
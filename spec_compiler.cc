@@ -0,0 +1,165 @@
+#include "logger.h"
+#include "openapi.h"
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Compiles an OpenAPI spec into a C++ source holding the node table restfs
+// would build from it, as constexpr arrays, with the data of every node
+// serialized as its metadata file reads it. Linked into restfs, the spec is
+// mounted through --api_spec_addr=compiled:<name> without being read or
+// parsed, and its table lives in .rodata, shared by every process mapping the
+// binary. See restfs.bzl.
+//
+// Usage: spec_compiler <openapi.json> <name> <output.cc>
+
+// Literals are split so that no line of the output gets too long.
+constexpr size_t LITERAL_LINE_CHARS = 96;
+
+// Writes `text` as adjacent string literals, escaping everything that is not
+// printable ASCII in octal.
+static void WriteLiteral(const std::string_view text, std::ostream &out) {
+  out << "\"";
+  size_t line_chars = 0;
+  for (const char c : text) {
+    if (line_chars >= LITERAL_LINE_CHARS) {
+      out << "\"\n    \"";
+      line_chars = 0;
+    }
+    const unsigned char u = static_cast<unsigned char>(c);
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+      line_chars += 2;
+    } else if (u >= 0x20 && u < 0x7F) {
+      out << c;
+      ++line_chars;
+    } else {
+      static const char DIGITS[] = "01234567";
+      out << '\\' << DIGITS[u >> 6] << DIGITS[(u >> 3) & 7] << DIGITS[u & 7];
+      line_chars += 4;
+    }
+  }
+  out << "\"";
+}
+
+template <typename T>
+static void WriteArray(const char *type, const char *name, const T *values,
+                       const size_t size, std::ostream &out) {
+  out << "constexpr " << type << " " << name << "[] = {";
+  for (size_t idx = 0; idx < size; ++idx) {
+    out << ((idx % 8 == 0) ? "\n    " : " ") << values[idx] << "u,";
+  }
+  out << "\n};\n\n";
+}
+
+static std::unique_ptr<const Json::Value> ReadSpec(const std::string &address) {
+  std::ifstream stream(address);
+  CHECK_M(stream.is_open(), "Failed to open " + address);
+  std::stringstream content;
+  content << stream.rdbuf();
+  auto spec = std::make_unique<Json::Value>();
+  Json::CharReaderBuilder builder;
+  std::string errors;
+  const std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+  const std::string text = content.str();
+  CHECK_M(reader->parse(text.data(), text.data() + text.size(), spec.get(),
+                        &errors),
+          "Failed to parse " + address + ": " + errors);
+  return spec;
+}
+
+int main(int argc, char *argv[]) {
+  CHECK_M(argc == 4, "Usage: spec_compiler <openapi.json> <name> <output.cc>");
+  const std::string spec_addr = argv[1];
+  const std::string name = argv[2];
+  const openapi::Directory directory =
+      openapi::NewDirectoryFromJsonValue("", ReadSpec(spec_addr));
+  const path::NodeTable &table = directory.table();
+  const path::NodeColumns &columns = table.columns();
+
+  // Nodes sharing data, such as operations and their metadata files, share
+  // its text.
+  std::map<const void *, size_t> text_of;
+  std::vector<std::string> texts;
+  std::vector<size_t> data_texts;
+  for (uint32_t idx = 0; idx < columns.data_size; ++idx) {
+    const void *data = columns.data[idx];
+    const auto [it, inserted] = text_of.emplace(data, texts.size());
+    if (inserted) {
+      texts.push_back(
+          openapi::MetadataText(*static_cast<const Json::Value *>(data)));
+    }
+    data_texts.push_back(it->second);
+  }
+
+  std::ostringstream out;
+  out << "// Generated by spec_compiler from " << spec_addr
+      << ". Do not edit.\n\n"
+      << "#include \"openapi.h\"\n\n"
+      << "namespace {\n\n";
+  WriteArray("uint32_t", "NAMES", columns.names, columns.size, out);
+  WriteArray("path::NodeIndex", "PARENTS", columns.parents, columns.size, out);
+  WriteArray("path::NodeIndex", "CHILD_BEGINS", columns.child_begins,
+             columns.size + 1, out);
+  WriteArray("uint64_t", "ATTRIBUTES", columns.attributes, columns.size, out);
+  WriteArray("uint32_t", "PAYLOADS", columns.payloads, columns.size, out);
+  WriteArray("uint32_t", "SEGMENT_OFFSETS", columns.segment_offsets,
+             columns.segments + 1, out);
+
+  out << "constexpr char SEGMENT_CHARS[] =\n    ";
+  WriteLiteral(std::string_view(columns.segment_chars,
+                                columns.segment_offsets[columns.segments]),
+               out);
+  out << ";\n\n";
+
+  // Arrays can't be empty.
+  if (!data_texts.empty()) {
+    out << "constexpr std::string_view TEXTS[] = {\n";
+    for (const std::string &text : texts) {
+      out << "    std::string_view(";
+      WriteLiteral(text, out);
+      out << ", " << text.size() << "),\n";
+    }
+    out << "};\n\n";
+
+    out << "constexpr const void *DATA[] = {";
+    for (size_t idx = 0; idx < data_texts.size(); ++idx) {
+      out << ((idx % 4 == 0) ? "\n    " : " ") << "&TEXTS[" << data_texts[idx]
+          << "],";
+    }
+    out << "\n};\n\n";
+  }
+
+  out << "constexpr openapi::CompiledSpec SPEC = {\n    ";
+  WriteLiteral(name, out);
+  out << ",\n"
+      << "    {\n"
+      << "        .size = " << columns.size << ",\n"
+      << "        .names = NAMES,\n"
+      << "        .parents = PARENTS,\n"
+      << "        .child_begins = CHILD_BEGINS,\n"
+      << "        .attributes = ATTRIBUTES,\n"
+      << "        .payloads = PAYLOADS,\n"
+      << "        .data_size = " << columns.data_size << ",\n"
+      << "        .data = " << (data_texts.empty() ? "nullptr" : "DATA")
+      << ",\n"
+      << "        .segments = " << columns.segments << ",\n"
+      << "        .segment_chars = SEGMENT_CHARS,\n"
+      << "        .segment_offsets = SEGMENT_OFFSETS,\n"
+      << "    },\n"
+      << "};\n\n"
+      << "const bool REGISTERED = openapi::RegisterCompiledSpec(&SPEC);\n\n"
+      << "} // namespace\n";
+
+  std::ofstream output(argv[3]);
+  CHECK_M(output.is_open(), std::string("Failed to open ") + argv[3]);
+  output << out.str();
+  CHECK_M(output.good(), std::string("Failed to write ") + argv[3]);
+  LOG(INFO) << "Compiled " << spec_addr << " into " << argv[3] << ": "
+            << columns.size << " nodes";
+  return 0;
+}
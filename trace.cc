@@ -0,0 +1,267 @@
+#include "trace.h"
+#include "logger.h"
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+namespace trace {
+
+// Buffers of exited threads kept for the next dump, such as hedged requests.
+constexpr size_t MAX_EXITED_BUFFERS = 64;
+
+struct Event final {
+  const char *name;
+  int64_t start;
+  int64_t duration;
+  std::string detail;
+};
+
+// The last events of a thread. Only that thread adds to it, so the lock is
+// contended only while dumping.
+class Buffer final {
+public:
+  Buffer(const size_t capacity, const int64_t tid)
+      : capacity_(std::max<size_t>(capacity, 1)), tid_(tid), next_(0) {}
+
+  void Add(Event event) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (events_.size() < capacity_) {
+      events_.push_back(std::move(event));
+      return;
+    }
+    events_[next_] = std::move(event);
+    next_ = (next_ + 1) % capacity_;
+  }
+
+  void AppendTo(const int64_t pid, Json::Value *events) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t idx = 0; idx < events_.size(); ++idx) {
+      const Event &event = events_[(next_ + idx) % events_.size()];
+      Json::Value value;
+      value["name"] = event.name;
+      value["cat"] = "restfs";
+      value["ph"] = "X";
+      value["ts"] = Json::Int64(event.start);
+      value["dur"] = Json::Int64(event.duration);
+      value["pid"] = Json::Int64(pid);
+      value["tid"] = Json::Int64(tid_);
+      if (!event.detail.empty()) {
+        value["args"]["detail"] = event.detail;
+      }
+      events->append(std::move(value));
+    }
+  }
+
+private:
+  const size_t capacity_;
+  const int64_t tid_;
+  mutable std::mutex mutex_;
+  std::vector<Event> events_;
+  size_t next_; // Oldest event once the buffer is full.
+};
+
+// Sampled fraction of operations, in units of 2^-32.
+static std::atomic<uint64_t> sample_threshold(0);
+static std::atomic<size_t> buffer_events(16384);
+
+static std::mutex registry_mutex;
+static std::list<std::shared_ptr<Buffer>> live_buffers;
+static std::deque<std::shared_ptr<Buffer>> exited_buffers;
+
+// Trivially destructible, so reading it costs no more than a load.
+struct ThreadContext final {
+  int depth;
+  bool sampled;
+  uint64_t random;
+};
+static thread_local ThreadContext context;
+
+// Registers the buffer of the thread on first use and retires it on exit.
+struct BufferHolder final {
+  std::shared_ptr<Buffer> buffer;
+
+  Buffer &Get() {
+    if (buffer == nullptr) {
+      buffer = std::make_shared<Buffer>(buffer_events.load(),
+                                        int64_t(syscall(SYS_gettid)));
+      std::lock_guard<std::mutex> lock(registry_mutex);
+      live_buffers.push_back(buffer);
+    }
+    return *buffer;
+  }
+
+  ~BufferHolder() {
+    if (buffer == nullptr) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    live_buffers.remove(buffer);
+    exited_buffers.push_back(std::move(buffer));
+    if (exited_buffers.size() > MAX_EXITED_BUFFERS) {
+      exited_buffers.pop_front();
+    }
+  }
+};
+static thread_local BufferHolder holder;
+
+// xorshift64*, seeded per thread.
+static uint32_t NextRandom() {
+  uint64_t &x = context.random;
+  if (x == 0) {
+    x = ((uint64_t(syscall(SYS_gettid)) * 0x9E3779B97F4A7C15ull) ^
+         uint64_t(NowMicros())) |
+        1;
+  }
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  return (x * 0x2545F4914F6CDD1Dull) >> 32;
+}
+
+void Configure(const double sample_rate, const size_t events) {
+  const double rate = std::min(std::max(sample_rate, 0.0), 1.0);
+  sample_threshold.store(uint64_t(rate * double(uint64_t(1) << 32)));
+  buffer_events.store(events);
+}
+
+int64_t NowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+bool Active() { return context.depth > 0 && context.sampled; }
+
+Span::Span(const char *name, const std::string_view detail)
+    : name_(name), counted_(false), recording_(false), start_(0) {
+  if (context.depth > 0) {
+    ++context.depth;
+  } else {
+    const uint64_t threshold =
+        sample_threshold.load(std::memory_order_relaxed);
+    if (threshold == 0) {
+      return;
+    }
+    context.depth = 1;
+    context.sampled = NextRandom() < threshold;
+  }
+  counted_ = true;
+  recording_ = context.sampled;
+  if (recording_) {
+    detail_ = detail;
+    start_ = NowMicros();
+  }
+}
+
+Span::~Span() {
+  if (!counted_) {
+    return;
+  }
+  if (recording_) {
+    holder.Get().Add({name_, start_, NowMicros() - start_, std::move(detail_)});
+  }
+  --context.depth;
+}
+
+void Record(const char *name, const int64_t start, const int64_t duration,
+            const std::string_view detail) {
+  if (Active()) {
+    holder.Get().Add({name, start, duration, std::string(detail)});
+  }
+}
+
+Adopt::Adopt(const bool active) : previous_(context.sampled) {
+  ++context.depth;
+  context.sampled = active;
+}
+
+Adopt::~Adopt() {
+  --context.depth;
+  context.sampled = previous_;
+}
+
+Json::Value ChromeTrace() {
+  std::vector<std::shared_ptr<Buffer>> buffers;
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    buffers.assign(exited_buffers.begin(), exited_buffers.end());
+    buffers.insert(buffers.end(), live_buffers.begin(), live_buffers.end());
+  }
+  Json::Value trace;
+  trace["displayTimeUnit"] = "ms";
+  Json::Value &events = trace["traceEvents"] = Json::Value(Json::arrayValue);
+  for (const auto &buffer : buffers) {
+    buffer->AppendTo(getpid(), &events);
+  }
+  return trace;
+}
+
+// Write end of the pipe of the SignalDumper, for the handler.
+static std::atomic<int> dump_fd(-1);
+
+static void OnDumpSignal(int) {
+  const int saved_errno = errno;
+  const int fd = dump_fd.load();
+  if (fd >= 0) {
+    [[maybe_unused]] const ssize_t ignored = write(fd, "d", 1);
+  }
+  errno = saved_errno;
+}
+
+SignalDumper::SignalDumper(const int signal, const std::string &path)
+    : signal_(signal), path_(path) {
+  CHECK_M(pipe2(wake_fds_, O_CLOEXEC) == 0, strerror(errno));
+  int expected = -1;
+  CHECK_M(dump_fd.compare_exchange_strong(expected, wake_fds_[1]),
+          "Only one SignalDumper at a time");
+  struct sigaction action = {};
+  action.sa_handler = OnDumpSignal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  CHECK_M(sigaction(signal_, &action, nullptr) == 0, strerror(errno));
+  thread_ = std::thread(&SignalDumper::Loop, this);
+}
+
+SignalDumper::~SignalDumper() {
+  std::signal(signal_, SIG_DFL);
+  dump_fd.store(-1);
+  CHECK(write(wake_fds_[1], "q", 1) == 1);
+  thread_.join();
+  close(wake_fds_[0]);
+  close(wake_fds_[1]);
+}
+
+void SignalDumper::Loop() {
+  char command;
+  while (true) {
+    const ssize_t n = read(wake_fds_[0], &command, 1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0 || command == 'q') {
+      return;
+    }
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    std::ofstream file(path_, std::ios::trunc);
+    file << Json::writeString(builder, ChromeTrace());
+    if (!file) {
+      LOG(WARNING) << "Failed to write the trace to " << path_;
+      continue;
+    }
+    LOG(INFO) << "Wrote the trace to " << path_;
+  }
+}
+
+} // namespace trace
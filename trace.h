@@ -0,0 +1,88 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdint>
+#include <json/json.h>
+#include <string>
+#include <string_view>
+#include <thread>
+
+// Spans of sampled file system operations and their phases, kept in
+// per-thread ring buffers and exported in the Chrome trace event format, which
+// chrome://tracing and Perfetto open.
+//
+// A span opened while no other is open on the thread starts an operation,
+// sampled at the configured rate; spans opened inside it are its phases and
+// are recorded only when it is sampled. Unsampled operations cost a couple of
+// thread-local accesses per span, and nothing is recorded while the rate is 0.
+namespace trace {
+
+// Samples a `sample_rate` fraction of operations, 0 disabling tracing, and
+// keeps the last `buffer_events` spans of every thread.
+void Configure(const double sample_rate, const size_t buffer_events);
+
+// Microseconds on a monotonic clock, the timestamps of spans.
+int64_t NowMicros();
+
+// Whether spans opened now on this thread are recorded.
+bool Active();
+
+class Span final {
+public:
+  // `name` must be a literal. `detail`, such as a path or URL, is only copied
+  // when the span is recorded.
+  explicit Span(const char *name, const std::string_view detail = {});
+  Span(const Span &) = delete;
+  Span &operator=(const Span &) = delete;
+  ~Span();
+
+private:
+  const char *const name_;
+  bool counted_;
+  bool recording_;
+  int64_t start_;
+  std::string detail_;
+};
+
+// Records a phase of the current operation measured by other means, such as
+// the timings curl reports. Does nothing when the operation is not sampled.
+void Record(const char *name, const int64_t start, const int64_t duration,
+            const std::string_view detail = {});
+
+// Makes spans opened on this thread part of an operation of another thread,
+// sampled when `active` was true there.
+class Adopt final {
+public:
+  explicit Adopt(const bool active);
+  Adopt(const Adopt &) = delete;
+  Adopt &operator=(const Adopt &) = delete;
+  ~Adopt();
+
+private:
+  const bool previous_;
+};
+
+// The spans of every thread, oldest first per thread.
+Json::Value ChromeTrace();
+
+// Writes ChromeTrace() to `path` whenever the process gets `signal`.
+class SignalDumper final {
+public:
+  SignalDumper(const int signal, const std::string &path);
+  SignalDumper(const SignalDumper &) = delete;
+  SignalDumper &operator=(const SignalDumper &) = delete;
+  ~SignalDumper();
+
+private:
+  void Loop();
+
+  const int signal_;
+  const std::string path_;
+  // The handler writes to wake_fds_[1] to wake up the thread.
+  int wake_fds_[2];
+  std::thread thread_;
+};
+
+} // namespace trace
+
+#endif
@@ -0,0 +1,56 @@
+#include "worker.h"
+#include "logger.h"
+
+namespace worker {
+
+Pool::Pool(const size_t threads) : stopped_(false), sequence_(0) {
+  CHECK(threads > 0);
+  threads_.reserve(threads);
+  for (size_t idx = 0; idx < threads; ++idx) {
+    threads_.emplace_back(&Pool::Loop, this);
+  }
+}
+
+Pool::~Pool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+  }
+  cv_.notify_all();
+  for (std::thread &thread : threads_) {
+    thread.join();
+  }
+}
+
+void Pool::RunAt(const Clock::time_point when, Task task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopped_) {
+      return;
+    }
+    queue_.push({when, sequence_++, std::move(task)});
+  }
+  cv_.notify_one();
+}
+
+void Pool::Loop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopped_) {
+    if (queue_.empty()) {
+      cv_.wait(lock);
+      continue;
+    }
+    const Clock::time_point when = queue_.top().when;
+    if (when > Clock::now()) {
+      cv_.wait_until(lock, when);
+      continue;
+    }
+    Task task = std::move(const_cast<Scheduled &>(queue_.top()).task);
+    queue_.pop();
+    lock.unlock();
+    task();
+    lock.lock();
+  }
+}
+
+} // namespace worker
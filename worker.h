@@ -0,0 +1,58 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace worker {
+
+using Clock = std::chrono::steady_clock;
+using Task = std::function<void()>;
+
+// Fixed set of threads running background work for all mounted APIs, so the
+// thread count does not grow with the number of APIs.
+class Pool final {
+public:
+  explicit Pool(const size_t threads);
+  Pool(const Pool &) = delete;
+  Pool &operator=(const Pool &) = delete;
+  // Drops pending tasks and waits for the running ones.
+  ~Pool();
+
+  void Run(Task task) { RunAt(Clock::now(), std::move(task)); }
+  void RunAt(const Clock::time_point when, Task task);
+
+  size_t size() const { return threads_.size(); }
+
+private:
+  struct Scheduled {
+    Clock::time_point when;
+    uint64_t sequence; // Keeps tasks due at the same time in FIFO order.
+    Task task;
+    bool operator>(const Scheduled &other) const {
+      return (when != other.when) ? when > other.when
+                                  : sequence > other.sequence;
+    }
+  };
+
+  void Loop();
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopped_;
+  uint64_t sequence_;
+  std::priority_queue<Scheduled, std::vector<Scheduled>,
+                      std::greater<Scheduled>>
+      queue_;
+  std::vector<std::thread> threads_;
+};
+
+} // namespace worker
+
+#endif
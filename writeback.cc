@@ -0,0 +1,340 @@
+#include "writeback.h"
+#include "logger.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+namespace writeback {
+
+// Failures listed by Metrics.
+constexpr size_t MAX_FAILURES = 64;
+// Of the response bodies kept as errors.
+constexpr size_t MAX_ERROR_BYTES = 256;
+constexpr char JOURNAL_SUFFIX[] = ".write";
+constexpr char FAILED_SUFFIX[] = ".failed";
+// Sequence numbers are written with as many digits, so that names sort in
+// the order the writes were queued.
+constexpr int SEQUENCE_DIGITS = 20;
+
+static bool WriteAll(const int fd, const std::string_view data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    const ssize_t n = write(fd, data.data() + written, data.size() - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    written += n;
+  }
+  return true;
+}
+
+static bool IsSuccess(const http::Response &response) {
+  return response.curl_code == CURLE_OK && response.http_code >= 200 &&
+         response.http_code < 400;
+}
+
+Queue::Queue(const Options &options, scheduler::Scheduler *scheduler,
+             HeadersOf headers_of)
+    : options_(options), scheduler_(scheduler),
+      headers_of_(std::move(headers_of)), stopped_(false), next_sequence_(1),
+      queued_(0), submitted_(0), sent_(0), failed_(0), recovered_(0) {
+  std::vector<Item> recovered = Recover();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (Item &item : recovered) {
+      next_sequence_ = std::max(next_sequence_, item.sequence + 1);
+      // Failures stay in the journal, and no handle waits for them.
+      forgotten_.insert(item.sequence);
+      Push(std::move(item));
+    }
+    recovered_ = recovered.size();
+  }
+  if (!recovered.empty()) {
+    LOG(INFO) << "Sending " << recovered.size() << " writes left in "
+              << options_.journal_dir;
+  }
+  for (size_t idx = 0; idx < std::max<size_t>(options_.parallelism, 1);
+       ++idx) {
+    threads_.emplace_back(&Queue::Run, this);
+  }
+}
+
+Queue::~Queue() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+  }
+  cv_.notify_all();
+  for (std::thread &thread : threads_) {
+    thread.join();
+  }
+}
+
+std::vector<Queue::Item> Queue::Recover() {
+  std::vector<Item> items;
+  if (options_.journal_dir.empty()) {
+    return items;
+  }
+  std::error_code error;
+  std::filesystem::create_directories(options_.journal_dir, error);
+  if (error) {
+    LOG(WARNING) << "Cannot create " << options_.journal_dir << ": "
+                 << error.message();
+    return items;
+  }
+  std::vector<std::filesystem::path> paths;
+  for (const auto &entry :
+       std::filesystem::directory_iterator(options_.journal_dir, error)) {
+    const std::string name = entry.path().filename().string();
+    // Ours are named after their sequence. Other files in the directory are
+    // not ours to read or remove.
+    if (name.length() < SEQUENCE_DIGITS + strlen(JOURNAL_SUFFIX) ||
+        name.find_first_not_of("0123456789") != SEQUENCE_DIGITS ||
+        name.compare(SEQUENCE_DIGITS, strlen(JOURNAL_SUFFIX),
+                     JOURNAL_SUFFIX) != 0) {
+      continue;
+    }
+    if (name.length() == SEQUENCE_DIGITS + strlen(JOURNAL_SUFFIX)) {
+      paths.push_back(entry.path());
+    } else if (name[SEQUENCE_DIGITS + strlen(JOURNAL_SUFFIX)] == '.') {
+      // Left by Journal for a write that did not complete.
+      std::filesystem::remove(entry.path(), error);
+    }
+  }
+  std::sort(paths.begin(), paths.end());
+  for (const std::filesystem::path &path : paths) {
+    std::ifstream stream(path, std::ios::binary);
+    // Operation, mount, endpoint and URL, separated by tabs, then the body.
+    std::string header, operation;
+    Item item;
+    if (std::getline(stream, header)) {
+      std::istringstream fields(header);
+      if (std::getline(fields, operation, '\t') &&
+          std::getline(fields, item.write.mount, '\t') &&
+          std::getline(fields, item.write.endpoint, '\t') &&
+          std::getline(fields, item.write.url)) {
+        std::ostringstream body;
+        body << stream.rdbuf();
+        item.write.body = body.str();
+      }
+    }
+    const auto &operations = rest::constants::operations_map();
+    const auto operation_it = operations.find(operation);
+    if (item.write.url.empty() || operation_it == operations.end()) {
+      LOG(WARNING) << "Ignoring " << path << ": not a write";
+      continue;
+    }
+    item.write.operation = operation_it->second;
+    item.sequence = std::strtoull(path.stem().c_str(), nullptr, 10);
+    item.journal_path = path.string();
+    items.push_back(std::move(item));
+  }
+  return items;
+}
+
+bool Queue::Journal(Item *item) const {
+  char name[SEQUENCE_DIGITS + sizeof(JOURNAL_SUFFIX)];
+  snprintf(name, sizeof(name), "%0*llu%s", SEQUENCE_DIGITS,
+           (unsigned long long)item->sequence, JOURNAL_SUFFIX);
+  const std::string path = options_.journal_dir + "/" + name;
+  // Renamed once complete, so that a crash never leaves a partial write.
+  std::string temp = path + ".XXXXXX";
+  const int fd = mkostemp(temp.data(), O_CLOEXEC);
+  if (fd < 0) {
+    LOG(WARNING) << "Cannot create " << temp << ": " << strerror(errno);
+    return false;
+  }
+  const Write &write = item->write;
+  const std::string header =
+      std::string(rest::constants::OPERATION_NAMES[write.operation]) + '\t' +
+      write.mount + '\t' + write.endpoint + '\t' + write.url + '\n';
+  bool written = WriteAll(fd, header) && WriteAll(fd, write.body) &&
+                 fdatasync(fd) == 0;
+  written = (close(fd) == 0) && written &&
+            rename(temp.c_str(), path.c_str()) == 0;
+  if (!written) {
+    LOG(WARNING) << "Cannot write " << path << ": " << strerror(errno);
+    unlink(temp.c_str());
+    return false;
+  }
+  item->journal_path = path;
+  return true;
+}
+
+void Queue::Push(Item item) {
+  std::deque<Item> &items = by_url_[item.write.url];
+  if (items.empty()) {
+    ready_.push_back(item.write.url);
+  }
+  pending_.insert(item.sequence);
+  items.push_back(std::move(item));
+  ++queued_;
+}
+
+int Queue::Submit(Write write, Sent sent, uint64_t *sequence) {
+  const trace::Span span("write_behind", write.url);
+  Item item{0, std::move(write), std::move(sent), ""};
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this]() { return queued_ < options_.max_queued; });
+  item.sequence = next_sequence_++;
+  if (!options_.journal_dir.empty()) {
+    // Written outside the lock: the threads need it to make room.
+    lock.unlock();
+    const bool journaled = Journal(&item);
+    lock.lock();
+    if (!journaled) {
+      return -EIO;
+    }
+  }
+  *sequence = item.sequence;
+  ++submitted_;
+  Push(std::move(item));
+  lock.unlock();
+  cv_.notify_all();
+  return 0;
+}
+
+int Queue::Wait(const uint64_t sequence) {
+  const trace::Span span("write_wait");
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this, sequence]() { return pending_.count(sequence) == 0; });
+  const auto it = errors_.find(sequence);
+  if (it == errors_.end()) {
+    return 0;
+  }
+  const int error = it->second;
+  errors_.erase(it);
+  return error;
+}
+
+void Queue::Forget(const uint64_t sequence) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (pending_.count(sequence) != 0) {
+    forgotten_.insert(sequence);
+  } else {
+    errors_.erase(sequence);
+  }
+}
+
+void Queue::Drain() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this]() { return queued_ == 0; });
+}
+
+void Queue::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this]() {
+      return !ready_.empty() || (stopped_ && queued_ == 0);
+    });
+    if (ready_.empty()) {
+      return;
+    }
+    const std::string url = std::move(ready_.front());
+    ready_.pop_front();
+    // Later writes to `url` wait until this one is answered.
+    const Item &item = by_url_.at(url).front();
+    lock.unlock();
+    Send(item);
+    lock.lock();
+    std::deque<Item> &items = by_url_.at(url);
+    pending_.erase(items.front().sequence);
+    if (forgotten_.erase(items.front().sequence) != 0) {
+      errors_.erase(items.front().sequence);
+    }
+    items.pop_front();
+    --queued_;
+    if (items.empty()) {
+      by_url_.erase(url);
+    } else {
+      ready_.push_back(url);
+    }
+    cv_.notify_all();
+  }
+}
+
+void Queue::Send(const Item &item) {
+  const trace::Span span("write", item.write.url);
+  http::Response response;
+  const http::Headers *headers = headers_of_(item.write.mount);
+  if (headers != nullptr) {
+    http::Request request(item.write.operation, *headers);
+    request.set_body(item.write.body);
+    response = scheduler_->Fetch(scheduler::INTERACTIVE, item.write.endpoint,
+                                 request, item.write.url);
+  }
+  if (headers != nullptr && IsSuccess(response)) {
+    if (!item.journal_path.empty()) {
+      unlink(item.journal_path.c_str());
+    }
+    if (item.sent) {
+      item.sent();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++sent_;
+    return;
+  }
+
+  Failure failure{item.write.url, item.write.operation, response.http_code,
+                  ""};
+  int code = ENOENT;
+  if (headers == nullptr) {
+    failure.error = "No mount named \"" + item.write.mount + "\"";
+  } else {
+    failure.error = (response.curl_code != CURLE_OK)
+                        ? curl_easy_strerror(response.curl_code)
+                        : response.data.str().substr(0, MAX_ERROR_BYTES);
+    const int errno_of = http::ErrnoOf(response);
+    code = (errno_of != 0) ? errno_of : EIO;
+  }
+  LOG(WARNING) << "Failed writing " << item.write.url << ": " << failure.error;
+  if (!item.journal_path.empty()) {
+    const std::string failed_path =
+        item.journal_path.substr(0, item.journal_path.size() -
+                                        strlen(JOURNAL_SUFFIX)) +
+        FAILED_SUFFIX;
+    rename(item.journal_path.c_str(), failed_path.c_str());
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++failed_;
+  errors_[item.sequence] = -code;
+  failures_.push_back(std::move(failure));
+  while (failures_.size() > MAX_FAILURES) {
+    failures_.pop_front();
+  }
+}
+
+Json::Value Queue::Metrics() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Json::Value metrics;
+  metrics["max_queued"] = Json::UInt64(options_.max_queued);
+  metrics["journal_dir"] = options_.journal_dir;
+  metrics["queued"] = Json::UInt64(queued_);
+  metrics["submitted"] = Json::UInt64(submitted_);
+  metrics["recovered"] = Json::UInt64(recovered_);
+  metrics["sent"] = Json::UInt64(sent_);
+  metrics["failed"] = Json::UInt64(failed_);
+  Json::Value &failures = metrics["failures"];
+  failures = Json::arrayValue;
+  for (const Failure &failure : failures_) {
+    Json::Value value;
+    value["url"] = failure.url;
+    value["operation"] = rest::constants::OPERATION_NAMES[failure.operation];
+    value["status"] = failure.http_code;
+    value["error"] = failure.error;
+    failures.append(value);
+  }
+  return metrics;
+}
+
+} // namespace writeback
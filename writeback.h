@@ -0,0 +1,141 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include "http.h"
+#include "rest.h"
+#include "scheduler.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <json/json.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+// Sends the bodies written to operation files after close returned.
+//
+// Scripts that write many small resources, one `echo > post.json` per item,
+// otherwise wait a round trip per file. With write-behind, flushing a file
+// hands its body to a bounded queue and returns. Threads of the queue send
+// the writes, one at a time per URL and in the order they were queued, and
+// fsync waits until the writes of its file were answered. Failures are
+// returned by fsync and listed by /.restfs/writes.json.
+//
+// With a journal directory, every write is stored there before flush returns
+// and removed once answered, so that writes left when restfs stops are sent
+// when it starts again. Writes that failed stay there as *.failed.
+namespace writeback {
+
+struct Options final {
+  // Writes queued or in flight at most. Submitting more waits for room.
+  size_t max_queued;
+  // Writes in flight at most, each to a different URL.
+  size_t parallelism;
+  // Empty keeps the queue in memory only.
+  std::string journal_dir;
+};
+
+struct Write final {
+  // Name of the mount, whose headers the write is sent with.
+  std::string mount;
+  std::string url;
+  // Path template of `url`, as the scheduler groups requests.
+  std::string endpoint;
+  rest::constants::OPERATIONS operation;
+  std::string body;
+};
+
+class Queue final {
+public:
+  // Runs on a thread of the queue once a write succeeded.
+  using Sent = std::function<void()>;
+  // Returns the headers of the mount named `mount`, nullptr when there is
+  // none. Called from the threads of the queue.
+  using HeadersOf = std::function<const http::Headers *(const std::string &)>;
+
+  // Queues the writes a previous run left in the journal. The headers
+  // `headers_of` returns must outlive the queue.
+  Queue(const Options &options, scheduler::Scheduler *scheduler,
+        HeadersOf headers_of);
+  Queue(const Queue &) = delete;
+  Queue &operator=(const Queue &) = delete;
+  // Sends what is left in the queue before returning.
+  ~Queue();
+
+  // Queues `write`, once journaled, and sets `*sequence` to the number Wait
+  // takes. Returns 0, or the negated errno when the journal can't be
+  // written.
+  int Submit(Write write, Sent sent, uint64_t *sequence);
+
+  // Waits until the write numbered `sequence` was answered. Returns 0 or the
+  // negated errno it failed with, which is dropped once returned.
+  int Wait(const uint64_t sequence);
+  // Drops the error of the write numbered `sequence`, which no one waits for
+  // any longer, such as when its handle is released.
+  void Forget(const uint64_t sequence);
+  // Waits until every write queued was answered.
+  void Drain();
+
+  Json::Value Metrics() const;
+
+private:
+  struct Item final {
+    uint64_t sequence;
+    Write write;
+    Sent sent;
+    // Empty without a journal.
+    std::string journal_path;
+  };
+  struct Failure final {
+    std::string url;
+    rest::constants::OPERATIONS operation;
+    int http_code;
+    std::string error;
+  };
+
+  // Queues `item`. Must hold `mutex_`.
+  void Push(Item item);
+  void Run();
+  void Send(const Item &item);
+  // Reads the writes left in the journal, oldest first.
+  std::vector<Item> Recover();
+  // Returns false when `item` could not be stored.
+  bool Journal(Item *item) const;
+
+  const Options options_;
+  scheduler::Scheduler *const scheduler_;
+  const HeadersOf headers_of_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopped_;
+  uint64_t next_sequence_;
+  // Writes of every URL, the first one in flight when the URL is not in
+  // `ready_`.
+  std::map<std::string, std::deque<Item>> by_url_;
+  // URLs with writes queued and none in flight, oldest first.
+  std::deque<std::string> ready_;
+  size_t queued_;
+  // Writes submitted and not answered yet.
+  std::unordered_set<uint64_t> pending_;
+  // Negated errnos of the writes that failed, by sequence, until waited for
+  // or forgotten.
+  std::map<uint64_t, int> errors_;
+  // Writes pending whose errors no one waits for.
+  std::unordered_set<uint64_t> forgotten_;
+  std::deque<Failure> failures_; // Newest last.
+  size_t submitted_;
+  size_t sent_;
+  size_t failed_;
+  size_t recovered_;
+  std::vector<std::thread> threads_;
+};
+
+} // namespace writeback
+
+#endif